@@ -0,0 +1,80 @@
+#include "bench.h"
+
+#include <osm/utils.h>
+#include <stdlib.h>
+
+/// Allocations made and then freed together, like the parts of a request
+#define BENCH_ALLOCS 64
+
+void bench_alloc_heap(void *state, unsigned int n)
+{
+	void *ptrs[BENCH_ALLOCS];
+	for (unsigned int i = 0; i < n; i++)
+	{
+		for (unsigned int j = 0; j < BENCH_ALLOCS; j++)
+			ptrs[j] = osm_alloc(NULL, 32);
+		bench_keep(ptrs);
+		for (unsigned int j = 0; j < BENCH_ALLOCS; j++)
+			osm_free(NULL, ptrs[j]);
+	}
+}
+
+void *bench_alloc_arena_setup(void)
+{
+	OSMArena *arena = malloc(sizeof(OSMArena));
+	osm_arena_init(arena, 0);
+	return arena;
+}
+
+void bench_alloc_arena_teardown(void *state)
+{
+	osm_arena_end(state);
+	free(state);
+}
+
+void bench_alloc_arena(void *state, unsigned int n)
+{
+	OSMArena *arena = state;
+	void *ptrs[BENCH_ALLOCS];
+	for (unsigned int i = 0; i < n; i++)
+	{
+		for (unsigned int j = 0; j < BENCH_ALLOCS; j++)
+			ptrs[j] = osm_alloc(&arena->allocator, 32);
+		bench_keep(ptrs);
+		osm_arena_reset(arena);
+	}
+}
+
+void *bench_alloc_pool_setup(void)
+{
+	OSMFixedPool *pool = malloc(sizeof(OSMFixedPool));
+	osm_fixed_pool_init(pool, 32, 0);
+	return pool;
+}
+
+void bench_alloc_pool_teardown(void *state)
+{
+	osm_fixed_pool_end(state);
+	free(state);
+}
+
+void bench_alloc_pool(void *state, unsigned int n)
+{
+	OSMFixedPool *pool = state;
+	void *ptrs[BENCH_ALLOCS];
+	for (unsigned int i = 0; i < n; i++)
+	{
+		for (unsigned int j = 0; j < BENCH_ALLOCS; j++)
+			ptrs[j] = osm_alloc(&pool->allocator, 32);
+		bench_keep(ptrs);
+		for (unsigned int j = 0; j < BENCH_ALLOCS; j++)
+			osm_free(&pool->allocator, ptrs[j]);
+	}
+}
+
+const BenchCase bench_alloc_cases[] = {
+	{ "alloc_heap_64x32", bench_alloc_heap },
+	{ "alloc_arena_64x32", bench_alloc_arena, bench_alloc_arena_setup, bench_alloc_arena_teardown },
+	{ "alloc_pool_64x32", bench_alloc_pool, bench_alloc_pool_setup, bench_alloc_pool_teardown },
+	{ NULL },
+};
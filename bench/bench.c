@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// Default number of samples per case
+#define BENCH_SAMPLES 200
+/// Shortest time a calibrated sample should take
+#define BENCH_SAMPLE_NS 50000
+/// Time spent warming up each case
+#define BENCH_WARMUP_NS 20000000
+
+static const BenchCase *const BENCH_GROUPS[] = {
+	bench_vector_cases,
+	bench_types_cases,
+	bench_frames_cases,
+	bench_socket_cases,
+	bench_network_cases,
+	bench_metrics_cases,
+	bench_alloc_cases,
+	bench_ring_cases,
+};
+
+/// CPUs the process may run on before the cases are pinned to one of them
+static cpu_set_t bench_cpus;
+static int bench_cpu = -1;
+
+int bench_other_cpu(void)
+{
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (cpu != bench_cpu && CPU_ISSET(cpu, &bench_cpus))
+			return cpu;
+	}
+	return -1;
+}
+
+uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Get a percentile of sorted samples, interpolating between neighbours
+ */
+double bench_percentile(const double *sorted, unsigned int count, double p)
+{
+	double rank = p / 100 * (count - 1);
+	unsigned int lo = floor(rank);
+	unsigned int hi = lo + 1 < count ? lo + 1 : lo;
+	return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+/**
+ * Time one batch of a case
+ * return - nanoseconds taken
+ */
+uint64_t bench_time(const BenchCase *c, void *state, unsigned int n)
+{
+	uint64_t start = bench_now();
+	c->run(state, n);
+	return bench_now() - start;
+}
+
+/**
+ * Run a case and print its results
+ * return - 0 on success, -1 if it couldn't be run
+ */
+int bench_case(const BenchCase *c, unsigned int samples)
+{
+	void *state = c->setup ? c->setup() : NULL;
+	if (c->setup && state == NULL)
+	{
+		fprintf(stderr, "%s: setup failed: %s\n", c->name, strerror(errno));
+		return -1;
+	}
+
+	// Double the batch until a sample is long enough to time
+	unsigned int batch = c->batch;
+	if (batch == 0)
+	{
+		batch = 1;
+		while (batch < (1u << 24) && bench_time(c, state, batch) < BENCH_SAMPLE_NS)
+			batch *= 2;
+	}
+
+	uint64_t warm_until = bench_now() + BENCH_WARMUP_NS;
+	while (bench_now() < warm_until)
+		c->run(state, batch);
+
+	double *ns = malloc(sizeof(double) * samples);
+	if (ns == NULL)
+	{
+		fprintf(stderr, "%s: out of memory for samples\n", c->name);
+		if (c->teardown)
+			c->teardown(state);
+		return -1;
+	}
+
+	double total = 0;
+	for (unsigned int i = 0; i < samples; i++)
+	{
+		ns[i] = (double) bench_time(c, state, batch) / batch;
+		total += ns[i];
+	}
+
+	if (c->teardown)
+		c->teardown(state);
+
+	qsort(ns, samples, sizeof(double), bench_compare);
+	double mean = total / samples;
+	double var = 0;
+	for (unsigned int i = 0; i < samples; i++)
+		var += (ns[i] - mean) * (ns[i] - mean);
+	double stddev = samples > 1 ? sqrt(var / (samples - 1)) : 0;
+	double p50 = bench_percentile(ns, samples, 50);
+
+	printf("{\"bench\":\"%s\",\"samples\":%u,\"batch\":%u,\"ns_per_op\":{"
+		"\"min\":%.2f,\"mean\":%.2f,\"stddev\":%.2f,\"p50\":%.2f,\"p90\":%.2f,"
+		"\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f},\"ops_per_sec\":%.0f}\n",
+		c->name, samples, batch,
+		ns[0], mean, stddev, p50,
+		bench_percentile(ns, samples, 90),
+		bench_percentile(ns, samples, 99),
+		bench_percentile(ns, samples, 99.9),
+		ns[samples - 1], p50 > 0 ? 1e9 / p50 : 0);
+	fflush(stdout);
+
+	free(ns);
+	return 0;
+}
+
+void bench_usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n samples] [-l] [filter...]\n"
+		"  -n samples  samples per case (default %d)\n"
+		"  -l          list the cases\n"
+		"  filter      only run cases whose name contains one of these\n",
+		name, BENCH_SAMPLES);
+}
+
+bool bench_selected(const char *name, char **filters, int count)
+{
+	if (count == 0)
+		return true;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (strstr(name, filters[i]) != NULL)
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int samples = BENCH_SAMPLES;
+	bool list = false;
+	int first = 1;
+
+	for (; first < argc && argv[first][0] == '-'; first++)
+	{
+		if (strcmp(argv[first], "-n") == 0 && first + 1 < argc)
+		{
+			samples = strtoul(argv[++first], NULL, 10);
+		}
+		else if (strcmp(argv[first], "-l") == 0)
+		{
+			list = true;
+		}
+		else
+		{
+			bench_usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (samples == 0)
+	{
+		bench_usage(argv[0]);
+		return 2;
+	}
+
+	// Stay on one CPU so samples aren't skewed by migrations
+	if (sched_getaffinity(0, sizeof(bench_cpus), &bench_cpus) != 0)
+		CPU_ZERO(&bench_cpus);
+	bench_cpu = sched_getcpu();
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(bench_cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	int failed = 0;
+	for (size_t g = 0; g < sizeof(BENCH_GROUPS) / sizeof(BENCH_GROUPS[0]); g++)
+	{
+		for (const BenchCase *c = BENCH_GROUPS[g]; c->name != NULL; c++)
+		{
+			if (!bench_selected(c->name, argv + first, argc - first))
+				continue;
+
+			if (list)
+				printf("%s\n", c->name);
+			else if (bench_case(c, samples) != 0)
+				failed = 1;
+		}
+	}
+
+	return failed;
+}
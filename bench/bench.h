@@ -0,0 +1,61 @@
+#ifndef OSM_BENCH_H
+#define OSM_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Microbenchmark harness.
+ *
+ * Every case runs its operation in batches and times each batch as one
+ * sample.  The batch size is calibrated so a sample takes long enough to
+ * time accurately, then a fixed number of samples are taken after a warm
+ * up, and the distribution of the time per operation is printed as one
+ * JSON object per line.
+ */
+
+/**
+ * Run n operations of a case
+ * state - from the case's setup
+ */
+typedef void (*BenchRun)(void *state, unsigned int n);
+
+/**
+ * A benchmark case
+ */
+typedef struct {
+	const char *name;
+	BenchRun run;
+	void *(*setup)(void);        // may be NULL
+	void (*teardown)(void *state);  // may be NULL
+	unsigned int batch;          // operations per sample, 0 to calibrate
+} BenchCase;
+
+/*
+ * Cases of each file, ended by one with a NULL name
+ */
+extern const BenchCase bench_vector_cases[];
+extern const BenchCase bench_types_cases[];
+extern const BenchCase bench_frames_cases[];
+extern const BenchCase bench_socket_cases[];
+extern const BenchCase bench_network_cases[];
+extern const BenchCase bench_metrics_cases[];
+extern const BenchCase bench_alloc_cases[];
+extern const BenchCase bench_ring_cases[];
+
+/**
+ * Get a CPU other than the one the cases run on, for threads serving the
+ * other end of a case
+ * return - the CPU, or -1 if the process may only run on one
+ */
+int bench_other_cpu(void);
+
+/**
+ * Keep the compiler from optimizing a result away
+ */
+static inline void bench_keep(const void *p)
+{
+	__asm__ volatile("" : : "g"(p) : "memory");
+}
+
+#endif
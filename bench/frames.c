@@ -0,0 +1,201 @@
+#include "bench.h"
+
+#include <osm/auth.h>
+#include <osm/codec.h>
+#include <osm/compact.h>
+#include <osm/framer.h>
+#include <osm/protocol.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Controls in the SET frames used by each case
+#define BENCH_CONTROLS 4
+
+typedef struct {
+	OSMFrameHeader header;
+	uint8_t frame[OSM_WIRE_FRAME_HEADER + OSM_WIRE_SUB_MAX + BENCH_CONTROLS * OSM_WIRE_CONTROL];
+	size_t len;
+
+	OSMFramer framer;
+	OSMCompactState enc, dec;
+	uint8_t samples[1024 * OSM_COMPACT_VALUE_MAX];
+	uint64_t values[1024];
+
+	OSMAuth auth;
+	OSMAuthSession session;
+} BenchFrames;
+
+void *bench_frames_setup(void)
+{
+	BenchFrames *b = calloc(1, sizeof(BenchFrames));
+	if (b == NULL)
+		return NULL;
+
+	memcpy(b->header.magic, OSM_MAGIC_FRAME, 4);
+	memcpy(b->header.uuid, "benchdev", 8);
+	memcpy(b->header.sub_uuid, "controlr", 8);
+	b->header.frame_type = OSM_FT_SET;
+
+	OSMSetHeader set = { .num_set = BENCH_CONTROLS };
+	b->len = osm_frame_encode(b->frame, sizeof(b->frame), &b->header, &set);
+	for (int i = 0; i < BENCH_CONTROLS; i++)
+	{
+		osm_control_set((OSMControl *)(b->frame + b->len), i + 1, i * 100);
+		b->len += OSM_WIRE_CONTROL;
+	}
+
+	if (osm_framer_init(&b->framer, 0) != 0)
+	{
+		free(b);
+		return NULL;
+	}
+
+	// A slowly moving sensor, rounded like a real reading
+	for (int i = 0; i < 1024; i++)
+	{
+		double d = round((20 + sin(i / 50.0) * 5) * 100) / 100;
+		memcpy(&b->values[i], &d, 8);
+	}
+
+	uint8_t init[OSM_WIRE_INIT_HEADER + 4];
+	OSMInitFrameHeader h = { .version = 1, .keytype = 1, .keylen = 4 };
+	memcpy(h.uuid, "benchdev", 8);
+	size_t init_len = osm_init_encode(init, sizeof(init), &h, (const uint8_t *) "key!");
+	OSMInitView view;
+	osm_init_parse(&view, init, init_len);
+	osm_auth_init(&b->auth, NULL);
+	osm_auth_session(&b->auth, &b->session, &view, &view, (const uint8_t *) "123456", 6);
+	return b;
+}
+
+void bench_frames_teardown(void *state)
+{
+	BenchFrames *b = state;
+	osm_framer_end(&b->framer);
+	osm_auth_session_end(&b->session);
+	osm_auth_end(&b->auth);
+	free(b);
+}
+
+void bench_frame_encode(void *state, unsigned int n)
+{
+	BenchFrames *b = state;
+	uint8_t out[sizeof(b->frame)];
+	OSMSetHeader set = { .num_set = BENCH_CONTROLS };
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		size_t len = osm_frame_encode(out, sizeof(out), &b->header, &set);
+		for (int c = 0; c < BENCH_CONTROLS; c++)
+		{
+			osm_control_set((OSMControl *)(out + len), c + 1, i);
+			len += OSM_WIRE_CONTROL;
+		}
+		bench_keep(out);
+	}
+}
+
+void bench_frame_parse(void *state, unsigned int n)
+{
+	BenchFrames *b = state;
+	OSMFrameView view;
+	uint64_t sum = 0;
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		osm_frame_parse(&view, b->frame, b->len);
+		for (unsigned int c = 0; c < view.sub.set.num_set; c++)
+			sum += osm_control_value(osm_view_control(&view, c));
+	}
+	bench_keep(&sum);
+}
+
+void bench_framer_next(void *state, unsigned int n)
+{
+	BenchFrames *b = state;
+	const uint8_t *frame;
+	size_t len, space_len;
+
+	// Feed frames in as a stream socket would, 32 at a time
+	for (unsigned int i = 0; i < n; i += 32)
+	{
+		uint8_t *space = osm_framer_space(&b->framer, &space_len);
+		unsigned int count = n - i < 32 ? n - i : 32;
+		for (unsigned int f = 0; f < count; f++)
+			memcpy(space + f * b->len, b->frame, b->len);
+		osm_framer_produce(&b->framer, count * b->len);
+
+		while (osm_framer_next(&b->framer, &frame, &len))
+			bench_keep(frame);
+	}
+}
+
+void bench_compact_put(void *state, unsigned int n)
+{
+	BenchFrames *b = state;
+	size_t len = 0;
+
+	osm_compact_reset(&b->enc);
+	for (unsigned int i = 0; i < n; i++)
+	{
+		if (i % 1024 == 0)
+			len = 0;
+		len += osm_compact_put_value(&b->enc, b->samples + len, OSM_TYPE_FLOAT, b->values[i % 1024]);
+	}
+	bench_keep(b->samples);
+}
+
+void *bench_compact_setup(void)
+{
+	BenchFrames *b = bench_frames_setup();
+	if (b == NULL)
+		return NULL;
+
+	// Encode one run of samples to decode over and over
+	size_t len = 0;
+	for (int i = 0; i < 1024; i++)
+		len += osm_compact_put_value(&b->enc, b->samples + len, OSM_TYPE_FLOAT, b->values[i]);
+	return b;
+}
+
+void bench_compact_get(void *state, unsigned int n)
+{
+	BenchFrames *b = state;
+	size_t off = 0;
+	uint64_t value, sum = 0;
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		if (i % 1024 == 0)
+		{
+			off = 0;
+			osm_compact_reset(&b->dec);
+		}
+		off += osm_compact_get_value(&b->dec, b->samples + off, sizeof(b->samples) - off, OSM_TYPE_FLOAT, &value);
+		sum += value;
+	}
+	bench_keep(&sum);
+}
+
+void bench_auth_sign(void *state, unsigned int n)
+{
+	BenchFrames *b = state;
+	uint8_t tag[OSM_AUTH_TAG_LEN];
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		osm_auth_sign(&b->session, b->frame, b->len, tag);
+		bench_keep(tag);
+	}
+}
+
+const BenchCase bench_frames_cases[] = {
+	{ "frame_encode_set4", bench_frame_encode, bench_frames_setup, bench_frames_teardown },
+	{ "frame_parse_set4", bench_frame_parse, bench_frames_setup, bench_frames_teardown },
+	{ "framer_next_set4", bench_framer_next, bench_frames_setup, bench_frames_teardown },
+	{ "compact_put_float", bench_compact_put, bench_frames_setup, bench_frames_teardown },
+	{ "compact_get_float", bench_compact_get, bench_compact_setup, bench_frames_teardown },
+	{ "auth_sign_set4", bench_auth_sign, bench_frames_setup, bench_frames_teardown },
+	{ NULL },
+};
@@ -0,0 +1,47 @@
+#include "bench.h"
+
+#include <osm/metrics.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+void bench_metrics_counter(void *state, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		osm_metric_add(OSM_M_FRAMES_IN, 1);
+}
+
+void bench_metrics_record(void *state, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		osm_metric_record(OSM_H_DEVICE_CALL, 1000 + (i & 0xffff));
+}
+
+void bench_metrics_now(void *state, unsigned int n)
+{
+	uint64_t sum = 0;
+	for (unsigned int i = 0; i < n; i++)
+		sum += osm_metrics_now();
+	bench_keep(&sum);
+}
+
+void bench_metrics_snapshot(void *state, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+	{
+		osm_metrics_snapshot(state);
+		bench_keep(state);
+	}
+}
+
+void *bench_metrics_setup(void)
+{
+	return malloc(sizeof(OSMMetrics));
+}
+
+const BenchCase bench_metrics_cases[] = {
+	{ "metrics_counter", bench_metrics_counter },
+	{ "metrics_record", bench_metrics_record },
+	{ "metrics_now", bench_metrics_now },
+	{ "metrics_snapshot", bench_metrics_snapshot, bench_metrics_setup, free },
+	{ NULL },
+};
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <osm/bind.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * TCP connections to an osm_open_network listener over loopback, through
+ * IPv4 and IPv6.  Setup fails unless the listener takes both, so running
+ * these cases also checks that it is dual-stack.
+ */
+
+/// First port tried for the listener, the next ones are tried if it is taken
+#define BENCH_NETWORK_PORT 41200
+#define BENCH_NETWORK_PORTS 64
+
+typedef struct {
+	int listener;
+	int family;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+} BenchNetwork;
+
+/**
+ * Fill in the loopback address of a family
+ */
+socklen_t bench_network_addr(struct sockaddr_storage *addr, int family, uint16_t port)
+{
+	memset(addr, 0, sizeof(*addr));
+	if (family == AF_INET)
+	{
+		struct sockaddr_in *in = (struct sockaddr_in *) addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		in->sin_port = htons(port);
+		return sizeof(*in);
+	}
+
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+	in6->sin6_family = AF_INET6;
+	in6->sin6_addr = in6addr_loopback;
+	in6->sin6_port = htons(port);
+	return sizeof(*in6);
+}
+
+/**
+ * Open a connection to the listener and accept it
+ * return - the accepted fd, or -1 on error
+ */
+int bench_network_connect(BenchNetwork *b, int *client)
+{
+	*client = socket(b->family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*client == -1)
+		return -1;
+
+	// Reset on close rather than leave thousands of connections in TIME_WAIT
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	setsockopt(*client, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+	if (connect(*client, (struct sockaddr *) &b->addr, b->addr_len) != 0)
+	{
+		close(*client);
+		return -1;
+	}
+
+	int fd = accept4(b->listener, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1)
+		close(*client);
+	return fd;
+}
+
+/**
+ * Check a connection over each family arrives, IPv4 ones as mapped addresses
+ */
+int bench_network_check(BenchNetwork *b, uint16_t port)
+{
+	const int families[] = { AF_INET, AF_INET6 };
+	for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++)
+	{
+		BenchNetwork check = { .listener = b->listener, .family = families[i] };
+		check.addr_len = bench_network_addr(&check.addr, families[i], port);
+
+		int client;
+		int fd = bench_network_connect(&check, &client);
+		if (fd == -1)
+			return -1;
+
+		struct sockaddr_in6 peer;
+		socklen_t peer_len = sizeof(peer);
+		int err = getpeername(fd, (struct sockaddr *) &peer, &peer_len);
+		close(client);
+		close(fd);
+
+		bool mapped = IN6_IS_ADDR_V4MAPPED(&peer.sin6_addr);
+		if (err != 0 || peer.sin6_family != AF_INET6 || mapped != (families[i] == AF_INET))
+		{
+			errno = EPROTONOSUPPORT;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void *bench_network_setup(int family)
+{
+	BenchNetwork *b = calloc(1, sizeof(BenchNetwork));
+	if (b == NULL)
+		return NULL;
+
+	uint16_t port = BENCH_NETWORK_PORT;
+	for (int i = 0; i < BENCH_NETWORK_PORTS; i++, port++)
+	{
+		b->listener = osm_open_network(port, false);
+		if (b->listener != -1 || errno != EADDRINUSE)
+			break;
+	}
+
+	if (b->listener == -1)
+	{
+		free(b);
+		return NULL;
+	}
+
+	if (bench_network_check(b, port) != 0)
+	{
+		int err = errno;
+		close(b->listener);
+		free(b);
+		errno = err;
+		return NULL;
+	}
+
+	b->family = family;
+	b->addr_len = bench_network_addr(&b->addr, family, port);
+	return b;
+}
+
+void *bench_network_setup_ipv4(void)
+{
+	return bench_network_setup(AF_INET);
+}
+
+void *bench_network_setup_ipv6(void)
+{
+	return bench_network_setup(AF_INET6);
+}
+
+void bench_network_teardown(void *state)
+{
+	BenchNetwork *b = state;
+	close(b->listener);
+	free(b);
+}
+
+void bench_network_accept(void *state, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+	{
+		int client;
+		int fd = bench_network_connect(state, &client);
+		if (fd == -1)
+			return;
+
+		close(client);
+		close(fd);
+	}
+}
+
+const BenchCase bench_network_cases[] = {
+	// Connect, accept and close, one connection per operation
+	{ "network_accept_ipv4", bench_network_accept, bench_network_setup_ipv4, bench_network_teardown, 0 },
+	{ "network_accept_ipv6", bench_network_accept, bench_network_setup_ipv6, bench_network_teardown, 0 },
+	{ NULL },
+};
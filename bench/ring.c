@@ -0,0 +1,133 @@
+#include "bench.h"
+
+#include <osm/utils.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <threads.h>
+
+/// Elements pushed and popped together in the batch cases
+#define BENCH_RING_BATCH 32
+
+/// Like a posted task: a function and its data
+typedef struct {
+	void *task, *data;
+} BenchRingEl;
+
+void *bench_ring_spsc_setup(void)
+{
+	OSMSpscRing *ring = aligned_alloc(alignof(OSMSpscRing), sizeof(OSMSpscRing));
+	osm_spsc_init(ring, sizeof(BenchRingEl), 1024);
+	return ring;
+}
+
+void bench_ring_spsc_teardown(void *state)
+{
+	osm_spsc_end(state);
+	free(state);
+}
+
+void bench_ring_spsc(void *state, unsigned int n)
+{
+	BenchRingEl el = { 0 };
+	for (unsigned int i = 0; i < n; i++)
+	{
+		osm_spsc_push(state, &el);
+		osm_spsc_pop(state, &el);
+	}
+	bench_keep(&el);
+}
+
+void bench_ring_spsc_batch(void *state, unsigned int n)
+{
+	BenchRingEl els[BENCH_RING_BATCH] = { 0 };
+	for (unsigned int i = 0; i < n; i += BENCH_RING_BATCH)
+	{
+		osm_spsc_push_n(state, els, BENCH_RING_BATCH);
+		osm_spsc_pop_n(state, els, BENCH_RING_BATCH);
+	}
+	bench_keep(els);
+}
+
+void *bench_ring_mpsc_setup(void)
+{
+	OSMMpscRing *ring = aligned_alloc(alignof(OSMMpscRing), sizeof(OSMMpscRing));
+	osm_mpsc_init(ring, sizeof(BenchRingEl), 1024);
+	return ring;
+}
+
+void bench_ring_mpsc_teardown(void *state)
+{
+	osm_mpsc_end(state);
+	free(state);
+}
+
+void bench_ring_mpsc(void *state, unsigned int n)
+{
+	BenchRingEl el = { 0 };
+	for (unsigned int i = 0; i < n; i++)
+	{
+		osm_mpsc_push(state, &el);
+		osm_mpsc_pop(state, &el);
+	}
+	bench_keep(&el);
+}
+
+void bench_ring_mpsc_batch(void *state, unsigned int n)
+{
+	BenchRingEl els[BENCH_RING_BATCH] = { 0 };
+	for (unsigned int i = 0; i < n; i += BENCH_RING_BATCH)
+	{
+		osm_mpsc_push_n(state, els, BENCH_RING_BATCH);
+		osm_mpsc_pop_n(state, els, BENCH_RING_BATCH);
+	}
+	bench_keep(els);
+}
+
+/// What loops used to post with: a vector behind a mutex
+typedef struct {
+	mtx_t lock;
+	Vector queue;
+} BenchRingLocked;
+
+void *bench_ring_locked_setup(void)
+{
+	BenchRingLocked *locked = malloc(sizeof(BenchRingLocked));
+	mtx_init(&locked->lock, mtx_plain);
+	locked->queue = vect_init(sizeof(BenchRingEl));
+	return locked;
+}
+
+void bench_ring_locked_teardown(void *state)
+{
+	BenchRingLocked *locked = state;
+	mtx_destroy(&locked->lock);
+	vect_end(&locked->queue);
+	free(locked);
+}
+
+void bench_ring_locked(void *state, unsigned int n)
+{
+	BenchRingLocked *locked = state;
+	BenchRingEl el = { 0 };
+	for (unsigned int i = 0; i < n; i++)
+	{
+		mtx_lock(&locked->lock);
+		vect_push(&locked->queue, &el);
+		mtx_unlock(&locked->lock);
+
+		mtx_lock(&locked->lock);
+		el = *(BenchRingEl *) vect_get(&locked->queue, locked->queue.count - 1);
+		vect_pop(&locked->queue);
+		mtx_unlock(&locked->lock);
+	}
+	bench_keep(&el);
+}
+
+const BenchCase bench_ring_cases[] = {
+	{ "ring_spsc_push_pop", bench_ring_spsc, bench_ring_spsc_setup, bench_ring_spsc_teardown },
+	{ "ring_spsc_batch_32", bench_ring_spsc_batch, bench_ring_spsc_setup, bench_ring_spsc_teardown },
+	{ "ring_mpsc_push_pop", bench_ring_mpsc, bench_ring_mpsc_setup, bench_ring_mpsc_teardown },
+	{ "ring_mpsc_batch_32", bench_ring_mpsc_batch, bench_ring_mpsc_setup, bench_ring_mpsc_teardown },
+	{ "ring_locked_push_pop", bench_ring_locked, bench_ring_locked_setup, bench_ring_locked_teardown },
+	{ NULL },
+};
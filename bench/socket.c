@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <osm/frames.h>
+#include <osm/protocol.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+/*
+ * Round trips over a SOCK_SEQPACKET socket pair, the same kind of socket
+ * onboard devices listen on, to a thread which echoes every frame
+ */
+
+typedef struct {
+	int fds[2];
+	thrd_t echo;
+	OSMFrameHeader header;
+	uint8_t bufs[OSM_FRAME_BATCH][64];
+	OSMFrameIn in[OSM_FRAME_BATCH];
+	OSMFrameOut out[OSM_FRAME_BATCH];
+} BenchSocket;
+
+int bench_echo(void *arg)
+{
+	int fd = *(int *) arg;
+	uint8_t bufs[OSM_FRAME_BATCH][64];
+	OSMFrameIn in[OSM_FRAME_BATCH];
+
+	// Don't share the benchmark's CPU, or every round trip is two context
+	// switches on one core
+	int cpu = bench_other_cpu();
+	if (cpu != -1)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+
+	for (;;)
+	{
+		for (int i = 0; i < OSM_FRAME_BATCH; i++)
+			in[i] = (OSMFrameIn) { .buf = bufs[i], .size = sizeof(bufs[i]) };
+
+		int n = osm_recv_frames(fd, in, OSM_FRAME_BATCH, 0);
+		if (n <= 0)
+			return 0;
+
+		// Send each frame back as it came
+		struct mmsghdr msgs[OSM_FRAME_BATCH];
+		struct iovec iov[OSM_FRAME_BATCH];
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < n; i++)
+		{
+			iov[i] = (struct iovec) { .iov_base = in[i].buf, .iov_len = in[i].len };
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		if (sendmmsg(fd, msgs, n, MSG_NOSIGNAL) != n)
+			return 0;
+	}
+}
+
+void *bench_socket_setup(void)
+{
+	BenchSocket *b = calloc(1, sizeof(BenchSocket));
+	if (b == NULL)
+		return NULL;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, b->fds) != 0)
+	{
+		free(b);
+		return NULL;
+	}
+
+	if (thrd_create(&b->echo, bench_echo, &b->fds[1]) != thrd_success)
+	{
+		close(b->fds[0]);
+		close(b->fds[1]);
+		free(b);
+		return NULL;
+	}
+
+	memcpy(b->header.magic, OSM_MAGIC_FRAME, 4);
+	b->header.frame_type = OSM_FT_GET;
+	OSMGetHeader get = { .num_get = 1 };
+	static uint8_t id[OSM_WIRE_CONTROL_ID] = { 1 };
+	for (int i = 0; i < OSM_FRAME_BATCH; i++)
+		b->out[i] = osm_frame_out(&b->header, &get, id, sizeof(id));
+	return b;
+}
+
+void bench_socket_teardown(void *state)
+{
+	BenchSocket *b = state;
+	shutdown(b->fds[0], SHUT_RDWR);
+	thrd_join(b->echo, NULL);
+	close(b->fds[0]);
+	close(b->fds[1]);
+	free(b);
+}
+
+/**
+ * Send frames and wait for all of them to come back
+ */
+void bench_round_trip(BenchSocket *b, unsigned int count)
+{
+	osm_send_frames(b->fds[0], b->out, count, 0);
+
+	unsigned int got = 0;
+	while (got < count)
+	{
+		for (unsigned int i = got; i < count; i++)
+			b->in[i] = (OSMFrameIn) { .buf = b->bufs[i], .size = sizeof(b->bufs[i]) };
+
+		int n = osm_recv_frames(b->fds[0], b->in + got, count - got, 0);
+		if (n <= 0)
+			return;
+		got += n;
+	}
+}
+
+void bench_socket_rtt(void *state, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+		bench_round_trip(state, 1);
+}
+
+void bench_socket_batch(void *state, unsigned int n)
+{
+	// n counts frames, sent OSM_FRAME_BATCH at a time
+	for (unsigned int i = 0; i < n; i += OSM_FRAME_BATCH)
+		bench_round_trip(state, n - i < OSM_FRAME_BATCH ? n - i : OSM_FRAME_BATCH);
+}
+
+const BenchCase bench_socket_cases[] = {
+	// One round trip per sample, so the percentiles are round trip latencies
+	{ "onboard_rtt", bench_socket_rtt, bench_socket_setup, bench_socket_teardown, 1 },
+	{ "onboard_batch64_per_frame", bench_socket_batch, bench_socket_setup, bench_socket_teardown, OSM_FRAME_BATCH },
+	{ NULL },
+};
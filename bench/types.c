@@ -0,0 +1,101 @@
+#include "bench.h"
+
+#include <osm/types.h>
+#include <stdlib.h>
+
+/// Values converted, cycled through by each case
+#define BENCH_FLOATS 1024
+
+typedef struct {
+	double natives[BENCH_FLOATS];
+	OSMFloat floats[BENCH_FLOATS];
+} BenchFloats;
+
+void *bench_types_setup(void)
+{
+	BenchFloats *f = malloc(sizeof(BenchFloats));
+	srand(1);
+	for (int i = 0; i < BENCH_FLOATS; i++)
+	{
+		// A spread of magnitudes, signs and some subnormals
+		double d = (rand() / (double) RAND_MAX - 0.5) * (1 << (i % 40));
+		if (i % 64 == 0)
+			d *= 1e-310;
+		f->natives[i] = d;
+		f->floats[i] = osm_native_to_float(d);
+	}
+	return f;
+}
+
+void bench_types_teardown(void *state)
+{
+	free(state);
+}
+
+void bench_float_to_native(void *state, unsigned int n)
+{
+	BenchFloats *f = state;
+	double sum = 0;
+	for (unsigned int i = 0; i < n; i++)
+		sum += osm_float_to_native(f->floats[i % BENCH_FLOATS]);
+	bench_keep(&sum);
+}
+
+void bench_native_to_float(void *state, unsigned int n)
+{
+	BenchFloats *f = state;
+	OSMFloat acc = 0;
+	for (unsigned int i = 0; i < n; i++)
+		acc ^= osm_native_to_float(f->natives[i % BENCH_FLOATS]);
+	bench_keep(&acc);
+}
+
+void bench_float_to_break(void *state, unsigned int n)
+{
+	BenchFloats *f = state;
+	uint64_t acc = 0;
+	for (unsigned int i = 0; i < n; i++)
+		acc ^= osm_float_to_break(f->floats[i % BENCH_FLOATS]).fraction;
+	bench_keep(&acc);
+}
+
+void bench_float_is_nan(void *state, unsigned int n)
+{
+	BenchFloats *f = state;
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < n; i++)
+		count += osm_is_nan(f->floats[i % BENCH_FLOATS]);
+	bench_keep(&count);
+}
+
+void bench_color_new(void *state, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+	{
+		OSMColor color = osm_rgb_to_color(i, i >> 8, i >> 16);
+		bench_keep(&color);
+		osm_color_free(&color);
+	}
+}
+
+void bench_color_copy(void *state, unsigned int n)
+{
+	OSMColor color = osm_rgb_to_color(1, 2, 3);
+	for (unsigned int i = 0; i < n; i++)
+	{
+		OSMColor copy = osm_color_copy(&color);
+		bench_keep(&copy);
+		osm_color_free(&copy);
+	}
+	osm_color_free(&color);
+}
+
+const BenchCase bench_types_cases[] = {
+	{ "float_to_native", bench_float_to_native, bench_types_setup, bench_types_teardown },
+	{ "native_to_float", bench_native_to_float, bench_types_setup, bench_types_teardown },
+	{ "float_to_break", bench_float_to_break, bench_types_setup, bench_types_teardown },
+	{ "float_is_nan", bench_float_is_nan, bench_types_setup, bench_types_teardown },
+	{ "color_new_free", bench_color_new },
+	{ "color_copy_free", bench_color_copy },
+	{ NULL },
+};
@@ -0,0 +1,123 @@
+#include "bench.h"
+
+#include <osm/utils.h>
+#include <stdlib.h>
+
+/// Elements kept in vectors which are inserted into and removed from
+#define BENCH_VECTOR_LEN 1024
+
+void *bench_vector_setup(void)
+{
+	Vector *vec = malloc(sizeof(Vector));
+	*vec = vect_init(sizeof(int));
+	for (int i = 0; i < BENCH_VECTOR_LEN; i++)
+		vect_push(vec, &i);
+	return vec;
+}
+
+void bench_vector_teardown(void *state)
+{
+	vect_end(state);
+	free(state);
+}
+
+void *bench_vector_empty(void)
+{
+	Vector *vec = malloc(sizeof(Vector));
+	*vec = vect_init(sizeof(int));
+	return vec;
+}
+
+void bench_vector_push(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		int v = i;
+		vect_push(vec, &v);
+
+		// Start again every so often so the vector doesn't grow forever
+		if (vec->count == 1 << 16)
+			vect_clear(vec);
+	}
+}
+
+void bench_vector_get(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	int sum = 0;
+	for (unsigned int i = 0; i < n; i++)
+		sum += *(int *) vect_get(vec, i % BENCH_VECTOR_LEN);
+	bench_keep(&sum);
+}
+
+void bench_vector_insert_front(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		int v = i;
+		vect_add(vec, 0, &v);
+		vect_pop(vec);
+	}
+}
+
+void bench_vector_remove_front(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		int v = i;
+		vect_remove(vec, 0);
+		vect_push(vec, &v);
+	}
+}
+
+void bench_vector_push_n(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	int block[64];
+	for (int i = 0; i < 64; i++)
+		block[i] = i;
+
+	for (unsigned int i = 0; i < n; i++)
+	{
+		vect_push_n(vec, block, 64);
+
+		if (vec->count >= 1 << 16)
+			vect_clear(vec);
+	}
+}
+
+void bench_vector_insert_range(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	int block[16] = {0};
+	for (unsigned int i = 0; i < n; i++)
+	{
+		vect_insert_n(vec, BENCH_VECTOR_LEN / 2, block, 16);
+		vect_remove_range(vec, BENCH_VECTOR_LEN / 2, 16);
+	}
+}
+
+void bench_vector_push_pop(void *state, unsigned int n)
+{
+	Vector *vec = state;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		int v = i;
+		vect_push(vec, &v);
+		vect_pop(vec);
+	}
+}
+
+const BenchCase bench_vector_cases[] = {
+	{ "vector_push", bench_vector_push, bench_vector_empty, bench_vector_teardown },
+	{ "vector_push_pop", bench_vector_push_pop, bench_vector_setup, bench_vector_teardown },
+	{ "vector_get", bench_vector_get, bench_vector_setup, bench_vector_teardown },
+	{ "vector_insert_front_1k", bench_vector_insert_front, bench_vector_setup, bench_vector_teardown },
+	{ "vector_remove_front_1k", bench_vector_remove_front, bench_vector_setup, bench_vector_teardown },
+	{ "vector_push_n_64", bench_vector_push_n, bench_vector_empty, bench_vector_teardown },
+	{ "vector_insert_range_16_1k", bench_vector_insert_range, bench_vector_setup, bench_vector_teardown },
+	{ NULL },
+};
@@ -0,0 +1,148 @@
+#ifndef OSM_ASYNC_H
+#define OSM_ASYNC_H
+
+#include <osm/batch.h>
+#include <osm/device.h>
+#include <osm/loop.h>
+#include <osm/utils.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+
+/*
+ * Asynchronous device operations.
+ *
+ * An OSMAsync drives device connections from an event loop without ever
+ * blocking on a device: operations are queued per device and their frames
+ * pipelined on non-blocking sockets (see osm/batch.h), so one thread can
+ * keep thousands of operations in flight.
+ *
+ * Completion is reported in one of two ways:
+ *  - given a loop, callbacks run on that loop's thread.
+ *  - without one, the OSMAsync runs its own loop on a background thread and
+ *    queues completed operations, signalling an eventfd (osm_async_fd) which
+ *    can be added to any event loop.  osm_async_reap then runs the callbacks
+ *    on the calling thread.
+ *
+ * Operations may be started from any thread.  Devices are connected on first
+ * use, without blocking the loop, and must not be used with the blocking API
+ * at the same time.
+ */
+
+/// Interval of the device timeout checks
+#define OSM_ASYNC_CHECK_MS 250
+
+typedef struct OSMAsync OSMAsync;
+typedef struct OSMAsyncOp OSMAsyncOp;
+
+/**
+ * Called when an operation completes
+ * error - 0 on success, otherwise the errno it failed with
+ */
+typedef void (*OSMAsyncCallback)(OSMAsyncOp *op, int error, void *data);
+
+/**
+ * A device operation in progress.  The handle is valid until its callback
+ * has returned, after which it is freed.
+ */
+struct OSMAsyncOp {
+	OSMAsync *async;
+	OSMDevice *dev;
+	OSMBatch *batch;             // the batch being run
+	OSMBatch own;                // batch of single datapoint operations
+	OSMBatchItem item;
+	uint8_t type;                // datapoint type of a read
+	void *value;                 // where to store the value of a read
+
+	OSMAsyncCallback callback;
+	void *data;
+	int error;
+	bool cancelled;
+	OSMAsyncOp *next;
+};
+
+/**
+ * Asynchronous operation context
+ */
+struct OSMAsync {
+	OSMLoop *loop;
+	OSMLoop own_loop;
+	bool threaded;
+	thrd_t thread;
+	int eventfd;                 // threaded: signalled when operations complete
+
+	int wakefd;                  // signalled when operations are started
+	OSMLoopHandle *wake;
+
+	mtx_t lock;
+	OSMAsyncOp *incoming;        // started but not yet picked up by the loop
+	OSMAsyncOp *done_head, *done_tail;  // threaded: completed, waiting to be reaped
+
+	unsigned int depth;
+	Vector devices;              // attached devices, only used on the loop thread
+	OSMLoopHandle *timer;
+};
+
+/**
+ * Initialize an asynchronous operation context
+ * loop - the loop to run on (callbacks run on its thread), or NULL to run
+ *        on a background thread and signal completions on an eventfd
+ * depth - requests in flight per device (0 for OSM_DEVICE_DEFAULT_DEPTH)
+ * return - 0 on success, -1 on error
+ */
+int osm_async_init(OSMAsync *async, OSMLoop *loop, unsigned int depth);
+
+/**
+ * Get the eventfd which becomes readable when operations complete (only
+ * without a loop), it is reset by osm_async_reap
+ * return - the eventfd, or -1 if callbacks run on a loop
+ */
+int osm_async_fd(OSMAsync *async);
+
+/**
+ * Run the callbacks of the operations which have completed (only without
+ * a loop)
+ * return - the number of operations completed
+ */
+unsigned int osm_async_reap(OSMAsync *async);
+
+/**
+ * Start reading a datapoint
+ * in - filled in with the value before the callback runs (OSMBool,
+ *      OSMInteger or OSMFloat), must live until then
+ * return - the operation's handle, or NULL on error
+ */
+OSMAsyncOp *osm_async_read(OSMAsync *async, OSMDevice *dev, OSMDatapoint *dat, void *in,
+	OSMAsyncCallback callback, void *data);
+
+/**
+ * Start writing a datapoint
+ * out - the value to write (OSMBool, OSMInteger or OSMFloat), copied
+ * return - the operation's handle, or NULL on error
+ */
+OSMAsyncOp *osm_async_write(OSMAsync *async, OSMDevice *dev, OSMDatapoint *dat, void *out,
+	OSMAsyncCallback callback, void *data);
+
+/**
+ * Start a batch.  The batch must live until the callback runs, and its done
+ * and data fields are used by the operation.
+ * return - the operation's handle, or NULL on error
+ */
+OSMAsyncOp *osm_async_batch(OSMAsync *async, OSMDevice *dev, OSMBatch *batch,
+	OSMAsyncCallback callback, void *data);
+
+/**
+ * Cancel an operation's callback.  Requests already sent are still
+ * answered, but the callback won't be called.  Must be called from the
+ * thread the callbacks run on, before the callback has run.
+ */
+void osm_async_cancel(OSMAsyncOp *op);
+
+/**
+ * Fail every operation still running with ECANCELED and run the remaining
+ * callbacks, then disconnect the devices and free the context.  With a loop,
+ * call it from the loop's thread or while the loop is not running.
+ */
+void osm_async_end(OSMAsync *async);
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef OSM_AUTH_H
+#define OSM_AUTH_H
+
+#include <osm/blake2s.h>
+#include <osm/codec.h>
+#include <osm/frames.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <threads.h>
+
+/*
+ * Frame authentication.
+ *
+ * The public keys exchanged in init frames are only checked once per peer,
+ * when a connection is paired.  Each session then derives a symmetric key
+ * for each direction from the pairing secret and both init frames, and every
+ * normal frame is followed by a short MAC tag over a per-direction sequence
+ * number and the frame.  Frames have to be verified in the order they were
+ * sent, which also rejects replayed and dropped frames.
+ *
+ * Peer keys which passed the check are cached by uuid, so reconnecting
+ * peers skip it as long as they present the same key.
+ *
+ * The key check, key derivation and MAC are pluggable.  By default keys
+ * are trusted as authenticated by the pairing code, session keys are
+ * derived with BLAKE2s keyed by the pairing secret, and tags are BLAKE2s
+ * MACs whose keyed state is computed once per session, so tagging a small
+ * frame costs a single compression.
+ */
+
+/// Length of a session key
+#define OSM_AUTH_KEY_LEN 32
+/// Length of the tag following every authenticated frame
+#define OSM_AUTH_TAG_LEN 16
+/// Initial size of the peer key cache
+#define OSM_AUTH_CACHE_SIZE 64
+
+/**
+ * Authentication operations, NULL members use the default
+ */
+typedef struct {
+	/**
+	 * Check a peer's key before it is trusted (eg. verify a certificate).
+	 * Only called for peers which aren't cached with the same key.
+	 * return - 0 if the key is trusted, -1 if not
+	 */
+	int (*verify_key)(const OSMInitView *peer, void *data);
+
+	/**
+	 * Derive the session key for frames sent from one side to the other
+	 * secret - the pairing secret
+	 * return - 0 on success, -1 on error
+	 */
+	int (*derive)(uint8_t key[OSM_AUTH_KEY_LEN], const uint8_t *secret, size_t secret_len,
+		const OSMInitView *from, const OSMInitView *to, void *data);
+
+	/**
+	 * Compute the tag of a frame, gathered from parts
+	 * seq - the frame's sequence number in its direction
+	 */
+	void (*mac)(uint8_t tag[OSM_AUTH_TAG_LEN], const uint8_t key[OSM_AUTH_KEY_LEN], uint64_t seq,
+		const struct iovec *parts, unsigned int count, void *data);
+
+	void *data;
+} OSMAuthOps;
+
+/**
+ * A trusted peer key
+ */
+typedef struct {
+	uint64_t uuid;
+	bool used;
+	uint8_t keytype;
+	uint16_t keylen;
+	uint8_t *key;
+} OSMAuthPeer;
+
+/**
+ * Authentication context, shared by every session.  It may be used from
+ * several threads.
+ */
+typedef struct {
+	OSMAuthOps ops;
+
+	mtx_t lock;
+	OSMAuthPeer *peers;          // open addressed by uuid
+	unsigned int size, count;
+} OSMAuth;
+
+/**
+ * Keys and sequence numbers of one authenticated connection.  A session is
+ * used by one thread at a time.
+ */
+typedef struct {
+	OSMAuth *auth;
+	uint8_t uuid[8];             // the peer
+
+	uint8_t tx_key[OSM_AUTH_KEY_LEN], rx_key[OSM_AUTH_KEY_LEN];
+	OSMBlake2s tx_mac, rx_mac;   // keyed states for the default MAC
+	uint64_t tx_seq, rx_seq;
+} OSMAuthSession;
+
+/**
+ * Initialize an authentication context
+ * ops - the operations to use, or NULL for the defaults
+ * return - 0 on success, -1 on error
+ */
+int osm_auth_init(OSMAuth *auth, const OSMAuthOps *ops);
+
+/**
+ * Check whether a peer's key is cached as trusted
+ */
+bool osm_auth_trusted(OSMAuth *auth, const OSMInitView *peer);
+
+/**
+ * Remove a peer's key from the cache, eg. when it is unpaired
+ */
+void osm_auth_forget(OSMAuth *auth, const uint8_t uuid[8]);
+
+/**
+ * Start a session once both init frames have been exchanged.  The peer's
+ * key is checked unless it is already trusted.
+ * local - our init frame
+ * peer - the peer's init frame
+ * secret - the pairing secret both sides know
+ * return - 0 on success, -1 on error (errno is EACCES if the key isn't
+ *          trusted)
+ */
+int osm_auth_session(OSMAuth *auth, OSMAuthSession *session, const OSMInitView *local,
+	const OSMInitView *peer, const uint8_t *secret, size_t secret_len);
+
+/**
+ * Compute the tag for the next frame sent
+ * frame - the encoded frame
+ */
+void osm_auth_sign(OSMAuthSession *session, const uint8_t *frame, size_t len, uint8_t tag[OSM_AUTH_TAG_LEN]);
+
+/**
+ * Compute the tag for the next frame sent and attach it, for frames sent
+ * with osm_send_frames
+ * tag - OSM_AUTH_TAG_LEN bytes, must live until the frame is sent
+ */
+void osm_auth_sign_out(OSMAuthSession *session, OSMFrameOut *frame, uint8_t *tag);
+
+/**
+ * Verify the next frame received
+ * frame - the frame followed by its tag
+ * len - length of the frame and tag
+ * return - 0 if the frame is authentic, -1 if not (errno is EBADMSG)
+ */
+int osm_auth_verify(OSMAuthSession *session, const uint8_t *frame, size_t len);
+
+/**
+ * Verify a batch of received frames, eg. from osm_recv_frames.  A frame
+ * which fails breaks the session, as every later frame will fail too.
+ * return - the number of frames verified before the first one which failed
+ *          (errno is EBADMSG if any did)
+ */
+unsigned int osm_auth_verify_batch(OSMAuthSession *session, const OSMFrameIn *frames, unsigned int count);
+
+/**
+ * Wipe a session's keys
+ */
+void osm_auth_session_end(OSMAuthSession *session);
+
+/**
+ * Free an authentication context
+ */
+void osm_auth_end(OSMAuth *auth);
+
+#endif
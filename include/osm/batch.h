@@ -0,0 +1,166 @@
+#ifndef OSM_BATCH_H
+#define OSM_BATCH_H
+
+#include <osm/codec.h>
+#include <osm/device.h>
+#include <osm/framer.h>
+#include <osm/metrics.h>
+#include <osm/protocol.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Batched GET/SET of datapoints with pipelining.
+ *
+ * A batch packs up to 255 datapoints into each GET or SET frame (larger
+ * batches are split over several frames), and several frames are kept in
+ * flight on a device connection.  Devices answer requests in order, so each
+ * OSM_FT_RES frame is matched to the oldest request still in flight.
+ *
+ * A reply whose res_type is not the type of the request fails it.
+ *
+ * Connections opened by osm_device_connect are blocking.  For non-blocking
+ * connections use osm_batch_submit and osm_device_poll without waiting, as
+ * osm/async.h does.
+ *
+ * When a connection fails or a device times out, every request in flight is
+ * failed and the device is disconnected (its fd is closed), so the next
+ * osm_device_connect opens a new connection rather than matching late
+ * replies to new requests.
+ */
+
+/// Most datapoints in a single GET or SET frame
+#define OSM_BATCH_FRAME_MAX 255
+
+/**
+ * One datapoint in a batch
+ */
+typedef struct {
+	uint64_t id;                 // the datapoint's id
+	uint64_t value;              // the value to set, or filled in by a get
+	bool valid;                  // filled in: the device answered for this datapoint
+} OSMBatchItem;
+
+typedef struct OSMBatch OSMBatch;
+
+/// Called once every frame of a batch has been answered or failed
+typedef void (*OSMBatchDone)(OSMBatch *batch, void *data);
+
+/**
+ * A batch of datapoints to get or set
+ */
+struct OSMBatch {
+	uint8_t frame_type;          // OSM_FT_GET or OSM_FT_SET
+	OSMBatchItem *items;
+	unsigned int count;
+
+	unsigned int sent;           // items handed to the connection
+	unsigned int pending;        // frames still in flight
+	int error;                   // 0, or the errno of the first failed frame
+
+	OSMBatchDone done;           // may be NULL
+	void *data;                  // passed to done
+};
+
+/**
+ * A request frame in flight
+ */
+typedef struct {
+	OSMBatch *batch;
+	unsigned int first, count;   // the batch items in the frame
+	uint64_t sent_at;            // osm_metrics_now when it was encoded
+} OSMBatchPart;
+
+/**
+ * Statistics of a device connection, read on the thread using it
+ */
+typedef struct {
+	uint64_t frames_in, frames_out;
+	uint64_t bytes_in, bytes_out;
+	uint64_t calls, errors;      // request frames answered or failed, and failed
+	OSMHist latency;             // nanoseconds from sending a request to its reply
+} OSMConnStats;
+
+/**
+ * A device connection
+ */
+struct OSMDeviceConn {
+	int fd;
+	bool stream;                 // TCP: frames are reassembled by the framer
+	OSMFramer framer;
+	uint8_t *in;                 // onboard: receive buffer for one frame
+	uint8_t *out;                // encode buffer for one frame
+	size_t out_len, out_off;     // frame in out, and how much has been sent
+	OSMFrameHeader header;       // used for every frame sent
+	void *owner;                 // free for the user of the connection (eg. osm/async.h)
+	OSMAllocator *alloc;         // the buffers came from, NULL for the heap
+
+	OSMBatchPart *inflight;      // FIFO of requests awaiting a reply
+	unsigned int depth, head, tail;
+
+	OSMConnStats stats;
+};
+
+/**
+ * Initialize a batch.  The items stay owned by the caller and must live
+ * until the batch completes.
+ * frame_type - OSM_FT_GET or OSM_FT_SET
+ */
+OSMBatch osm_batch(uint8_t frame_type, OSMBatchItem *items, unsigned int count);
+
+/**
+ * Send as many of a batch's frames as the connection has room for without
+ * waiting for replies.  Call again to send the rest once replies arrive, or
+ * once the socket is writable if osm_device_want_write.
+ * return - 1 once every frame is sent, 0 if some are left, -1 on error (the
+ *          device is disconnected if sending failed)
+ */
+int osm_batch_submit(OSMDevice *dev, OSMBatch *batch);
+
+/**
+ * Send a batch's frames to a connected device.  If the connection already
+ * has depth requests in flight this waits for replies to make room.
+ * return - 0 once every frame is sent, -1 on error
+ */
+int osm_batch_send(OSMDevice *dev, OSMBatch *batch);
+
+/**
+ * Check whether a non-blocking connection has a partly sent frame, and
+ * needs the socket to become writable before more can be sent
+ */
+bool osm_device_want_write(OSMDevice *dev);
+
+/**
+ * Read replies and complete the requests they answer
+ * wait - wait for at least one reply (up to OSM_DEVICE_TIMEOUT_MS)
+ * return - the number of requests completed, or -1 if the connection failed
+ *          or timed out (every request in flight is failed and the device
+ *          is disconnected)
+ */
+int osm_device_poll(OSMDevice *dev, bool wait);
+
+/**
+ * Get the statistics of a device's connection
+ * return - the statistics, or NULL if the device isn't connected
+ */
+const OSMConnStats *osm_device_stats(const OSMDevice *dev);
+
+/**
+ * Wait for every frame of a batch to be answered
+ * return - 0 if the batch succeeded, -1 otherwise (errno is batch->error)
+ */
+int osm_batch_wait(OSMDevice *dev, OSMBatch *batch);
+
+/**
+ * Fail every request in flight on a connection
+ * error - errno to fail the batches with
+ */
+void osm_batch_fail_all(OSMDeviceConn *conn, int error);
+
+/**
+ * Send a batch and wait for it
+ * return - 0 if the batch succeeded, -1 otherwise
+ */
+int osm_batch_run(OSMDevice *dev, OSMBatch *batch);
+
+#endif
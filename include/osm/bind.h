@@ -1,28 +1,107 @@
 #ifndef OSM_BIND_H
 #define OSM_BIND_H
 
+#include <osm/device.h>
 #include <osm/utils.h>
+#include <osm/workers.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <threads.h>
 
+/// Default port for networked devices
+#define OSM_NETWORK_PORT 1200
+
+/// Seconds a network connection may idle before keepalive probes start
+#define OSM_NETWORK_KEEPIDLE 30
+/// Seconds between keepalive probes
+#define OSM_NETWORK_KEEPINTVL 5
+/// Unanswered keepalive probes before a connection is dropped
+#define OSM_NETWORK_KEEPCNT 3
+
 /**
- * Bind to the next available onboard socket in the given directory
- * sock_dir - The directory containing osm sockets (or null for the default)
+ * Bind to the lowest free onboard socket id in the given directory
+ * Sockets left behind by exited processes are removed.  A socket counts as
+ * left behind when it refuses two connections a few milliseconds apart, so
+ * a process must start listening on its socket promptly after binding it.
+ * sock_dir - The directory containing osm sockets, or a name starting with
+ *            '@' to bind in the Linux abstract namespace
+ * return - 0 on success, -1 on error
  */
 int osm_bind_local(int sockfd, const char *sock_dir);
 
+/**
+ * Check whether a unix socket file was left behind by a process which has
+ * exited, probing it as osm_bind_local does
+ * return - true only if path is a socket which refuses connections
+ */
+bool osm_socket_stale(const char *path);
+
 /**
  * Bind a new onboard socket
- * sock_dir - The directory containing osm sockets (or null for the default)
+ * sock_dir - The directory containing osm sockets (or null for the default),
+ *            see osm_bind_local
  * return - a negitve number on error, or the socket fd on success
  */
 int osm_open_onboard(char *sock_dir);
 
 /**
- * Listen for socket connections and return the new
- * file descriptors to the callback function for processing
+ * Listen for socket connections and hand the new file descriptors
+ * to the callback function on a worker pool
  * sockfd - the socket file descriptor
+ * pool - the worker pool to run callbacks on
  * callback - the callback function which will be provided with the new file descriptor
+ * return - 0 once the socket has failed, -1 if listening could not start
+ *
+ * Each callback occupies a worker until it returns, so long lived connections
+ * should hand their fd to an OSMLoop rather than block.
+ */
+int osm_listen_and_dispatch(int sockfd, OSMWorkerPool *pool, thrd_start_t callback);
+
+/**
+ * Listen for socket connections and hand the new file descriptors to the
+ * callback function, each on a thread of its own
+ * sockfd - the socket file descriptor
+ * callback - the callback function which will be provided with the new file descriptor
+ * return - 0 once the socket has failed and all callbacks have returned,
+ *          -1 if listening could not start
+ *
+ * Accepting is driven by an OSMLoop on the calling thread.  At most
+ * OSM_CONN_DEFAULT_MAX connections are handled at once.  Each callback owns
+ * its fd and must close it.  Use an OSMConnManager directly to change these,
+ * or osm_listen_and_dispatch to run short callbacks on a worker pool.
+ */
+int osm_listen_and_serve(int sockfd, thrd_start_t callback);
+
+/**
+ * Deprecated, use osm_listen_and_serve
+ * Connection threads are detached, so the returned vector is always empty.
  */
+__attribute__((deprecated("use osm_listen_and_serve")))
 Vector osm_listen_and_accept(int sockfd, thrd_start_t callback);
 
+/**
+ * Bind a new dual-stack (IPv6 and IPv4) TCP listener
+ * port - the port to listen on (0 for OSM_NETWORK_PORT)
+ * reuseport - set SO_REUSEPORT so more listeners can share the port
+ * return - a negative number on error, or the listening socket fd
+ */
+int osm_open_network(uint16_t port, bool reuseport);
+
+/**
+ * Open count SO_REUSEPORT listeners on the same port, so the kernel spreads
+ * new connections across them.  Give each one its own OSMLoop thread.
+ * port - the port to listen on (0 for OSM_NETWORK_PORT)
+ * count - number of listeners (0 for one per online cpu)
+ * return - a vector of listening socket fds (int), empty on error
+ */
+Vector osm_open_network_group(uint16_t port, unsigned int count);
+
+/**
+ * Set TCP_NODELAY and keepalive options suited to small control frames.
+ * Accepted sockets inherit these from osm_open_network listeners, use this
+ * on outgoing connections.
+ * return - 0 on success, -1 on error
+ */
+int osm_tune_network(int fd);
+
 #endif
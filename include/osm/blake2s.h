@@ -0,0 +1,54 @@
+#ifndef OSM_BLAKE2S_H
+#define OSM_BLAKE2S_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * BLAKE2s (RFC 7693), used as the default keyed MAC for authenticated frames
+ */
+
+/// Largest digest and key length
+#define OSM_BLAKE2S_LEN 32
+/// Block size
+#define OSM_BLAKE2S_BLOCK 64
+
+/**
+ * Hash state.  A keyed state can be copied after osm_blake2s_init to hash
+ * many messages with the same key without hashing the key again.
+ */
+typedef struct {
+	uint32_t h[8];
+	uint32_t t[2];
+	uint8_t buf[OSM_BLAKE2S_BLOCK];
+	size_t buflen, outlen;
+} OSMBlake2s;
+
+/**
+ * Start a hash
+ * outlen - digest length, 1 to OSM_BLAKE2S_LEN
+ * key - the key for a MAC, or NULL
+ * keylen - 0 to OSM_BLAKE2S_LEN
+ * return - 0 on success, -1 if a length is invalid
+ */
+int osm_blake2s_init(OSMBlake2s *s, size_t outlen, const void *key, size_t keylen);
+
+/**
+ * Compress the key block of a keyed state straight away, so copies of the
+ * state don't hash the key again.  Every message hashed with the state must
+ * then be at least one byte long.
+ */
+void osm_blake2s_precompute(OSMBlake2s *s);
+
+/**
+ * Add data to a hash
+ */
+void osm_blake2s_update(OSMBlake2s *s, const void *data, size_t len);
+
+/**
+ * Finish a hash
+ * out - outlen bytes
+ */
+void osm_blake2s_final(OSMBlake2s *s, uint8_t *out);
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef OSM_CODEC_H
+#define OSM_CODEC_H
+
+#include <osm/protocol.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Frame codec with a fixed wire layout.
+ *
+ * The structs in osm/protocol.h are not sent as they are laid out in
+ * memory: on the wire every field is packed with no padding and multi-byte
+ * integers are little endian.  Frames are parsed in place into views which
+ * point into the receive buffer, and encoded straight into caller buffers.
+ */
+
+/// Wire size of OSMFrameHeader
+#define OSM_WIRE_FRAME_HEADER 21
+/// Wire size of OSMInitFrameHeader
+#define OSM_WIRE_INIT_HEADER 16
+/// Largest wire size of a secondary header
+#define OSM_WIRE_SUB_MAX 12
+/// Wire size of OSMControl
+#define OSM_WIRE_CONTROL 16
+/// Wire size of a control id in a GET frame
+#define OSM_WIRE_CONTROL_ID 8
+/// Largest key in an init frame
+#define OSM_WIRE_KEY_MAX 4096
+
+/// Largest possible frame, a data frame with a full payload
+#define OSM_WIRE_FRAME_MAX (OSM_WIRE_FRAME_HEADER + 3 + UINT16_MAX)
+
+// Little endian helpers
+
+static inline uint16_t osm_get_le16(const uint8_t *p)
+{
+	return (uint16_t) p[0] | (uint16_t) p[1] << 8;
+}
+
+static inline uint32_t osm_get_le32(const uint8_t *p)
+{
+	return (uint32_t) osm_get_le16(p) | (uint32_t) osm_get_le16(p + 2) << 16;
+}
+
+static inline uint64_t osm_get_le64(const uint8_t *p)
+{
+	return (uint64_t) osm_get_le32(p) | (uint64_t) osm_get_le32(p + 4) << 32;
+}
+
+static inline void osm_put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void osm_put_le32(uint8_t *p, uint32_t v)
+{
+	osm_put_le16(p, v);
+	osm_put_le16(p + 2, v >> 16);
+}
+
+static inline void osm_put_le64(uint8_t *p, uint64_t v)
+{
+	osm_put_le32(p, v);
+	osm_put_le32(p + 4, v >> 32);
+}
+
+/**
+ * A parsed frame.  The pointers refer to the buffer it was parsed from and
+ * are only valid as long as it is.
+ */
+typedef struct {
+	const uint8_t *uuid;         // 8 bytes
+	const uint8_t *sub_uuid;     // 8 bytes
+	uint8_t frame_type;
+
+	union {
+		OSMResHeader res;
+		OSMSetHeader set;
+		OSMGetHeader get;
+		OSMDataHeader data;
+		OSMStreamOutHeader stream_out;
+		OSMStreamInHeader stream_in;
+		OSMStreamCloseHeader stream_close;
+	} sub;                       // decoded secondary header
+
+	const uint8_t *payload;      // controls, control ids or data after the headers
+	size_t payload_len;
+	size_t len;                  // length of the whole frame
+} OSMFrameView;
+
+/**
+ * A parsed init frame, pointing into the buffer it was parsed from
+ */
+typedef struct {
+	uint8_t version;
+	const uint8_t *uuid;         // 8 bytes
+	uint8_t keytype;
+	const uint8_t *key;
+	uint16_t keylen;
+	size_t len;                  // length of the whole frame
+} OSMInitView;
+
+/**
+ * Wire size of the secondary header for a frame type
+ * return - the size, or -1 for unknown frame types
+ */
+ssize_t osm_wire_sub_len(uint8_t frame_type);
+
+/**
+ * Work out the length of the init or normal frame at the start of a buffer
+ * from as many bytes of it as are available
+ * return - the frame's length, 0 if more bytes are needed to tell, or -1 if
+ *          the bytes can't be the start of a frame (errno is EBADMSG)
+ */
+ssize_t osm_frame_len(const uint8_t *buf, size_t len);
+
+/**
+ * Validate and parse a normal frame in place
+ * len - bytes available, may be more than the frame
+ * return - 0 on success, -1 if the frame is invalid or incomplete (errno is
+ *          EBADMSG)
+ */
+int osm_frame_parse(OSMFrameView *view, const uint8_t *buf, size_t len);
+
+/**
+ * Validate and parse an init frame in place
+ * return - 0 on success, -1 if the frame is invalid or incomplete (errno is
+ *          EBADMSG)
+ */
+int osm_init_parse(OSMInitView *view, const uint8_t *buf, size_t len);
+
+/**
+ * Get a control from the payload of a SET or RES frame
+ */
+static inline const OSMControl *osm_view_control(const OSMFrameView *view, unsigned int index)
+{
+	return (const OSMControl *)(view->payload + (size_t) index * OSM_WIRE_CONTROL);
+}
+
+/**
+ * Get a control id from the payload of a GET frame
+ */
+static inline uint64_t osm_view_control_id(const OSMFrameView *view, unsigned int index)
+{
+	return osm_get_le64(view->payload + (size_t) index * OSM_WIRE_CONTROL_ID);
+}
+
+/// Get the id of a control
+static inline uint64_t osm_control_id(const OSMControl *control)
+{
+	return osm_get_le64(control->control_id);
+}
+
+/// Get the value of a control
+static inline uint64_t osm_control_value(const OSMControl *control)
+{
+	return osm_get_le64(control->value);
+}
+
+/// Fill in a control
+static inline void osm_control_set(OSMControl *control, uint64_t id, uint64_t value)
+{
+	osm_put_le64(control->control_id, id);
+	osm_put_le64(control->value, value);
+}
+
+/**
+ * Encode a secondary header
+ * buf - at least OSM_WIRE_SUB_MAX bytes
+ * return - bytes written, or -1 for unknown frame types
+ */
+ssize_t osm_sub_encode(uint8_t *buf, uint8_t frame_type, const void *sub_header);
+
+/**
+ * Encode the headers of a normal frame.  The payload is written by the
+ * caller straight after them.
+ * sub_header - the secondary header struct for the frame type, may be NULL
+ *              for frame types without one
+ * return - bytes written, or 0 if the buffer is too small or the frame type
+ *          is unknown
+ */
+size_t osm_frame_encode(uint8_t *buf, size_t size, const OSMFrameHeader *header, const void *sub_header);
+
+/**
+ * Encode an init frame and its key
+ * return - bytes written, or 0 if the buffer is too small or the key too long
+ */
+size_t osm_init_encode(uint8_t *buf, size_t size, const OSMInitFrameHeader *header, const uint8_t *key);
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef OSM_COMPACT_H
+#define OSM_COMPACT_H
+
+#include <osm/device.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Compact encoding of control values for high rate streams.
+ *
+ * A plain control always takes 16 bytes.  The compact encoding only spends
+ * as many bytes as the value needs for its datapoint type:
+ *  - bools take no value bytes in a control, or one byte on their own.
+ *  - integers are sent as the zigzag varint of their difference to the
+ *    previous integer, so small changes take a byte.
+ *  - floats are XORed with the previous float and only the bytes which
+ *    differ are sent after a control byte, so slowly moving samples take a
+ *    few bytes and repeated ones a single byte.
+ *  - control ids are sent as the zigzag varint of their difference to the
+ *    previous id, with the value's type in the low bits of the first byte.
+ *
+ * The encoding is lossless for OSMBool, OSMInteger and OSMFloat values in
+ * their 64 bit control form (see osm_datapoint_encode).  Because values
+ * depend on the ones before them, both sides keep an OSMCompactState and
+ * everything has to be decoded in the order it was encoded.
+ */
+
+/// Largest encoded value
+#define OSM_COMPACT_VALUE_MAX 10
+/// Largest encoded control
+#define OSM_COMPACT_CONTROL_MAX 20
+
+/**
+ * Previous id and values, the same for encoding and decoding
+ */
+typedef struct {
+	uint64_t id;
+	uint64_t integer;
+	uint64_t bits;               // of the previous float
+} OSMCompactState;
+
+/// Map a signed difference to an unsigned one, small either way
+static inline uint64_t osm_zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/// Reverse osm_zigzag
+static inline int64_t osm_unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/**
+ * Write a varint, 7 bits per byte with the high bit set on all but the last
+ * buf - at least 10 bytes
+ * return - bytes written
+ */
+static inline size_t osm_put_varint(uint8_t *buf, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80)
+	{
+		buf[n++] = (uint8_t) v | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = (uint8_t) v;
+	return n;
+}
+
+/**
+ * Read a varint
+ * return - bytes read, or 0 if it is truncated or too long
+ */
+static inline size_t osm_get_varint(const uint8_t *buf, size_t len, uint64_t *v)
+{
+	uint64_t result = 0;
+	for (size_t n = 0; n < len && n < 10; n++)
+	{
+		result |= (uint64_t)(buf[n] & 0x7f) << (7 * n);
+		if (!(buf[n] & 0x80))
+		{
+			*v = result;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Reset a state, at the start of a stream
+ */
+void osm_compact_reset(OSMCompactState *state);
+
+/**
+ * Encode a value whose type both sides know, eg. a stream sample
+ * buf - at least OSM_COMPACT_VALUE_MAX bytes
+ * type - OSM_TYPE_BOOL, OSM_TYPE_INT or OSM_TYPE_FLOAT
+ * return - bytes written, or 0 for other types (errno is EOPNOTSUPP)
+ */
+size_t osm_compact_put_value(OSMCompactState *state, uint8_t *buf, uint8_t type, uint64_t value);
+
+/**
+ * Decode a value whose type both sides know.  The state is left as it was
+ * if decoding fails.
+ * return - bytes read, or -1 on error (errno is EBADMSG, or EOPNOTSUPP for
+ *          unsupported types)
+ */
+ssize_t osm_compact_get_value(OSMCompactState *state, const uint8_t *buf, size_t len, uint8_t type, uint64_t *value);
+
+/**
+ * Encode a control along with its value's type
+ * buf - at least OSM_COMPACT_CONTROL_MAX bytes
+ * return - bytes written, or 0 for unsupported types (errno is EOPNOTSUPP)
+ */
+size_t osm_compact_put_control(OSMCompactState *state, uint8_t *buf, uint8_t type, uint64_t id, uint64_t value);
+
+/**
+ * Decode a control
+ * type - filled in with the value's type
+ * return - bytes read, or -1 if the control is invalid or truncated (errno
+ *          is EBADMSG)
+ */
+ssize_t osm_compact_get_control(OSMCompactState *state, const uint8_t *buf, size_t len,
+	uint8_t *type, uint64_t *id, uint64_t *value);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef OSM_CONN_H
+#define OSM_CONN_H
+
+#include <osm/loop.h>
+#include <osm/workers.h>
+#include <stdbool.h>
+#include <threads.h>
+
+/*
+ * Bounded connection manager.
+ *
+ * Accepted connections are given a slot from a fixed table and their
+ * callback is run on a worker pool, or on a thread of its own.  When every slot is taken the listener
+ * stops accepting (new connections wait in the socket backlog) until a
+ * callback returns and its slot is reaped.
+ *
+ * As with osm_listen_and_serve, each callback owns its connection's fd and
+ * must close it.  The manager keeps a duplicate of the fd so it can drain
+ * connections, and closes only that once the callback returns.
+ */
+
+/// Default limit of concurrent connections
+#define OSM_CONN_DEFAULT_MAX 1024
+
+typedef struct OSMConnManager OSMConnManager;
+
+/**
+ * A connection slot
+ */
+typedef struct {
+	OSMConnManager *manager;
+	int fd;                      // the manager's duplicate, -1 if the slot is free
+	int callback_fd;             // handed to the callback, which owns it
+	unsigned int next_free;
+} OSMConn;
+
+/**
+ * Connection manager state
+ */
+struct OSMConnManager {
+	OSMConn *conns;
+	unsigned int max, active, free_head;
+
+	OSMWorkerPool *pool;
+	thrd_start_t callback;
+
+	OSMLoop *loop;
+	OSMLoopHandle *listener;
+	OSMLoopHandle *retry;        // resumes accepting after running out of fds
+	bool paused, shutting_down;
+
+	mtx_t lock;
+	cnd_t drained;
+};
+
+/**
+ * Initialize a connection manager
+ * max - maximum concurrent connections (0 for OSM_CONN_DEFAULT_MAX, or
+ *       fewer if RLIMIT_NOFILE can't hold two fds for each)
+ * pool - the worker pool to run callbacks on, or NULL to start a thread per
+ *        connection.  A pool only suits callbacks that return promptly, as
+ *        every blocked callback holds one of its workers.
+ * callback - called with each connection's fd, which it must close, the slot is
+ *            reaped when it returns
+ * return - 0 on success, -1 on error
+ */
+int osm_conn_init(OSMConnManager *manager, unsigned int max, OSMWorkerPool *pool, thrd_start_t callback);
+
+/**
+ * Accept connections from a listening socket on a loop.
+ * Must be called from the loop's thread.  When the process runs out of fds,
+ * memory or threads, accepting pauses briefly and resumes.  The loop is
+ * stopped if the listening socket fails.
+ * return - 0 on success, -1 on error
+ */
+int osm_conn_listen(OSMConnManager *manager, OSMLoop *loop, int sockfd);
+
+/**
+ * Get the number of connections currently open (thread safe)
+ */
+unsigned int osm_conn_active(OSMConnManager *manager);
+
+/**
+ * Stop accepting and drain open connections: their read side is shut down,
+ * so callbacks see end of file once they have read the frames already
+ * received, while replies can still be sent.
+ * Must not be called from a connection's callback.
+ * timeout_ms - how long to wait for callbacks to return (0 to wait forever)
+ * return - 0 if every connection finished, -1 on timeout
+ */
+int osm_conn_shutdown(OSMConnManager *manager, unsigned int timeout_ms);
+
+/**
+ * Free the manager and remove its listener.  All connections must have
+ * finished.  Must be called before the loop is ended, from the loop's thread
+ * or while the loop is not running.
+ */
+void osm_conn_end(OSMConnManager *manager);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef OSM_DEVICE_H
 #define OSM_DEVICE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <osm/utils.h>
@@ -11,6 +12,17 @@
 #define OSM_CT_FILE 0
 #define OSM_CT_TCP 1
 
+/// Default directory of onboard device sockets
+#define OSM_ONBOARD_DIR "/run/osm/onboard/"
+
+/// Default number of requests in flight on a device connection
+#define OSM_DEVICE_DEFAULT_DEPTH 8
+/// How long to wait for a device to reply
+#define OSM_DEVICE_TIMEOUT_MS 5000
+
+/// Connection state of a device (see osm/batch.h)
+typedef struct OSMDeviceConn OSMDeviceConn;
+
 /**
  * Device context: can be used to interact with an underlying device
  */
@@ -19,8 +31,52 @@ typedef struct {
 	unsigned int conn_type;
 	char *address;
 	Vector inputs, outputs;
+	OSMDeviceConn *conn;     // NULL until osm_device_connect
+	OSMAllocator *alloc;     // for connection and frame buffers, NULL for the heap
 } OSMDevice;
 
+/**
+ * Create a device context with no name or datapoints yet
+ * conn_type - OSM_CT_FILE or OSM_CT_TCP
+ * address - the socket path or network address (copied)
+ */
+OSMDevice osm_device_new(unsigned int conn_type, const char *address);
+
+/**
+ * Free all data associated with a device context, disconnecting it if
+ * needed
+ */
+void osm_device_free(OSMDevice *dev);
+
+/**
+ * Open a socket to a device.  TCP addresses are numeric, as host:port
+ * with brackets around IPv6 hosts.
+ * nonblock - make the socket non-blocking, a TCP connection may still be in
+ *            progress when it is returned
+ * return - the socket, or -1 on error
+ */
+int osm_device_socket(OSMDevice *dev, bool nonblock);
+
+/**
+ * Connect to a device to read and write its datapoints
+ * depth - requests kept in flight at once (0 for OSM_DEVICE_DEFAULT_DEPTH)
+ * return - 0 on success, -1 on error
+ */
+int osm_device_connect(OSMDevice *dev, unsigned int depth);
+
+/**
+ * Set up a device's connection on a socket from osm_device_socket, which
+ * may still be connecting.  The device takes ownership of fd, even on error.
+ * depth - requests kept in flight at once (0 for OSM_DEVICE_DEFAULT_DEPTH)
+ * return - 0 on success, -1 on error
+ */
+int osm_device_connect_fd(OSMDevice *dev, int fd, unsigned int depth);
+
+/**
+ * Close a device's connection, failing the requests still in flight
+ */
+void osm_device_disconnect(OSMDevice *dev);
+
 // Device datapoint
 
 /// Raw data (rarely used)
@@ -47,11 +103,26 @@ typedef struct {
 	uint8_t flags;     /// Datapoint flags
 } OSMDatapoint;
 
-/// Attempt to read a datapoint from a device
+/**
+ * Convert a datapoint value to the 64 bit value sent in a control
+ * value - an OSMBool, OSMInteger or OSMFloat depending on the datapoint type
+ * return - 0 on success, -1 if the type can't be sent in a control
+ */
+int osm_datapoint_encode(const OSMDatapoint *dat, const void *value, uint64_t *raw);
+
+/**
+ * Convert the 64 bit value of a control to a datapoint value
+ * return - 0 on success, -1 if the type can't be sent in a control
+ */
+int osm_datapoint_decode(const OSMDatapoint *dat, uint64_t raw, void *value);
+
+/// Attempt to read a datapoint from a device, connecting if needed
+/// in - filled in with the value (OSMBool, OSMInteger or OSMFloat)
 /// returns nonzero error code on failure
 int osm_read_datapoint(OSMDevice *dev, OSMDatapoint *dat, void *in);
 
-/// Attempt to write a datapoint to a device
+/// Attempt to write a datapoint to a device, connecting if needed
+/// out - the value to write (OSMBool, OSMInteger or OSMFloat)
 /// returns nonzero error code on failure
 int osm_write_datapoint(OSMDevice *dev, OSMDatapoint *dat, void *out);
 
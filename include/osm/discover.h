@@ -4,7 +4,56 @@
 #include <osm/utils.h>
 #include <osm/device.h>
 
+/**
+ * Find every onboard device socket in a directory
+ * sock_dir - The directory containing osm sockets (or null for the default)
+ * return - a vector of OSMDevice (free each with osm_device_free), the
+ *          devices have an address but no name or datapoints until probed
+ */
 Vector osm_discover_onboard(char *sock_dir);
 
-#endif
+/// Returned by osm_discover_watch_read when changes may have been missed
+#define OSM_DISCOVER_RESCAN (-2)
+
+/**
+ * Watches an onboard socket directory for devices coming and going
+ */
+typedef struct {
+	int fd, wd;                  // wd is -1 once the directory is gone
+	char *dir;
+} OSMDiscoverWatch;
+
+/**
+ * Start watching a directory with inotify.  Start the watch before the
+ * initial osm_discover_onboard so no device is missed in between.
+ * sock_dir - The directory containing osm sockets (or null for the default)
+ * return - 0 on success, -1 on error
+ */
+int osm_discover_watch(OSMDiscoverWatch *watch, char *sock_dir);
+
+/**
+ * Get the pollable file descriptor of a watch, it becomes readable when
+ * there are changes (eg. to add it to an OSMLoop)
+ */
+int osm_discover_watch_fd(OSMDiscoverWatch *watch);
 
+/**
+ * Read the changes since the last call without blocking
+ * added - vector of OSMDevice to append new devices to
+ * removed - vector of char * to append the addresses of removed devices to
+ *           (free each address).  Removed files can't be checked, so
+ *           addresses which were never devices should be ignored.
+ * return - the number of changes, -1 on error, or OSM_DISCOVER_RESCAN if
+ *          the kernel's event queue overflowed or the directory was deleted
+ *          or moved.  The changes appended so far are then incomplete, so
+ *          rescan with osm_discover_onboard.  If wd is -1 the watch no
+ *          longer follows the directory's path, end it and start it again.
+ */
+int osm_discover_watch_read(OSMDiscoverWatch *watch, Vector *added, Vector *removed);
+
+/**
+ * Stop watching and free the watch
+ */
+void osm_discover_watch_end(OSMDiscoverWatch *watch);
+
+#endif
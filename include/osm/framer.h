@@ -0,0 +1,86 @@
+#ifndef OSM_FRAMER_H
+#define OSM_FRAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Reassembles frames from a byte stream (TCP connections on port 1200).
+ *
+ * Each connection has one ring buffer which is mapped twice, back to back,
+ * so both the free space to read into and every buffered frame are
+ * contiguous even when they wrap around.  Complete init and normal frames
+ * are returned in place, ready for osm_frame_parse/osm_init_parse.
+ *
+ * If the stream does not start with a magic number the framer skips ahead
+ * to the next one.
+ *
+ * On authenticated connections set trailer to OSM_AUTH_TAG_LEN, so each
+ * normal frame is returned along with its tag.
+ */
+
+/// Default ring size
+#define OSM_FRAMER_DEFAULT_SIZE (1 << 17)
+
+typedef struct {
+	uint8_t *buf;                // mapped twice, buf[i] is buf[i + size]
+	size_t size;
+	uint64_t head;               // total bytes written
+	uint64_t tail;               // total bytes framed
+	uint64_t keep;               // start of the frames handed out since the last read
+	uint64_t skipped;            // total bytes discarded while resyncing
+	size_t trailer;              // bytes following every normal frame, eg. an authentication tag
+} OSMFramer;
+
+/**
+ * Set up a framer's ring buffer
+ * size - ring size, rounded up to a power of two which holds at least a page
+ *        and OSM_WIRE_FRAME_MAX (0 for OSM_FRAMER_DEFAULT_SIZE)
+ * return - 0 on success, -1 on error
+ */
+int osm_framer_init(OSMFramer *framer, size_t size);
+
+/**
+ * Get the free space to write received bytes into, for callers doing their
+ * own reads (eg. with io_uring).  Frames returned by osm_framer_next are
+ * released.
+ * len - filled in with the size of the space
+ */
+uint8_t *osm_framer_space(OSMFramer *framer, size_t *len);
+
+/**
+ * Add bytes written into the space from osm_framer_space
+ */
+void osm_framer_produce(OSMFramer *framer, size_t len);
+
+/**
+ * Read as much as fits from a stream socket.  Frames returned by
+ * osm_framer_next are released.
+ * return - the number of bytes read, 0 if the peer closed the connection, or
+ *          -1 on error (errno is EAGAIN on non-blocking sockets with nothing
+ *          to read, ENOBUFS if the buffered frames fill the ring)
+ */
+ssize_t osm_framer_read(OSMFramer *framer, int fd);
+
+/**
+ * Get the next complete frame, resyncing on the next magic number if the
+ * buffered bytes aren't a frame.  The frame stays valid until the next
+ * osm_framer_read or osm_framer_space.
+ * frame - filled in with the start of the frame
+ * len - filled in with the length of the frame
+ * return - 1 if a frame was returned, 0 if more bytes are needed
+ */
+int osm_framer_next(OSMFramer *framer, const uint8_t **frame, size_t *len);
+
+/**
+ * Drop everything buffered
+ */
+void osm_framer_reset(OSMFramer *framer);
+
+/**
+ * Unmap a framer's ring buffer
+ */
+void osm_framer_end(OSMFramer *framer);
+
+#endif
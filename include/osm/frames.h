@@ -0,0 +1,71 @@
+#ifndef OSM_FRAMES_H
+#define OSM_FRAMES_H
+
+#include <osm/codec.h>
+#include <osm/protocol.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Batched frame I/O for message based (SOCK_SEQPACKET) onboard sockets.
+ * Every frame is one message, and a whole batch is sent or received with
+ * a single sendmmsg/recvmmsg call.
+ */
+
+/// Frames handled per syscall
+#define OSM_FRAME_BATCH 64
+
+/**
+ * A frame to send, gathered from its header, the encoded secondary header
+ * for its frame type, an optional payload and an optional authentication
+ * tag (see osm/auth.h)
+ */
+typedef struct {
+	OSMFrameHeader *header;
+	uint8_t sub[OSM_WIRE_SUB_MAX];
+	size_t sub_len;
+	void *payload;             // may be NULL
+	size_t payload_len;
+	const uint8_t *tag;        // may be NULL
+	size_t tag_len;
+} OSMFrameOut;
+
+/**
+ * A buffer to receive a frame into
+ */
+typedef struct {
+	void *buf;
+	size_t size;
+	size_t len;                // filled in: bytes received
+	bool truncated;            // filled in: frame was larger than size
+} OSMFrameIn;
+
+/**
+ * Wire size of the secondary header for a frame type
+ * return - the size, or 0 for unknown frame types
+ */
+size_t osm_sub_header_len(uint8_t frame_type);
+
+/**
+ * Fill in a frame to send, encoding the secondary header for the frame type
+ * sub_header - the secondary header struct, may be NULL
+ */
+OSMFrameOut osm_frame_out(OSMFrameHeader *header, const void *sub_header, void *payload, size_t payload_len);
+
+/**
+ * Send up to count frames, OSM_FRAME_BATCH per syscall
+ * flags - flags for sendmmsg (eg. MSG_DONTWAIT)
+ * return - the number of frames sent, or -1 if none could be sent
+ */
+int osm_send_frames(int fd, OSMFrameOut *frames, unsigned int count, int flags);
+
+/**
+ * Receive up to count frames with one syscall, waiting for at least one
+ * unless flags contains MSG_DONTWAIT
+ * flags - flags for recvmmsg
+ * return - the number of frames received, 0 if the connection closed,
+ *          or -1 on error
+ */
+int osm_recv_frames(int fd, OSMFrameIn *frames, unsigned int count, int flags);
+
+#endif
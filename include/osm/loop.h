@@ -0,0 +1,154 @@
+#ifndef OSM_LOOP_H
+#define OSM_LOOP_H
+
+#include <osm/utils.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <threads.h>
+
+/*
+ * Event loop (reactor) built on epoll.
+ *
+ * A loop is driven by a single thread calling osm_loop_run.  To serve
+ * connections from more than one thread, create one loop per thread and
+ * register the same listening socket with each of them.
+ *
+ * Handles and loop functions may only be used from the thread running the
+ * loop (usually from inside a callback), with the exception of
+ * osm_loop_post and osm_loop_stop, which may be called from any thread.
+ */
+
+/// The handle wants read-ready callbacks
+#define OSM_LOOP_READ  0b01
+/// The handle wants write-ready callbacks
+#define OSM_LOOP_WRITE 0b10
+
+typedef struct OSMLoop OSMLoop;
+typedef struct OSMLoopHandle OSMLoopHandle;
+
+/// Called when a handle is ready (or a timer has expired)
+typedef void (*OSMLoopCallback)(OSMLoop *loop, OSMLoopHandle *handle, void *data);
+
+/// Function posted to a loop from another thread
+typedef void (*OSMLoopTask)(OSMLoop *loop, void *data);
+
+/// Called with each accepted connection, or with -1 (and errno set) if the
+/// listening socket failed and was removed from the loop
+typedef void (*OSMAcceptCallback)(OSMLoop *loop, int fd, void *data);
+
+/**
+ * A file descriptor registered with a loop.
+ * All fields are owned by the loop and should be treated as read only.
+ */
+struct OSMLoopHandle {
+	int fd;
+	unsigned int events;
+	bool closed, timer;
+	OSMLoopCallback on_read, on_write;
+	OSMAcceptCallback on_accept;
+	OSMLoopHandle *retry;        // a listener's timer for backing off
+	void *data;
+	OSMLoopHandle *prev, *next;
+};
+
+/**
+ * Epoll reactor state
+ */
+struct OSMLoop {
+	int epfd;
+	bool running;
+	OSMLoopHandle *handles;
+	Vector closed;
+	OSMMpscRing *posted;         // tasks posted from any thread
+	atomic_bool overflowing;     // posts go to overflow until it is drained
+	mtx_t lock;
+	Vector overflow;             // tasks posted while the ring was full
+};
+
+/**
+ * Initialize a new loop
+ * return - 0 on success, -1 on error
+ */
+int osm_loop_init(OSMLoop *loop);
+
+/**
+ * Run the loop on the calling thread until osm_loop_stop is called
+ * return - 0 if the loop was stopped, -1 on error
+ */
+int osm_loop_run(OSMLoop *loop);
+
+/**
+ * Ask the loop to return from osm_loop_run (thread safe)
+ */
+void osm_loop_stop(OSMLoop *loop);
+
+/**
+ * Run a function on the loop's thread during the next iteration (thread safe)
+ * return - 0 on success, -1 on error
+ */
+int osm_loop_post(OSMLoop *loop, OSMLoopTask task, void *data);
+
+/**
+ * Free all handles and resources associated with the loop.
+ * The loop must not be running.  Registered file descriptors are not closed.
+ */
+void osm_loop_end(OSMLoop *loop);
+
+/**
+ * Register a file descriptor with the loop
+ * fd - the file descriptor to watch
+ * events - a combination of OSM_LOOP_READ and OSM_LOOP_WRITE
+ * on_read - called when the fd is readable, hung up or in error (may be NULL)
+ * on_write - called when the fd is writable (may be NULL)
+ * return - the new handle, or NULL on error
+ */
+OSMLoopHandle *osm_loop_add(OSMLoop *loop, int fd, unsigned int events,
+	OSMLoopCallback on_read, OSMLoopCallback on_write, void *data);
+
+/**
+ * Change the events a handle is interested in
+ * May also be called from other threads, as long as the caller serializes
+ * all calls for the handle and it is not removed concurrently.
+ * return - 0 on success, -1 on error
+ */
+int osm_loop_mod(OSMLoop *loop, OSMLoopHandle *handle, unsigned int events);
+
+/**
+ * Remove a handle from the loop.  The handle is freed once the current
+ * iteration has finished, so it is safe to call from its own callbacks.
+ * The file descriptor is not closed (timers excepted).
+ */
+void osm_loop_del(OSMLoop *loop, OSMLoopHandle *handle);
+
+/**
+ * Create a timer which calls callback after ms milliseconds
+ * repeat - if true, keep calling callback every ms milliseconds
+ * return - the timer's handle (remove with osm_loop_del), or NULL on error
+ */
+OSMLoopHandle *osm_loop_timer(OSMLoop *loop, unsigned int ms, bool repeat,
+	OSMLoopCallback callback, void *data);
+
+/**
+ * Re-arm a timer, replacing when it was due to fire
+ * ms, repeat - as for osm_loop_timer
+ * return - 0 on success, -1 on error
+ */
+int osm_loop_timer_set(OSMLoop *loop, OSMLoopHandle *timer, unsigned int ms, bool repeat);
+
+/**
+ * Disarm a timer without removing it, so it can be re-armed later with
+ * osm_loop_timer_set
+ * return - 0 on success, -1 on error
+ */
+int osm_loop_timer_cancel(OSMLoop *loop, OSMLoopHandle *timer);
+
+/**
+ * Accept connections from a listening socket on the loop.
+ * The listening socket is switched to non-blocking mode, accepted
+ * connections are left in blocking mode.  When the process runs out of
+ * file descriptors or memory, accepting pauses briefly and resumes.
+ * return - the listener's handle, or NULL on error
+ */
+OSMLoopHandle *osm_loop_listen(OSMLoop *loop, int sockfd, OSMAcceptCallback callback, void *data);
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef OSM_METRICS_H
+#define OSM_METRICS_H
+
+#include <osm/loop.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
+
+/*
+ * Runtime metrics.
+ *
+ * Counters and latency histograms are kept per thread: each thread updates
+ * its own shard without atomic read-modify-write instructions or locks, and
+ * readers merge every shard into a snapshot.  Recording a counter costs a
+ * thread-local load and an add, so it can be left on in the hot paths
+ * (accepting connections, frame I/O and device calls).
+ *
+ * Shards of threads which have exited are kept, so their counts aren't
+ * lost, and are reused by new threads.
+ *
+ * Histograms are log-linear (HDR style): OSM_HIST_SUB buckets for every
+ * power of two, so any recorded value is within 1/OSM_HIST_SUB of the
+ * bucket's value.
+ *
+ * A snapshot can be served as JSON on a unix socket (osm_metrics_serve),
+ * eg. `socat - UNIX-CONNECT:/run/osm/stats`.
+ */
+
+/// Default path of the stats socket
+#define OSM_METRICS_SOCKET "/run/osm/stats"
+
+/*
+ * Counters
+ */
+#define OSM_M_ACCEPTS         0  ///< Connections accepted
+#define OSM_M_ACCEPT_ERRORS   1  ///< Listening sockets which failed
+#define OSM_M_CONNECTS        2  ///< Device connections opened
+#define OSM_M_FRAMES_IN       3  ///< Frames received
+#define OSM_M_FRAMES_OUT      4  ///< Frames sent
+#define OSM_M_BYTES_IN        5  ///< Bytes received
+#define OSM_M_BYTES_OUT       6  ///< Bytes sent
+#define OSM_M_FRAME_ERRORS    7  ///< Truncated frames, or garbage skipped by a framer
+#define OSM_M_DEVICE_CALLS    8  ///< Request frames answered or failed
+#define OSM_M_DEVICE_ERRORS   9  ///< Request frames which failed
+#define OSM_M_DEVICE_INFLIGHT 10 ///< Request frames awaiting a reply (a gauge)
+#define OSM_METRIC_COUNT      11
+
+/*
+ * Histograms
+ */
+#define OSM_H_DEVICE_CALL 0      ///< Nanoseconds from sending a request frame to its reply
+#define OSM_HIST_COUNT    1
+
+/// Sub-buckets per power of two
+#define OSM_HIST_SUB_BITS 4
+#define OSM_HIST_SUB (1 << OSM_HIST_SUB_BITS)
+#define OSM_HIST_BUCKETS ((64 - OSM_HIST_SUB_BITS + 1) * OSM_HIST_SUB)
+
+/**
+ * Log-linear histogram.  It is written by one thread at a time, and may be
+ * read from others while it is being written.
+ */
+typedef struct {
+	uint64_t counts[OSM_HIST_BUCKETS];
+	uint64_t count, sum, max;
+} OSMHist;
+
+typedef struct OSMMetricsShard OSMMetricsShard;
+
+/**
+ * Metrics of one thread
+ */
+struct OSMMetricsShard {
+	alignas(64) uint64_t counters[OSM_METRIC_COUNT];
+	OSMHist hists[OSM_HIST_COUNT];
+	atomic_bool free;            // the thread exited, the shard can be reused
+	OSMMetricsShard *next;
+};
+
+/**
+ * Merged metrics of every thread
+ */
+typedef struct {
+	uint64_t counters[OSM_METRIC_COUNT];
+	OSMHist hists[OSM_HIST_COUNT];
+	unsigned int shards;         // how many were merged
+} OSMMetrics;
+
+/**
+ * Stats socket serving JSON snapshots
+ */
+typedef struct {
+	OSMLoop *loop;
+	OSMLoopHandle *handle;
+	char path[108];
+} OSMMetricsServer;
+
+/// The calling thread's shard, NULL until it records something
+extern thread_local OSMMetricsShard *osm_metrics_local __attribute__((tls_model("initial-exec")));
+
+/**
+ * Give the calling thread a shard
+ * return - the shard, or NULL if it couldn't be allocated
+ */
+OSMMetricsShard *osm_metrics_attach(void);
+
+/// Add to a value which only the calling thread writes, but others may read
+static inline void osm_relaxed_add(uint64_t *p, uint64_t n)
+{
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/// Bucket of a value
+static inline unsigned int osm_hist_index(uint64_t v)
+{
+	if (v < OSM_HIST_SUB)
+		return v;
+
+	unsigned int exp = 63 - __builtin_clzll(v);
+	unsigned int sub = (v >> (exp - OSM_HIST_SUB_BITS)) & (OSM_HIST_SUB - 1);
+	return (exp - OSM_HIST_SUB_BITS + 1) * OSM_HIST_SUB + sub;
+}
+
+/// Smallest value in a bucket
+static inline uint64_t osm_hist_value(unsigned int index)
+{
+	if (index < OSM_HIST_SUB)
+		return index;
+
+	unsigned int exp = index / OSM_HIST_SUB + OSM_HIST_SUB_BITS - 1;
+	uint64_t sub = index % OSM_HIST_SUB;
+	return (1ull << exp) | sub << (exp - OSM_HIST_SUB_BITS);
+}
+
+/**
+ * Record a value in a histogram
+ */
+static inline void osm_hist_add(OSMHist *hist, uint64_t v)
+{
+	osm_relaxed_add(&hist->counts[osm_hist_index(v)], 1);
+	osm_relaxed_add(&hist->count, 1);
+	osm_relaxed_add(&hist->sum, v);
+	if (v > hist->max)
+		__atomic_store_n(&hist->max, v, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add to a counter
+ * metric - one of OSM_M_*
+ */
+static inline void osm_metric_add(unsigned int metric, uint64_t n)
+{
+	OSMMetricsShard *shard = osm_metrics_local;
+	if (shard == NULL && (shard = osm_metrics_attach()) == NULL)
+		return;
+	osm_relaxed_add(&shard->counters[metric], n);
+}
+
+/**
+ * Subtract from a gauge, possibly on another thread than the one which
+ * added to it
+ */
+static inline void osm_metric_sub(unsigned int metric, uint64_t n)
+{
+	osm_metric_add(metric, -n);
+}
+
+/**
+ * Record a value in a histogram
+ * hist - one of OSM_H_*
+ */
+static inline void osm_metric_record(unsigned int hist, uint64_t v)
+{
+	OSMMetricsShard *shard = osm_metrics_local;
+	if (shard == NULL && (shard = osm_metrics_attach()) == NULL)
+		return;
+	osm_hist_add(&shard->hists[hist], v);
+}
+
+/**
+ * Get a monotonic timestamp for latency histograms
+ * return - nanoseconds
+ */
+uint64_t osm_metrics_now(void);
+
+/**
+ * Add one histogram to another
+ */
+void osm_hist_merge(OSMHist *hist, const OSMHist *other);
+
+/**
+ * Get a percentile of a histogram
+ * p - the percentile, 0 to 100
+ * return - the value of its bucket, or 0 if the histogram is empty
+ */
+uint64_t osm_hist_percentile(const OSMHist *hist, double p);
+
+/**
+ * Merge the metrics of every thread.  Counts are read without stopping
+ * the threads updating them, so a snapshot may be slightly behind.
+ */
+void osm_metrics_snapshot(OSMMetrics *metrics);
+
+/**
+ * Get the name of a counter, as used in JSON snapshots
+ * return - the name, or NULL if there is no such counter
+ */
+const char *osm_metric_name(unsigned int metric);
+
+/**
+ * Get the name of a histogram, as used in JSON snapshots
+ * return - the name, or NULL if there is no such histogram
+ */
+const char *osm_hist_name(unsigned int hist);
+
+/**
+ * Write a snapshot as a JSON object on one line
+ * return - the length it needs (without the terminating null), like snprintf
+ */
+size_t osm_metrics_format(const OSMMetrics *metrics, char *buf, size_t size);
+
+/**
+ * Serve a snapshot to everything connecting to a unix socket, then close the
+ * connection.  A socket left at the path by an exited process is replaced
+ * (see osm_socket_stale), anything else there is an error.
+ * path - the socket's path, or NULL for OSM_METRICS_SOCKET (whose directory
+ *        is created if needed)
+ * return - 0 on success, -1 on error
+ */
+int osm_metrics_serve(OSMMetricsServer *server, OSMLoop *loop, const char *path);
+
+/**
+ * Stop serving snapshots and remove the socket.  Call it from the loop's
+ * thread or while the loop is not running.
+ */
+void osm_metrics_server_end(OSMMetricsServer *server);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef OSM_PROBE_H
+#define OSM_PROBE_H
+
+#include <osm/device.h>
+#include <osm/utils.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Parallel device probing.
+ *
+ * Every device is connected to at once with non-blocking sockets and sent a
+ * request, and the replies are handed to a callback which fills in the
+ * device's name and datapoints.  A scan takes as long as the slowest device
+ * which answers, bounded by the deadlines.
+ */
+
+/// Size of the receive buffer for each device
+#define OSM_PROBE_BUF_SIZE 4352
+
+/// Default deadline for a single device
+#define OSM_PROBE_DEVICE_MS 500
+/// Default deadline for the whole probe
+#define OSM_PROBE_TOTAL_MS 2000
+
+/**
+ * Write the request to send to a device into buf
+ * return - the length of the request, or 0 to fail the device
+ */
+typedef size_t (*OSMProbeRequest)(OSMDevice *dev, uint8_t *buf, size_t size, void *data);
+
+/**
+ * Handle data received from a device.  On onboard sockets buf holds a single
+ * frame, on TCP connections it holds everything received so far.
+ * return - 1 when the device has been fully probed, 0 to wait for more
+ *          data, -1 to fail the device
+ */
+typedef int (*OSMProbeReply)(OSMDevice *dev, const uint8_t *buf, size_t len, void *data);
+
+typedef struct {
+	unsigned int device_ms;      // 0 for OSM_PROBE_DEVICE_MS
+	unsigned int total_ms;       // 0 for OSM_PROBE_TOTAL_MS
+	OSMProbeRequest request;     // NULL to send a GET frame for no datapoints
+	OSMProbeReply reply;         // NULL to accept any OSM_FT_RES frame
+	void *data;                  // passed to request and reply
+} OSMProbeOptions;
+
+/**
+ * Probe devices in parallel
+ * devices - vector of OSMDevice to probe, afterwards only holds the devices
+ *           which answered
+ * timed_out - vector of OSMDevice to move the devices which missed a
+ *             deadline, refused the connection or failed to
+ * opt - probe options, or NULL for the defaults
+ * return - the number of devices which answered, or -1 on error
+ */
+int osm_probe_devices(Vector *devices, Vector *timed_out, const OSMProbeOptions *opt);
+
+#endif
@@ -17,6 +17,8 @@
 extern const char OSM_MAGIC_INIT[4];
 /// The magic number for normal frames
 extern const char OSM_MAGIC_FRAME[4];
+/// The magic number for shared memory transport negotiation (see osm/shm.h)
+extern const char OSM_MAGIC_SHM[4];
 
 /**
  * The init frame header from the controller
@@ -93,15 +95,17 @@ typedef struct {
 #define OSM_FT_SCL 6
 
 /**
- * Result of a sent frame
+ * Result of a sent frame, followed by num_res OSMControl with the values
+ * requested (if any)
  */
 typedef struct {
 	uint8_t res_type;   // the type of frame we are replying to
+	uint8_t num_res;    // number of controls which follow
 } OSMResHeader;
 
 /**
  * Header for frames where we are attempting to set
- * data on the other device
+ * data on the other device, followed by num_set OSMControl
  */
 typedef struct {
 	uint8_t num_set;
@@ -109,7 +113,7 @@ typedef struct {
 
 /**
  * Header for frames where we are attempting to get
- * data from the other device
+ * data from the other device, followed by num_get control ids
  */
 typedef struct {
 	uint8_t num_get;
@@ -124,18 +128,45 @@ typedef struct {
 	uint16_t len;        // How many significant bytes are in this frame
 } OSMDataHeader;
 
+/// Stream frame only grants more credits on an open stream
+#define OSM_STREAM_F_CREDIT 0b01
+/**
+ * Data on the stream uses the compact sample encoding (see osm/compact.h).
+ * Offered by the side opening a stream and accepted by the other side:
+ *  - opened with an SVO, the receiver of the data sets the flag on the
+ *    SVI carrying its first credits.
+ *  - opened with an SVI, the sender of the data answers with an SVO with
+ *    OSM_STREAM_F_CREDIT and the flag set.
+ * Without the flag in the answer the stream carries plain values.
+ */
+#define OSM_STREAM_F_COMPACT 0b10
+
 /**
  * Header for streams where we are going to send a
- * continuous stream of data to the other device
+ * continuous stream of data to the other device.
+ * Data is sent in OSMDataHeader frames with the stream's number, one frame
+ * for each credit the other device has granted.
  */
 typedef struct {
+	uint8_t number;              // the stream's number
+	uint8_t flags;               // OSM_STREAM_F_*
+	uint16_t credits;            // unused (the receiver grants credits)
+	uint64_t control_id;         // the control the stream carries
 } OSMStreamOutHeader;
 
 /**
  * Header for streams where we are asking for
- * a continuous data stream from the other device
+ * a continuous data stream from the other device.
+ * Also sent with OSM_STREAM_F_CREDIT by the receiver of either kind of
+ * stream to grant the sender more credits.  The sender takes max_len from
+ * the first one it receives.
  */
 typedef struct {
+	uint8_t number;              // the stream's number
+	uint8_t flags;               // OSM_STREAM_F_*
+	uint16_t credits;            // data frames the other device may send
+	uint64_t control_id;         // the control the stream carries
+	uint16_t max_len;            // largest data payload the other device may send
 } OSMStreamInHeader;
 
 /**
@@ -143,8 +174,12 @@ typedef struct {
  * a previously opened stream.
  */
 typedef struct {
+	uint8_t number;              // the stream's number
 } OSMStreamCloseHeader;
 
+/**
+ * A control value as sent on the wire, both fields are little endian
+ */
 typedef struct {
 	uint8_t control_id[8];       // The ID of the control we are setting the value on
 	uint8_t value[8];            // The new value for the control, or the data frame number we will next use
@@ -0,0 +1,112 @@
+#ifndef OSM_SHM_H
+#define OSM_SHM_H
+
+#include <osm/protocol.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory transport for data frames between processes on the same
+ * board.
+ *
+ * The sending side creates a memfd backed ring buffer and passes it over an
+ * onboard socket with SCM_RIGHTS.  Afterwards OSMDataHeader payloads are
+ * written straight into the ring and read in place by the receiver, and the
+ * socket only carries one byte doorbells to wake a side which is waiting for
+ * data or for space.
+ *
+ * Each OSMShm is used by a single thread on each side.
+ */
+
+/// Default size of the ring's data area
+#define OSM_SHM_DEFAULT_SIZE (1 << 22)
+
+/**
+ * The header at the start of the shared memory, producer and consumer
+ * fields are kept on separate cache lines
+ */
+typedef struct {
+	uint8_t magic[4];
+	uint32_t size;
+
+	_Alignas(64) _Atomic uint64_t head;
+	atomic_uint producer_waiting;
+
+	_Alignas(64) _Atomic uint64_t tail;
+	atomic_uint consumer_waiting;
+} OSMShmHeader;
+
+/**
+ * One side of a shared memory transport
+ */
+typedef struct {
+	int sockfd, memfd;
+	bool producer;
+
+	OSMShmHeader *header;
+	uint8_t *data;
+	size_t map_len;
+	uint32_t size;
+
+	uint64_t pos;            // producer: head once committed, consumer: tail
+	uint32_t pending;        // size of the record reserved or being read
+} OSMShm;
+
+/**
+ * Create a ring and offer it to the peer on an onboard socket, waiting for
+ * the peer to accept it
+ * size - size of the data area, a power of two (0 for OSM_SHM_DEFAULT_SIZE)
+ * return - 0 on success, -1 on error (the socket can still be used normally)
+ */
+int osm_shm_offer(OSMShm *shm, int sockfd, uint32_t size);
+
+/**
+ * Wait for and accept a ring offered by the peer
+ * return - 0 on success, -1 on error
+ */
+int osm_shm_accept(OSMShm *shm, int sockfd);
+
+/**
+ * Reserve space for a payload in the ring, to be written in place and then
+ * published with osm_shm_commit
+ * wait - wait for the consumer to free space if the ring is full
+ * return - where to write the payload, or NULL on error (errno is EAGAIN if
+ *          full and not waiting, EMSGSIZE if it can never fit)
+ */
+void *osm_shm_reserve(OSMShm *shm, const OSMDataHeader *header, bool wait);
+
+/**
+ * Publish the payload reserved by osm_shm_reserve and ring the doorbell if
+ * the consumer is waiting
+ * return - 0 on success, -1 on error
+ */
+int osm_shm_commit(OSMShm *shm);
+
+/**
+ * Copy a payload into the ring and publish it
+ * return - 0 on success, -1 on error
+ */
+int osm_shm_send(OSMShm *shm, const OSMDataHeader *header, const void *payload, bool wait);
+
+/**
+ * Get the next payload, in place.  It stays valid until osm_shm_release.
+ * header - filled in with the payload's data header
+ * wait - wait for the producer if the ring is empty
+ * return - the payload, or NULL on error (errno is EAGAIN if empty and not
+ *          waiting, ECONNRESET if the producer went away)
+ */
+const void *osm_shm_recv(OSMShm *shm, OSMDataHeader *header, bool wait);
+
+/**
+ * Give the space of the last received payload back to the producer
+ */
+void osm_shm_release(OSMShm *shm);
+
+/**
+ * Unmap the ring.  The socket is not closed.
+ */
+void osm_shm_end(OSMShm *shm);
+
+#endif
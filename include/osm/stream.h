@@ -0,0 +1,207 @@
+#ifndef OSM_STREAM_H
+#define OSM_STREAM_H
+
+#include <osm/codec.h>
+#include <osm/compact.h>
+#include <osm/frames.h>
+#include <osm/protocol.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Stream engine for SVO/SVI streams on one connection.
+ *
+ * Streams are multiplexed by OSMDataHeader.number and use credit based flow
+ * control: the receiver of a stream grants the sender one credit for each
+ * data frame it has room to buffer, and the sender may only send while it
+ * has credits.  A receiver never buffers more than its window and a sender
+ * never queues at all: writing without credits fails with EAGAIN, so a fast
+ * producer is pushed back instead of overrunning a slow consumer.
+ *
+ * Credits are granted back in batches as the consumer releases frames.
+ *
+ * Streams of samples of one control can negotiate the compact encoding
+ * (OSM_STREAM_F_COMPACT) when both engines enable it, falling back to plain
+ * 8 byte values otherwise.
+ *
+ * An engine is used by one thread at a time.
+ */
+
+/// Default window of buffered data frames for incoming streams
+#define OSM_STREAM_DEFAULT_WINDOW 16
+/// Default largest data payload for incoming streams
+#define OSM_STREAM_DEFAULT_MAX_LEN 1024
+/// Number of streams on a connection
+#define OSM_STREAM_MAX 256
+
+/*
+ * Stream states
+ */
+#define OSM_STREAM_CLOSED  0
+#define OSM_STREAM_OPENING 1     ///< Outgoing stream waiting for its first credits
+#define OSM_STREAM_OPEN    2
+
+/*
+ * Stream events
+ */
+#define OSM_STREAM_EV_OPENED 0   ///< The peer opened a stream, or granted the first credits for ours
+#define OSM_STREAM_EV_DATA   1   ///< Data was buffered on an incoming stream
+#define OSM_STREAM_EV_CREDIT 2   ///< An outgoing stream was granted more credits
+#define OSM_STREAM_EV_CLOSED 3   ///< The peer closed or refused a stream
+
+typedef struct OSMStreamEngine OSMStreamEngine;
+
+/**
+ * Send a frame to the peer
+ * return - 0 on success, -1 on error
+ */
+typedef int (*OSMStreamSend)(OSMFrameOut *frame, void *data);
+
+/**
+ * Called when something happens on a stream
+ */
+typedef void (*OSMStreamEvent)(OSMStreamEngine *engine, uint8_t number, int event, void *data);
+
+/**
+ * State of one stream
+ */
+typedef struct {
+	uint8_t state;
+	bool outgoing;               // we send the data
+	uint64_t control_id;
+	unsigned int max_len;        // largest data payload the receiver accepts
+
+	// Outgoing streams
+	unsigned int credits;        // data frames we may still send
+
+	// Incoming streams
+	uint8_t *slots;              // window buffers of max_len bytes
+	uint16_t *lens;
+	unsigned int window;
+	unsigned int head, tail;     // data frames buffered and consumed
+	unsigned int granted;        // credits the peer still holds
+
+	// Samples
+	bool compact;                // data uses the compact encoding
+	OSMCompactState samples;
+	unsigned int offset;         // samples already read from the oldest frame
+} OSMStream;
+
+/**
+ * Streams of one connection
+ */
+struct OSMStreamEngine {
+	OSMFrameHeader header;       // used for every frame sent
+
+	OSMStreamSend send;
+	OSMStreamEvent event;
+	void *data;
+
+	unsigned int window, max_len;
+	bool compact;                // offer and accept compact samples
+	OSMStream streams[OSM_STREAM_MAX];
+};
+
+/**
+ * Initialize a stream engine
+ * header - uuids to send frames with
+ * send - sends frames to the peer
+ * event - called on stream events, may be NULL
+ * data - passed to send and event
+ */
+void osm_stream_init(OSMStreamEngine *engine, const OSMFrameHeader *header, OSMStreamSend send, OSMStreamEvent event, void *data);
+
+/**
+ * Set the window and payload limit used for streams the peer opens
+ * window - buffered data frames (0 for OSM_STREAM_DEFAULT_WINDOW)
+ * max_len - largest payload (0 for OSM_STREAM_DEFAULT_MAX_LEN)
+ */
+void osm_stream_limits(OSMStreamEngine *engine, unsigned int window, unsigned int max_len);
+
+/**
+ * Offer the compact sample encoding on streams we open, and accept it on
+ * streams the peer opens
+ */
+void osm_stream_compact(OSMStreamEngine *engine, bool enable);
+
+/**
+ * Handle a stream frame from the peer: SVO, SVI, SCL or data for a stream
+ * return - 1 if the frame was handled, 0 if it isn't for the engine, -1 if
+ *          the peer broke the protocol (errno is EPROTO) or sending failed
+ */
+int osm_stream_handle(OSMStreamEngine *engine, const OSMFrameView *view);
+
+/**
+ * Open a stream to send data on.  Writes fail until the peer grants credits.
+ * return - 0 on success, -1 on error (errno is EBUSY if the number is in use)
+ */
+int osm_stream_open_out(OSMStreamEngine *engine, uint8_t number, uint64_t control_id);
+
+/**
+ * Ask the peer to stream data to us
+ * window - buffered data frames (0 for the engine's window)
+ * max_len - largest payload (0 for the engine's limit)
+ * return - 0 on success, -1 on error (errno is EBUSY if the number is in use)
+ */
+int osm_stream_open_in(OSMStreamEngine *engine, uint8_t number, uint64_t control_id, unsigned int window, unsigned int max_len);
+
+/**
+ * Get the number of data frames which may be sent on an outgoing stream
+ */
+unsigned int osm_stream_credits(OSMStreamEngine *engine, uint8_t number);
+
+/**
+ * Send one data frame on an outgoing stream
+ * return - 0 on success, -1 on error (errno is EAGAIN without credits, or
+ *          EMSGSIZE if the payload is larger than the receiver accepts)
+ */
+int osm_stream_write(OSMStreamEngine *engine, uint8_t number, const void *payload, uint16_t len);
+
+/**
+ * Get the oldest buffered data frame of an incoming stream, in place.  It
+ * stays valid until osm_stream_release.
+ * len - filled in with the payload's length
+ * return - the payload, or NULL if nothing is buffered (errno is EAGAIN)
+ */
+const void *osm_stream_read(OSMStreamEngine *engine, uint8_t number, uint16_t *len);
+
+/**
+ * Release the oldest buffered data frame, granting the peer more credits
+ * once enough have been released
+ * return - 0 on success, -1 if sending the credits failed
+ */
+int osm_stream_release(OSMStreamEngine *engine, uint8_t number);
+
+/**
+ * Send samples of the stream's control in one data frame, as many as fit in
+ * the payload limit the receiver announced
+ * type - OSM_TYPE_BOOL, OSM_TYPE_INT or OSM_TYPE_FLOAT
+ * values - control values (see osm_datapoint_encode)
+ * return - the number of samples sent, or -1 on error (errno is EAGAIN
+ *          without credits)
+ */
+int osm_stream_write_samples(OSMStreamEngine *engine, uint8_t number, uint8_t type, const uint64_t *values, unsigned int count);
+
+/**
+ * Read buffered samples of an incoming stream, releasing each data frame
+ * once all of its samples have been read.  Samples before an invalid one are
+ * returned first, the next call fails and drops the rest of that frame.
+ * values - filled in with up to max control values
+ * return - the number of samples read, or -1 on error (errno is EAGAIN if
+ *          nothing is buffered, EPROTO if the samples are invalid)
+ */
+int osm_stream_read_samples(OSMStreamEngine *engine, uint8_t number, uint8_t type, uint64_t *values, unsigned int max);
+
+/**
+ * Close a stream and tell the peer
+ * return - 0 on success, -1 on error
+ */
+int osm_stream_close(OSMStreamEngine *engine, uint8_t number);
+
+/**
+ * Free every stream without telling the peer
+ */
+void osm_stream_end(OSMStreamEngine *engine);
+
+#endif
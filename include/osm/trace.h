@@ -0,0 +1,52 @@
+#ifndef OSM_TRACE_H
+#define OSM_TRACE_H
+
+/*
+ * Static tracepoints (USDT) for perf, bpftrace and systemtap.
+ *
+ * Built with OSM_TRACE defined (make TRACE=1), each tracepoint is a single
+ * nop in the code plus a note in the library which tracers use to attach
+ * to it, eg.
+ *
+ *   bpftrace -e 'usdt:./build/libopensmarts.so:opensmarts:read_done { ... }'
+ *   perf buildid-cache --add build/libopensmarts.so; perf list sdt_opensmarts:*
+ *
+ * Without OSM_TRACE they compile to nothing.
+ *
+ * Tracepoints of the provider "opensmarts" and their arguments:
+ *  - accept(fd) - a connection was accepted
+ *  - bind(fd, id) - an onboard socket was bound with the id
+ *  - bind_network(fd, port) - a network socket was bound
+ *  - frame_recv(fd, len) - a frame (or a read of a stream's bytes, fd is -1
+ *    for frames taken from a framer) was received
+ *  - frame_decode(frame_type, len, ret) - a frame was parsed, ret is 0 or -1
+ *  - frame_dispatch(frame_type, data) - a parsed frame was handed to what it
+ *    is for (data is the batch a reply completes, or the stream engine)
+ *  - frame_send(fd, frame_type, len) - a frame was sent or queued to send
+ *  - read_start(dev, id), read_done(dev, id, ret) - osm_read_datapoint
+ *  - write_start(dev, id), write_done(dev, id, ret) - osm_write_datapoint
+ */
+
+#ifdef OSM_TRACE
+
+#if !__has_include(<sys/sdt.h>)
+#error "OSM_TRACE needs <sys/sdt.h> (systemtap-sdt-dev or systemtap-sdt-devel)"
+#endif
+
+#include <sys/sdt.h>
+
+#define OSM_TRACE0(name) DTRACE_PROBE(opensmarts, name)
+#define OSM_TRACE1(name, a) DTRACE_PROBE1(opensmarts, name, a)
+#define OSM_TRACE2(name, a, b) DTRACE_PROBE2(opensmarts, name, a, b)
+#define OSM_TRACE3(name, a, b, c) DTRACE_PROBE3(opensmarts, name, a, b, c)
+
+#else
+
+#define OSM_TRACE0(name) do {} while (0)
+#define OSM_TRACE1(name, a) do {} while (0)
+#define OSM_TRACE2(name, a, b) do {} while (0)
+#define OSM_TRACE3(name, a, b, c) do {} while (0)
+
+#endif
+
+#endif
@@ -82,21 +82,29 @@ typedef struct {
 
 /// Color struct with support for extra channels (up to 255)
 /// each channel has a range from 0-255
+/// colors with up to two extra channels don't allocate for them
 typedef struct {
 	uint8_t
 		r,
 		g,
 		b;
-	Vector
+	SmallVector
 		extra;
 } OSMColor;
 
 /// Output color struct from 24-bit RGB
 OSMColor osm_rgb_to_color(uint8_t r, uint8_t g, uint8_t b);
 
-/// Deep copy a color struct
+/// Output color struct from 24-bit RGB, whose extra channels and their
+/// names are allocated from alloc (NULL for the heap)
+OSMColor osm_rgb_to_color_in(OSMAllocator *alloc, uint8_t r, uint8_t g, uint8_t b);
+
+/// Deep copy a color struct, using the same allocator
 OSMColor osm_color_copy(OSMColor *color);
 
+/// Deep copy a color struct into another allocator (NULL for the heap)
+OSMColor osm_color_copy_in(OSMAllocator *alloc, OSMColor *color);
+
 /// Free a color struct
 void osm_color_free(OSMColor *color);
 
@@ -0,0 +1,94 @@
+#ifndef OSM_URING_H
+#define OSM_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Completion based I/O on io_uring.
+ *
+ * Operations are queued and only submitted to the kernel (all at once) by
+ * osm_uring_submit or by the next iteration of osm_uring_run, so a batch of
+ * operations costs a single syscall.  Only multishot accept is implemented:
+ * connections are handed to callbacks that own their (blocking) fd.
+ *
+ * Only available when built with OSM_USE_IO_URING (the default on Linux, see
+ * the Makefile).  Otherwise, or if the kernel doesn't support io_uring,
+ * osm_uring_init fails and callers should fall back to OSMLoop.
+ *
+ * Like OSMLoop, a ring is driven by a single thread and only osm_uring_stop
+ * may be called from other threads.
+ */
+
+typedef struct OSMUring OSMUring;
+
+/**
+ * Called when an operation completes
+ * res - the result of the operation (an fd for accept) or a negative errno
+ * more - true if the operation is multishot and will complete again
+ */
+typedef void (*OSMUringCallback)(OSMUring *ring, int res, bool more, void *data);
+
+/// An in flight operation
+typedef struct OSMUringOp OSMUringOp;
+
+/**
+ * io_uring state, the ring pointers are mapped from the kernel
+ */
+struct OSMUring {
+	int fd, wakefd;
+	bool running;
+
+	void *sq_ptr, *cq_ptr, *sqes, *cqes;
+	unsigned long sq_len, cq_len, sqes_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	unsigned int queued, inflight;
+
+	OSMUringOp *ops, *ops_free;
+	uint64_t wake_value;
+};
+
+/**
+ * Check whether io_uring can be used on this machine
+ */
+bool osm_uring_available();
+
+/**
+ * Set up a new ring
+ * entries - submission queue size (rounded up to a power of two by the kernel)
+ * return - 0 on success, -1 on error (errno is ENOSYS if io_uring is unavailable)
+ */
+int osm_uring_init(OSMUring *ring, unsigned int entries);
+
+/**
+ * Unmap and free the ring, abandoning any operations still in flight.
+ * Must not be running.  File descriptors used by operations are not closed.
+ */
+void osm_uring_end(OSMUring *ring);
+
+/**
+ * Submit all queued operations, and wait for and dispatch completions
+ * until osm_uring_stop is called
+ * return - 0 if the ring was stopped, -1 on error
+ */
+int osm_uring_run(OSMUring *ring);
+
+/**
+ * Ask the ring to return from osm_uring_run (thread safe)
+ */
+void osm_uring_stop(OSMUring *ring);
+
+/**
+ * Submit all queued operations without waiting
+ * return - the number of submitted operations, or -1 on error
+ */
+int osm_uring_submit(OSMUring *ring);
+
+/**
+ * Queue a multishot accept, the callback is called with each new connection
+ * (in blocking mode) until it is called with more set to false
+ */
+int osm_uring_accept(OSMUring *ring, int sockfd, OSMUringCallback callback, void *data);
+
+#endif
@@ -1,7 +1,113 @@
 #ifndef OSM_UTILS_H
 #define OSM_UTILS_H
 
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocators
+
+typedef struct OSMAllocator OSMAllocator;
+
+/**
+ * Allocator interface.  Everything which takes an allocator uses the heap
+ * (malloc and free) when given NULL.
+ */
+struct OSMAllocator {
+	/// Allocate size bytes, aligned for any type, or return NULL
+	void *(*alloc)(OSMAllocator *allocator, size_t size);
+	/// Resize an allocation of old_size bytes, or return NULL leaving it as it was
+	void *(*resize)(OSMAllocator *allocator, void *ptr, size_t old_size, size_t size);
+	/// Free an allocation, may do nothing
+	void (*free)(OSMAllocator *allocator, void *ptr);
+};
+
+/**
+ * Allocate memory
+ * allocator - the allocator, or NULL for the heap
+ */
+void *osm_alloc(OSMAllocator *allocator, size_t size);
+
+/**
+ * Resize memory from osm_alloc
+ * old_size - the size it was allocated or last resized with
+ */
+void *osm_realloc(OSMAllocator *allocator, void *ptr, size_t old_size, size_t size);
+
+/**
+ * Free memory from osm_alloc
+ */
+void osm_free(OSMAllocator *allocator, void *ptr);
+
+/// Default size of arena chunks
+#define OSM_ARENA_CHUNK 4096
+
+typedef struct OSMArenaChunk OSMArenaChunk;
+
+/**
+ * Bump allocator: allocations are carved from large chunks and only freed
+ * all at once, with osm_arena_reset or osm_arena_end.  Resizing the most
+ * recent allocation grows it in place.  An arena is used by one thread at
+ * a time.
+ */
+typedef struct {
+	OSMAllocator allocator;      // pass &arena->allocator to take an allocator
+	OSMArenaChunk *chunks;       // the current chunk first
+	size_t chunk_size;
+	size_t used;                 // of the current chunk
+	void *last;                  // the most recent allocation
+} OSMArena;
+
+/**
+ * Initialize an arena, this doesn't allocate until it is first used
+ * chunk_size - bytes allocated at once (0 for OSM_ARENA_CHUNK), larger
+ *              allocations get a chunk of their own
+ */
+void osm_arena_init(OSMArena *arena, size_t chunk_size);
+
+/**
+ * Free everything allocated from an arena, keeping one chunk for reuse
+ */
+void osm_arena_reset(OSMArena *arena);
+
+/**
+ * Free an arena's memory
+ */
+void osm_arena_end(OSMArena *arena);
+
+/**
+ * Pool of fixed size blocks: freed blocks are kept on a free list and
+ * reused, so objects of one size can be allocated and freed in any order
+ * without fragmenting the heap.  Allocations larger than the block size
+ * fail.  A pool is used by one thread at a time.
+ */
+typedef struct {
+	OSMAllocator allocator;      // pass &pool->allocator to take an allocator
+	size_t size;                 // of each block
+	unsigned int per_chunk;      // blocks allocated at once
+	void *free_list;
+	OSMArenaChunk *chunks;
+} OSMFixedPool;
+
+/**
+ * Initialize a pool, this doesn't allocate until it is first used
+ * size - the size of each block
+ * per_chunk - blocks allocated from the heap at once (0 for a chunk of
+ *             about OSM_ARENA_CHUNK bytes)
+ */
+void osm_fixed_pool_init(OSMFixedPool *pool, size_t size, unsigned int per_chunk);
+
+/**
+ * Return every block to a pool, keeping its memory
+ */
+void osm_fixed_pool_reset(OSMFixedPool *pool);
+
+/**
+ * Free a pool's memory
+ */
+void osm_fixed_pool_end(OSMFixedPool *pool);
 
 // Vector utilities
 
@@ -11,6 +117,7 @@
 typedef struct {
 	unsigned int count, size, elsz;
 	void *data;
+	OSMAllocator *alloc;         // NULL for the heap
 } Vector;
 
 /**
@@ -18,21 +125,60 @@ typedef struct {
  */
 Vector vect_init(unsigned int elsz);
 
+/**
+ * Get an initialized vector struct whose data comes from an allocator
+ * alloc - the allocator, or NULL for the heap
+ */
+Vector vect_init_in(unsigned int elsz, OSMAllocator *alloc);
+
+/**
+ * Make room for at least count elements, so adding up to that many doesn't
+ * reallocate (until elements are removed, which may shrink the vector)
+ */
+bool vect_reserve(Vector *vec, unsigned int count);
+
 /**
  * Add an element to an arbitrary index in the vector
  */
 bool vect_add(Vector *vec, unsigned int index, void *el);
 
+/**
+ * Same as vect_add, for code written against its old name
+ */
+bool vect_insert(Vector *vec, unsigned int index, void *el);
+
+/**
+ * Add n elements to an arbitrary index in the vector
+ * els - n elements, which may be inside the vector itself
+ */
+bool vect_insert_n(Vector *vec, unsigned int index, const void *els, unsigned int n);
+
 /**
  * Remove an element from an arbitrary index in the vector
  */
 bool vect_remove(Vector *vec, unsigned int index);
 
+/**
+ * Remove n elements starting at an arbitrary index in the vector
+ */
+bool vect_remove_range(Vector *vec, unsigned int index, unsigned int n);
+
 /**
  * Push an element to the end of the vector
  */
 bool vect_push(Vector *vec, void *el);
 
+/**
+ * Push n elements to the end of the vector
+ */
+bool vect_push_n(Vector *vec, const void *els, unsigned int n);
+
+/**
+ * Push every element of another vector (with the same element size) to the
+ * end of the vector
+ */
+bool vect_extend(Vector *vec, const Vector *other);
+
 /**
  * Pop an element from the end of the vector
  */
@@ -48,6 +194,11 @@ void *vect_get(Vector *vec, unsigned int index);
  */
 bool vect_set(Vector *vec, unsigned int index, void *el);
 
+/**
+ * Free the capacity which isn't used by elements
+ */
+bool vect_shrink_to_fit(Vector *vec);
+
 /**
  * Clear all data in a vector
  */
@@ -58,5 +209,287 @@ void vect_clear(Vector *vec);
  */
 void vect_end(Vector *vect);
 
+// Small vector utilities
+
+/// Bytes of elements a small vector stores without allocating
+#define SVECT_INLINE 32
+
+/**
+ * SmallVector is a dynamic array which keeps its first SVECT_INLINE bytes of
+ * elements inside the struct, and only allocates once it grows past them.
+ * Where the elements are is worked out from the capacity rather than
+ * stored, so a small vector which hasn't spilled can be copied by value.
+ * Inline elements are 8 byte aligned.
+ */
+typedef struct {
+	unsigned int count, size, elsz;
+	union {
+		void *heap;                  // size * elsz > SVECT_INLINE
+		uint64_t align;
+		unsigned char local[SVECT_INLINE];
+	} store;
+	OSMAllocator *alloc;         // for spilled elements, NULL for the heap
+} SmallVector;
+
+/**
+ * Get an initialized small vector, this never allocates
+ */
+SmallVector svect_init(unsigned int elsz);
+
+/**
+ * Get an initialized small vector which spills to an allocator
+ * alloc - the allocator, or NULL for the heap
+ */
+SmallVector svect_init_in(unsigned int elsz, OSMAllocator *alloc);
+
+/**
+ * Get the elements of a small vector
+ */
+static inline void *svect_data(SmallVector *vec)
+{
+	return (size_t) vec->size * vec->elsz > SVECT_INLINE ? vec->store.heap : vec->store.local;
+}
+
+/**
+ * Make room for at least count elements
+ */
+bool svect_reserve(SmallVector *vec, unsigned int count);
+
+/**
+ * Add an element to an arbitrary index in the small vector
+ */
+bool svect_add(SmallVector *vec, unsigned int index, void *el);
+
+/**
+ * Remove an element from an arbitrary index in the small vector
+ */
+bool svect_remove(SmallVector *vec, unsigned int index);
+
+/**
+ * Push an element to the end of the small vector
+ */
+bool svect_push(SmallVector *vec, void *el);
+
+/**
+ * Pop an element from the end of the small vector
+ */
+bool svect_pop(SmallVector *vec);
+
+/**
+ * Get an element from the small vector
+ */
+void *svect_get(SmallVector *vec, unsigned int index);
+
+/**
+ * Set an element inside the small vector
+ */
+bool svect_set(SmallVector *vec, unsigned int index, void *el);
+
+/**
+ * Copy a small vector's elements (shallowly) into a new one
+ */
+bool svect_copy(SmallVector *dst, SmallVector *src);
+
+/**
+ * Move the elements back inside the struct if they fit, or free the unused
+ * capacity
+ */
+bool svect_shrink_to_fit(SmallVector *vec);
+
+/**
+ * Clear all data in a small vector
+ */
+void svect_clear(SmallVector *vec);
+
+/**
+ * Remove all associated data from the small vector
+ */
+void svect_end(SmallVector *vec);
+
+// Ring buffers
+
+/// Size of a cache line, which separates what producers and consumers write
+#define OSM_CACHE_LINE 64
+
+/**
+ * Wakes a ring's consumer.  The consumer announces it is about to sleep,
+ * and the producers only signal the eventfd when it has, so pushing costs
+ * no system call while the consumer is busy.
+ */
+typedef struct {
+	int fd;                      // eventfd, readable once the consumer should look again
+	atomic_bool sleeping;
+} OSMRingNotify;
+
+/**
+ * Lock-free ring buffer for one producer thread and one consumer thread.
+ * Elements are copied in and out, and each side keeps its own index on a
+ * separate cache line along with a cached copy of the other side's.
+ */
+typedef struct {
+	alignas(OSM_CACHE_LINE) atomic_size_t head;  // written by the producer
+	size_t tail_cache;
+
+	alignas(OSM_CACHE_LINE) atomic_size_t tail;  // written by the consumer
+	size_t head_cache;
+
+	alignas(OSM_CACHE_LINE) unsigned char *buf;
+	size_t mask;
+	unsigned int elsz;
+	OSMRingNotify notify;
+} OSMSpscRing;
+
+/**
+ * Lock-free ring buffer for any number of producer threads and one consumer
+ * thread.  Producers claim slots by advancing head, and mark each slot as
+ * written with a sequence number which the consumer waits for.
+ */
+typedef struct {
+	alignas(OSM_CACHE_LINE) atomic_size_t head;  // claimed by producers
+	alignas(OSM_CACHE_LINE) atomic_size_t tail;  // written by the consumer
+
+	alignas(OSM_CACHE_LINE) unsigned char *slots;
+	size_t mask, stride;
+	unsigned int elsz;
+	OSMRingNotify notify;
+} OSMMpscRing;
+
+/**
+ * Initialize a single producer ring
+ * elsz - size of each element
+ * capacity - elements it holds, rounded up to a power of two
+ * return - 0 on success, -1 on error
+ */
+int osm_spsc_init(OSMSpscRing *ring, unsigned int elsz, unsigned int capacity);
+
+/**
+ * Push up to n elements (producer only), waking the consumer if it waits
+ * return - the number pushed, less than n if the ring is full
+ */
+unsigned int osm_spsc_push_n(OSMSpscRing *ring, const void *els, unsigned int n);
+
+/**
+ * Push an element (producer only)
+ * return - false if the ring is full
+ */
+bool osm_spsc_push(OSMSpscRing *ring, const void *el);
+
+/**
+ * Pop up to max elements (consumer only)
+ * return - the number popped
+ */
+unsigned int osm_spsc_pop_n(OSMSpscRing *ring, void *els, unsigned int max);
+
+/**
+ * Pop an element (consumer only)
+ * return - false if the ring is empty
+ */
+bool osm_spsc_pop(OSMSpscRing *ring, void *el);
+
+/**
+ * Get the number of elements in the ring, which may be out of date by the
+ * time it returns
+ */
+unsigned int osm_spsc_count(OSMSpscRing *ring);
+
+/**
+ * Wait until the ring has elements (consumer only)
+ * timeout_ms - how long to wait, -1 for ever
+ * return - true if there are elements, false on timeout
+ */
+bool osm_spsc_wait(OSMSpscRing *ring, int timeout_ms);
+
+/**
+ * Ask to be woken through osm_spsc_fd when elements arrive, for consumers
+ * driven by an event loop.  Once the fd is readable, call osm_spsc_ack and
+ * pop everything before arming again.
+ * return - false if the ring already has elements, pop them instead
+ */
+bool osm_spsc_arm(OSMSpscRing *ring);
+
+/**
+ * Get the eventfd which becomes readable when an armed ring receives
+ * elements
+ */
+int osm_spsc_fd(OSMSpscRing *ring);
+
+/**
+ * Reset the eventfd after it became readable
+ */
+void osm_spsc_ack(OSMSpscRing *ring);
+
+/**
+ * Free a single producer ring
+ */
+void osm_spsc_end(OSMSpscRing *ring);
+
+/**
+ * Initialize a multi producer ring
+ * elsz - size of each element
+ * capacity - elements it holds, rounded up to a power of two
+ * return - 0 on success, -1 on error
+ */
+int osm_mpsc_init(OSMMpscRing *ring, unsigned int elsz, unsigned int capacity);
+
+/**
+ * Push up to n elements (any thread).  The elements pushed are consecutive
+ * in the ring, they aren't interleaved with other producers'.
+ * return - the number pushed, less than n if the ring is full
+ */
+unsigned int osm_mpsc_push_n(OSMMpscRing *ring, const void *els, unsigned int n);
+
+/**
+ * Push an element (any thread)
+ * return - false if the ring is full
+ */
+bool osm_mpsc_push(OSMMpscRing *ring, const void *el);
+
+/**
+ * Pop up to max elements (consumer only).  Stops at a slot which has been
+ * claimed but not yet written by its producer.
+ * return - the number popped
+ */
+unsigned int osm_mpsc_pop_n(OSMMpscRing *ring, void *els, unsigned int max);
+
+/**
+ * Pop an element (consumer only)
+ * return - false if the ring is empty
+ */
+bool osm_mpsc_pop(OSMMpscRing *ring, void *el);
+
+/**
+ * Get the number of elements claimed in the ring, which may be out of date
+ * by the time it returns
+ */
+unsigned int osm_mpsc_count(OSMMpscRing *ring);
+
+/**
+ * Wait until the ring has elements (consumer only)
+ * timeout_ms - how long to wait, -1 for ever
+ * return - true if there are elements, false on timeout
+ */
+bool osm_mpsc_wait(OSMMpscRing *ring, int timeout_ms);
+
+/**
+ * Ask to be woken through osm_mpsc_fd, like osm_spsc_arm
+ * return - false if the ring already has elements
+ */
+bool osm_mpsc_arm(OSMMpscRing *ring);
+
+/**
+ * Get the eventfd which becomes readable when an armed ring receives
+ * elements
+ */
+int osm_mpsc_fd(OSMMpscRing *ring);
+
+/**
+ * Reset the eventfd after it became readable
+ */
+void osm_mpsc_ack(OSMMpscRing *ring);
+
+/**
+ * Free a multi producer ring
+ */
+void osm_mpsc_end(OSMMpscRing *ring);
 
 #endif
@@ -0,0 +1,73 @@
+#ifndef OSM_WORKERS_H
+#define OSM_WORKERS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <threads.h>
+
+/*
+ * Fixed-size worker pool with per-worker deques and work stealing.
+ *
+ * Tasks submitted from a worker go to the bottom of that worker's own deque
+ * and are run newest first.  Tasks submitted from other threads are spread
+ * across the workers.  Idle workers steal the oldest task from the other
+ * workers before going to sleep.
+ */
+
+/// A queued task, the function's return value is ignored
+typedef struct {
+	thrd_start_t func;
+	void *data;
+} OSMTask;
+
+typedef struct OSMWorkerPool OSMWorkerPool;
+
+/**
+ * A single worker thread and its deque
+ */
+typedef struct {
+	OSMWorkerPool *pool;
+	unsigned int index;
+	thrd_t thread;
+
+	mtx_t lock;
+	OSMTask *tasks;
+	unsigned int top, bottom, size;
+} OSMWorker;
+
+/**
+ * Worker pool state
+ */
+struct OSMWorkerPool {
+	OSMWorker *workers;
+	unsigned int count;
+	bool pin;
+
+	atomic_uint pending, sleeping, next;
+	atomic_bool stopping;
+	mtx_t lock;
+	cnd_t wake;
+};
+
+/**
+ * Start a worker pool
+ * count - number of worker threads (0 for one per online cpu)
+ * pin - pin each worker to its own cpu
+ * return - 0 on success, -1 on error
+ */
+int osm_workers_init(OSMWorkerPool *pool, unsigned int count, bool pin);
+
+/**
+ * Queue a task on the pool (thread safe)
+ * func - the function to run, called with data
+ * return - 0 on success, -1 on error
+ */
+int osm_workers_submit(OSMWorkerPool *pool, thrd_start_t func, void *data);
+
+/**
+ * Run all queued tasks, stop the workers and free the pool
+ * Must not be called from a worker.
+ */
+void osm_workers_end(OSMWorkerPool *pool);
+
+#endif
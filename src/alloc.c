@@ -0,0 +1,291 @@
+#include "osm/utils.h"
+
+#include <errno.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Alignment of every allocation
+#define ALLOC_ALIGN alignof(max_align_t)
+
+/**
+ * A block of memory owned by an arena or pool
+ */
+struct OSMArenaChunk {
+	OSMArenaChunk *next;
+	size_t size;
+	alignas(max_align_t) unsigned char data[];
+};
+
+/**
+ * Round a size up to the alignment of every allocation
+ */
+size_t _osm_alloc_align(size_t size)
+{
+	if (size == 0)
+		size = 1;
+	return (size + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+}
+
+void *osm_alloc(OSMAllocator *allocator, size_t size)
+{
+	if (allocator == NULL)
+		return malloc(size);
+	return allocator->alloc(allocator, size);
+}
+
+void *osm_realloc(OSMAllocator *allocator, void *ptr, size_t old_size, size_t size)
+{
+	if (allocator == NULL)
+		return realloc(ptr, size);
+	return allocator->resize(allocator, ptr, old_size, size);
+}
+
+void osm_free(OSMAllocator *allocator, void *ptr)
+{
+	if (allocator == NULL)
+		free(ptr);
+	else if (ptr != NULL)
+		allocator->free(allocator, ptr);
+}
+
+// Arena
+
+void *_osm_arena_alloc(OSMAllocator *allocator, size_t size)
+{
+	OSMArena *arena = (OSMArena *) allocator;
+	size_t need = _osm_alloc_align(size);
+	OSMArenaChunk *chunk = arena->chunks;
+
+	if (chunk != NULL && chunk->size - arena->used >= need)
+	{
+		void *ptr = chunk->data + arena->used;
+		arena->used += need;
+		arena->last = ptr;
+		return ptr;
+	}
+
+	// Too large for a chunk: give it its own, behind the current one so
+	// what is left of that is still used
+	if (need > arena->chunk_size)
+	{
+		OSMArenaChunk *big = malloc(sizeof(OSMArenaChunk) + need);
+		if (big == NULL)
+			return NULL;
+		big->size = need;
+
+		if (chunk == NULL)
+		{
+			big->next = NULL;
+			arena->chunks = big;
+			arena->used = need;
+		}
+		else
+		{
+			big->next = chunk->next;
+			chunk->next = big;
+		}
+
+		arena->last = NULL;
+		return big->data;
+	}
+
+	chunk = malloc(sizeof(OSMArenaChunk) + arena->chunk_size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = arena->chunk_size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	arena->used = need;
+	arena->last = chunk->data;
+	return chunk->data;
+}
+
+void *_osm_arena_resize(OSMAllocator *allocator, void *ptr, size_t old_size, size_t size)
+{
+	OSMArena *arena = (OSMArena *) allocator;
+	if (ptr == NULL)
+		return _osm_arena_alloc(allocator, size);
+
+	// The most recent allocation is at the end of the current chunk, so it
+	// can grow or shrink in place
+	if (ptr == arena->last)
+	{
+		size_t start = (unsigned char *) ptr - arena->chunks->data;
+		size_t need = _osm_alloc_align(size);
+		if (need <= arena->chunks->size - start)
+		{
+			arena->used = start + need;
+			return ptr;
+		}
+	}
+
+	if (size <= old_size)
+		return ptr;
+
+	void *out = _osm_arena_alloc(allocator, size);
+	if (out != NULL)
+		memcpy(out, ptr, old_size);
+	return out;
+}
+
+void _osm_arena_free(OSMAllocator *allocator, void *ptr)
+{
+	OSMArena *arena = (OSMArena *) allocator;
+
+	// Only the most recent allocation can be given back
+	if (ptr == arena->last)
+	{
+		arena->used = (unsigned char *) ptr - arena->chunks->data;
+		arena->last = NULL;
+	}
+}
+
+void osm_arena_init(OSMArena *arena, size_t chunk_size)
+{
+	arena->allocator = (OSMAllocator) {
+		.alloc = _osm_arena_alloc,
+		.resize = _osm_arena_resize,
+		.free = _osm_arena_free,
+	};
+	arena->chunks = NULL;
+	arena->chunk_size = _osm_alloc_align(chunk_size == 0 ? OSM_ARENA_CHUNK : chunk_size);
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+void osm_arena_reset(OSMArena *arena)
+{
+	OSMArenaChunk *keep = NULL;
+	OSMArenaChunk *chunk = arena->chunks;
+	while (chunk != NULL)
+	{
+		OSMArenaChunk *next = chunk->next;
+		if (keep == NULL && chunk->size == arena->chunk_size)
+			keep = chunk;
+		else
+			free(chunk);
+		chunk = next;
+	}
+
+	if (keep != NULL)
+		keep->next = NULL;
+	arena->chunks = keep;
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+void osm_arena_end(OSMArena *arena)
+{
+	osm_arena_reset(arena);
+	free(arena->chunks);
+	arena->chunks = NULL;
+}
+
+// Fixed size pool
+
+/**
+ * Put every block of a chunk on the free list
+ */
+void _osm_fixed_pool_add(OSMFixedPool *pool, OSMArenaChunk *chunk)
+{
+	for (size_t off = 0; off + pool->size <= chunk->size; off += pool->size)
+	{
+		void **block = (void **)(chunk->data + off);
+		*block = pool->free_list;
+		pool->free_list = block;
+	}
+}
+
+void *_osm_fixed_pool_alloc(OSMAllocator *allocator, size_t size)
+{
+	OSMFixedPool *pool = (OSMFixedPool *) allocator;
+	if (size > pool->size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (pool->free_list == NULL)
+	{
+		size_t bytes = pool->size * pool->per_chunk;
+		OSMArenaChunk *chunk = malloc(sizeof(OSMArenaChunk) + bytes);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = bytes;
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		_osm_fixed_pool_add(pool, chunk);
+	}
+
+	void **block = pool->free_list;
+	pool->free_list = *block;
+	return block;
+}
+
+void *_osm_fixed_pool_resize(OSMAllocator *allocator, void *ptr, size_t old_size, size_t size)
+{
+	OSMFixedPool *pool = (OSMFixedPool *) allocator;
+	if (ptr == NULL)
+		return _osm_fixed_pool_alloc(allocator, size);
+
+	// Every block is as large as it can get
+	if (size > pool->size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return ptr;
+}
+
+void _osm_fixed_pool_free(OSMAllocator *allocator, void *ptr)
+{
+	OSMFixedPool *pool = (OSMFixedPool *) allocator;
+	void **block = ptr;
+	*block = pool->free_list;
+	pool->free_list = block;
+}
+
+void osm_fixed_pool_init(OSMFixedPool *pool, size_t size, unsigned int per_chunk)
+{
+	pool->allocator = (OSMAllocator) {
+		.alloc = _osm_fixed_pool_alloc,
+		.resize = _osm_fixed_pool_resize,
+		.free = _osm_fixed_pool_free,
+	};
+
+	// Free blocks hold the free list
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	pool->size = _osm_alloc_align(size);
+
+	if (per_chunk == 0)
+		per_chunk = pool->size < OSM_ARENA_CHUNK ? OSM_ARENA_CHUNK / pool->size : 1;
+	pool->per_chunk = per_chunk;
+
+	pool->free_list = NULL;
+	pool->chunks = NULL;
+}
+
+void osm_fixed_pool_reset(OSMFixedPool *pool)
+{
+	pool->free_list = NULL;
+	for (OSMArenaChunk *chunk = pool->chunks; chunk != NULL; chunk = chunk->next)
+		_osm_fixed_pool_add(pool, chunk);
+}
+
+void osm_fixed_pool_end(OSMFixedPool *pool)
+{
+	OSMArenaChunk *chunk = pool->chunks;
+	while (chunk != NULL)
+	{
+		OSMArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	pool->chunks = NULL;
+	pool->free_list = NULL;
+}
@@ -0,0 +1,620 @@
+#define _GNU_SOURCE
+
+#include "osm/async.h"
+#include "osm/batch.h"
+#include "osm/device.h"
+#include "osm/loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+/// Async state of an attached device, kept in its connection's owner
+typedef struct {
+	OSMAsync *async;
+	OSMDevice *dev;
+	OSMLoopHandle *handle;
+	unsigned int events;
+	bool connecting;             // waiting for the socket to become writable
+	OSMAsyncOp *head, *tail;     // waiting to be submitted, head may be partly sent
+	uint64_t progress;           // when a reply last arrived, or the device became busy
+} _OSMAsyncDev;
+
+/**
+ * Milliseconds on the monotonic clock
+ */
+uint64_t _osm_async_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Report a finished operation
+ */
+void _osm_async_complete(OSMAsyncOp *op)
+{
+	OSMAsync *async = op->async;
+
+	if (!async->threaded)
+	{
+		if (!op->cancelled)
+			op->callback(op, op->error, op->data);
+		free(op);
+		return;
+	}
+
+	// Queue it for osm_async_reap
+	mtx_lock(&async->lock);
+	op->next = NULL;
+	if (async->done_tail != NULL)
+		async->done_tail->next = op;
+	else
+		async->done_head = op;
+	async->done_tail = op;
+	mtx_unlock(&async->lock);
+
+	uint64_t one = 1;
+	if (write(async->eventfd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/**
+ * Called when every frame of an operation's batch is done
+ */
+void _osm_async_batch_done(OSMBatch *batch, void *data)
+{
+	OSMAsyncOp *op = data;
+
+	op->error = batch->error;
+	if (op->error == 0 && op->value != NULL)
+	{
+		OSMDatapoint dat = {
+			.type = op->type,
+		};
+		osm_datapoint_decode(&dat, op->item.value, op->value);
+	}
+
+	_osm_async_complete(op);
+}
+
+/**
+ * Fail everything on a device and detach it
+ */
+void _osm_async_drop(_OSMAsyncDev *adev, int error)
+{
+	OSMAsync *async = adev->async;
+
+	// Waiting operations finish once their frames in flight are failed,
+	// the ones with nothing in flight are finished here
+	OSMAsyncOp *idle = NULL;
+	OSMAsyncOp *op = adev->head;
+	while (op != NULL)
+	{
+		OSMAsyncOp *next = op->next;
+		op->batch->sent = op->batch->count;
+		if (op->batch->error == 0)
+			op->batch->error = error;
+		if (op->batch->pending == 0)
+		{
+			op->next = idle;
+			idle = op;
+		}
+		op = next;
+	}
+	adev->head = NULL;
+	adev->tail = NULL;
+
+	// A failed poll or submit has already disconnected the device
+	osm_loop_del(async->loop, adev->handle);
+	if (adev->dev->conn != NULL)
+		osm_batch_fail_all(adev->dev->conn, error);
+	osm_device_disconnect(adev->dev);
+
+	while (idle != NULL)
+	{
+		OSMAsyncOp *next = idle->next;
+		_osm_async_batch_done(idle->batch, idle);
+		idle = next;
+	}
+
+	for (unsigned int i = 0; i < async->devices.count; i++)
+	{
+		if (*(_OSMAsyncDev **) vect_get(&async->devices, i) == adev)
+		{
+			vect_remove(&async->devices, i);
+			break;
+		}
+	}
+	free(adev);
+}
+
+/**
+ * Submit as many waiting operations as the connection has room for
+ */
+void _osm_async_pump(_OSMAsyncDev *adev)
+{
+	if (adev->connecting)
+		return;
+
+	OSMDeviceConn *conn = adev->dev->conn;
+	bool idle = conn->head == conn->tail;
+
+	while (adev->head != NULL)
+	{
+		int ret = osm_batch_submit(adev->dev, adev->head->batch);
+		if (ret == -1)
+		{
+			_osm_async_drop(adev, errno);
+			return;
+		}
+		if (ret == 0)
+			break;
+
+		adev->head = adev->head->next;
+		if (adev->head == NULL)
+			adev->tail = NULL;
+	}
+
+	// Time out from when the device became busy
+	if (idle && conn->head != conn->tail)
+		adev->progress = _osm_async_now();
+
+	unsigned int events = OSM_LOOP_READ | (osm_device_want_write(adev->dev) ? OSM_LOOP_WRITE : 0);
+	if (events != adev->events && osm_loop_mod(adev->async->loop, adev->handle, events) == 0)
+		adev->events = events;
+}
+
+/**
+ * Finish connecting once the socket is writable or has failed
+ * return - true if the device is still attached
+ */
+bool _osm_async_connected(_OSMAsyncDev *adev)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(adev->dev->conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0)
+		error = errno;
+
+	if (error != 0)
+	{
+		_osm_async_drop(adev, error);
+		return false;
+	}
+
+	adev->connecting = false;
+	adev->progress = _osm_async_now();
+	return true;
+}
+
+void _osm_async_on_read(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	_OSMAsyncDev *adev = data;
+
+	// Errors and hang ups are reported as readable
+	if (adev->connecting)
+	{
+		if (_osm_async_connected(adev))
+			_osm_async_pump(adev);
+		return;
+	}
+
+	int ret = osm_device_poll(adev->dev, false);
+	if (ret == -1)
+	{
+		_osm_async_drop(adev, errno);
+		return;
+	}
+
+	if (ret > 0)
+		adev->progress = _osm_async_now();
+
+	// Replies made room in the pipeline
+	_osm_async_pump(adev);
+}
+
+void _osm_async_on_write(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	_OSMAsyncDev *adev = data;
+
+	if (adev->connecting && !_osm_async_connected(adev))
+		return;
+
+	_osm_async_pump(adev);
+}
+
+/**
+ * Fail devices which stopped answering
+ */
+void _osm_async_check(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	OSMAsync *async = data;
+	uint64_t now = _osm_async_now();
+
+	for (unsigned int i = async->devices.count; i > 0; i--)
+	{
+		_OSMAsyncDev *adev = *(_OSMAsyncDev **) vect_get(&async->devices, i - 1);
+		OSMDeviceConn *conn = adev->dev->conn;
+
+		bool busy = adev->connecting || conn->head != conn->tail;
+		if (busy && now - adev->progress > OSM_DEVICE_TIMEOUT_MS)
+			_osm_async_drop(adev, ETIMEDOUT);
+	}
+}
+
+/**
+ * Start connecting to a device and register it with the loop, operations
+ * are only submitted once the connection is up
+ */
+_OSMAsyncDev *_osm_async_attach(OSMAsync *async, OSMDevice *dev)
+{
+	if (dev->conn != NULL && dev->conn->owner != NULL)
+		return dev->conn->owner;
+
+	if (dev->conn == NULL)
+	{
+		int fd = osm_device_socket(dev, true);
+		if (fd == -1 || osm_device_connect_fd(dev, fd, async->depth) != 0)
+			return NULL;
+	}
+
+	_OSMAsyncDev *adev = calloc(1, sizeof(_OSMAsyncDev));
+	if (adev == NULL)
+		goto fail;
+
+	// A device connected by the blocking API has a blocking socket
+	int flags = fcntl(dev->conn->fd, F_GETFL);
+	if (flags == -1 || fcntl(dev->conn->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto fail;
+
+	adev->async = async;
+	adev->dev = dev;
+	adev->connecting = true;
+	adev->progress = _osm_async_now();
+	adev->events = OSM_LOOP_WRITE;
+	adev->handle = osm_loop_add(async->loop, dev->conn->fd, OSM_LOOP_WRITE,
+		_osm_async_on_read, _osm_async_on_write, adev);
+	if (adev->handle == NULL)
+		goto fail;
+
+	if (!vect_push(&async->devices, &adev))
+	{
+		osm_loop_del(async->loop, adev->handle);
+		goto fail;
+	}
+
+	dev->conn->owner = adev;
+	return adev;
+
+fail:
+	free(adev);
+	osm_device_disconnect(dev);
+	return NULL;
+}
+
+/**
+ * Start an operation on the loop's thread
+ */
+void _osm_async_start(OSMAsyncOp *op)
+{
+	_OSMAsyncDev *adev = _osm_async_attach(op->async, op->dev);
+	if (adev == NULL)
+	{
+		op->error = errno;
+		_osm_async_complete(op);
+		return;
+	}
+
+	op->next = NULL;
+	if (adev->tail != NULL)
+		adev->tail->next = op;
+	else
+		adev->head = op;
+	adev->tail = op;
+
+	_osm_async_pump(adev);
+}
+
+/**
+ * Pick up the operations started since the last time
+ */
+void _osm_async_run_incoming(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	OSMAsync *async = data;
+
+	uint64_t count;
+	if (read(async->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return;
+
+	mtx_lock(&async->lock);
+	OSMAsyncOp *list = async->incoming;
+	async->incoming = NULL;
+	mtx_unlock(&async->lock);
+
+	// The list was pushed in reverse
+	OSMAsyncOp *ordered = NULL;
+	while (list != NULL)
+	{
+		OSMAsyncOp *next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	while (ordered != NULL)
+	{
+		OSMAsyncOp *next = ordered->next;
+		_osm_async_start(ordered);
+		ordered = next;
+	}
+}
+
+/**
+ * Wake the loop to pick up incoming operations.  The operations are already
+ * queued, so a failed write leaves them for the next wake.
+ */
+void _osm_async_wake(OSMAsync *async)
+{
+	uint64_t one = 1;
+	if (write(async->wakefd, &one, sizeof(one)) < 0)
+		return;
+}
+
+/**
+ * Hand an operation to the loop
+ */
+OSMAsyncOp *_osm_async_submit(OSMAsyncOp *op)
+{
+	OSMAsync *async = op->async;
+
+	// Only wake the loop for the first operation of a run
+	mtx_lock(&async->lock);
+	bool first = async->incoming == NULL;
+	op->next = async->incoming;
+	async->incoming = op;
+	mtx_unlock(&async->lock);
+
+	if (first)
+		_osm_async_wake(async);
+
+	return op;
+}
+
+/**
+ * Allocate an operation
+ */
+OSMAsyncOp *_osm_async_op(OSMAsync *async, OSMDevice *dev, OSMAsyncCallback callback, void *data)
+{
+	OSMAsyncOp *op = calloc(1, sizeof(OSMAsyncOp));
+	if (op == NULL)
+		return NULL;
+
+	op->async = async;
+	op->dev = dev;
+	op->callback = callback;
+	op->data = data;
+	return op;
+}
+
+int _osm_async_thread(void *data)
+{
+	OSMAsync *async = data;
+	return osm_loop_run(async->loop);
+}
+
+int osm_async_init(OSMAsync *async, OSMLoop *loop, unsigned int depth)
+{
+	memset(async, 0, sizeof(*async));
+	async->eventfd = -1;
+	async->depth = depth;
+	async->devices = vect_init(sizeof(_OSMAsyncDev *));
+
+	if (mtx_init(&async->lock, mtx_plain) != thrd_success)
+		return -1;
+
+	async->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (async->wakefd == -1)
+		goto fail_lock;
+
+	if (loop != NULL)
+	{
+		async->loop = loop;
+	}
+	else
+	{
+		async->threaded = true;
+		async->loop = &async->own_loop;
+
+		async->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (async->eventfd == -1)
+			goto fail_wakefd;
+
+		if (osm_loop_init(async->loop) != 0)
+			goto fail_eventfd;
+	}
+
+	async->timer = osm_loop_timer(async->loop, OSM_ASYNC_CHECK_MS, true, _osm_async_check, async);
+	if (async->timer == NULL)
+		goto fail_loop;
+
+	async->wake = osm_loop_add(async->loop, async->wakefd, OSM_LOOP_READ, _osm_async_run_incoming, NULL, async);
+	if (async->wake == NULL)
+		goto fail_loop;
+
+	if (async->threaded && thrd_create(&async->thread, _osm_async_thread, async) != thrd_success)
+		goto fail_loop;
+
+	return 0;
+
+fail_loop:
+	if (async->threaded)
+	{
+		osm_loop_end(async->loop);
+	}
+	else
+	{
+		if (async->timer != NULL)
+			osm_loop_del(async->loop, async->timer);
+		if (async->wake != NULL)
+			osm_loop_del(async->loop, async->wake);
+	}
+fail_eventfd:
+	if (async->eventfd != -1)
+		close(async->eventfd);
+fail_wakefd:
+	close(async->wakefd);
+fail_lock:
+	mtx_destroy(&async->lock);
+	vect_end(&async->devices);
+	return -1;
+}
+
+int osm_async_fd(OSMAsync *async)
+{
+	return async->eventfd;
+}
+
+unsigned int osm_async_reap(OSMAsync *async)
+{
+	if (!async->threaded)
+		return 0;
+
+	uint64_t count;
+	if (read(async->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return 0;
+
+	mtx_lock(&async->lock);
+	OSMAsyncOp *op = async->done_head;
+	async->done_head = NULL;
+	async->done_tail = NULL;
+	mtx_unlock(&async->lock);
+
+	unsigned int done = 0;
+	while (op != NULL)
+	{
+		OSMAsyncOp *next = op->next;
+		if (!op->cancelled)
+			op->callback(op, op->error, op->data);
+		free(op);
+		op = next;
+		done++;
+	}
+
+	return done;
+}
+
+OSMAsyncOp *osm_async_read(OSMAsync *async, OSMDevice *dev, OSMDatapoint *dat, void *in,
+	OSMAsyncCallback callback, void *data)
+{
+	// Check the type can be read before starting
+	uint64_t raw;
+	if (osm_datapoint_decode(dat, 0, &raw) != 0)
+		return NULL;
+
+	OSMAsyncOp *op = _osm_async_op(async, dev, callback, data);
+	if (op == NULL)
+		return NULL;
+
+	op->item.id = dat->id;
+	op->own = osm_batch(OSM_FT_GET, &op->item, 1);
+	op->batch = &op->own;
+	op->type = dat->type;
+	op->value = in;
+
+	op->batch->done = _osm_async_batch_done;
+	op->batch->data = op;
+	return _osm_async_submit(op);
+}
+
+OSMAsyncOp *osm_async_write(OSMAsync *async, OSMDevice *dev, OSMDatapoint *dat, void *out,
+	OSMAsyncCallback callback, void *data)
+{
+	uint64_t raw;
+	if (osm_datapoint_encode(dat, out, &raw) != 0)
+		return NULL;
+
+	OSMAsyncOp *op = _osm_async_op(async, dev, callback, data);
+	if (op == NULL)
+		return NULL;
+
+	op->item.id = dat->id;
+	op->item.value = raw;
+	op->own = osm_batch(OSM_FT_SET, &op->item, 1);
+	op->batch = &op->own;
+
+	op->batch->done = _osm_async_batch_done;
+	op->batch->data = op;
+	return _osm_async_submit(op);
+}
+
+OSMAsyncOp *osm_async_batch(OSMAsync *async, OSMDevice *dev, OSMBatch *batch,
+	OSMAsyncCallback callback, void *data)
+{
+	// Nothing would ever complete an empty batch
+	if (batch->count == 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	OSMAsyncOp *op = _osm_async_op(async, dev, callback, data);
+	if (op == NULL)
+		return NULL;
+
+	op->batch = batch;
+	op->batch->done = _osm_async_batch_done;
+	op->batch->data = op;
+	return _osm_async_submit(op);
+}
+
+void osm_async_cancel(OSMAsyncOp *op)
+{
+	op->cancelled = true;
+}
+
+void osm_async_end(OSMAsync *async)
+{
+	if (async->threaded)
+	{
+		osm_loop_stop(async->loop);
+		thrd_join(async->thread, NULL);
+	}
+
+	// Operations which never reached the loop
+	mtx_lock(&async->lock);
+	OSMAsyncOp *op = async->incoming;
+	async->incoming = NULL;
+	mtx_unlock(&async->lock);
+
+	while (op != NULL)
+	{
+		OSMAsyncOp *next = op->next;
+		op->error = ECANCELED;
+		_osm_async_complete(op);
+		op = next;
+	}
+
+	while (async->devices.count > 0)
+		_osm_async_drop(*(_OSMAsyncDev **) vect_get(&async->devices, async->devices.count - 1), ECANCELED);
+
+	osm_loop_del(async->loop, async->timer);
+	osm_loop_del(async->loop, async->wake);
+	close(async->wakefd);
+	osm_async_reap(async);
+
+	if (async->threaded)
+	{
+		osm_loop_end(async->loop);
+		close(async->eventfd);
+	}
+
+	vect_end(&async->devices);
+	mtx_destroy(&async->lock);
+}
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+
+#include "osm/auth.h"
+#include "osm/blake2s.h"
+#include "osm/codec.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Label mixed into the default session key derivation
+static const char OSM_AUTH_LABEL[] = "OSmF session key";
+
+/**
+ * Slot of a uuid in the peer cache
+ */
+unsigned int _osm_auth_slot(const OSMAuth *auth, uint64_t uuid)
+{
+	return (uuid * 0x9e3779b97f4a7c15ull) >> (64 - __builtin_ctz(auth->size));
+}
+
+/**
+ * Find a cached peer
+ * return - the peer, or NULL
+ */
+OSMAuthPeer *_osm_auth_find(OSMAuth *auth, uint64_t uuid)
+{
+	unsigned int mask = auth->size - 1;
+	for (unsigned int i = _osm_auth_slot(auth, uuid);; i = (i + 1) & mask)
+	{
+		OSMAuthPeer *peer = &auth->peers[i];
+		if (!peer->used)
+			return NULL;
+		if (peer->uuid == uuid)
+			return peer;
+	}
+}
+
+/**
+ * Double the size of the peer cache
+ * return - 0 on success, -1 on error
+ */
+int _osm_auth_grow(OSMAuth *auth)
+{
+	OSMAuthPeer *old = auth->peers;
+	unsigned int old_size = auth->size;
+
+	OSMAuthPeer *peers = calloc(old_size * 2, sizeof(OSMAuthPeer));
+	if (peers == NULL)
+		return -1;
+
+	auth->peers = peers;
+	auth->size = old_size * 2;
+
+	unsigned int mask = auth->size - 1;
+	for (unsigned int i = 0; i < old_size; i++)
+	{
+		if (!old[i].used)
+			continue;
+
+		unsigned int j = _osm_auth_slot(auth, old[i].uuid);
+		while (peers[j].used)
+			j = (j + 1) & mask;
+		peers[j] = old[i];
+	}
+
+	free(old);
+	return 0;
+}
+
+/**
+ * Check whether a cached peer has the same key as an init frame
+ */
+bool _osm_auth_same_key(const OSMAuthPeer *peer, const OSMInitView *view)
+{
+	return peer->keytype == view->keytype && peer->keylen == view->keylen
+		&& memcmp(peer->key, view->key, view->keylen) == 0;
+}
+
+/**
+ * Cache a peer's key, replacing any other key for its uuid
+ * return - 0 on success, -1 on error
+ */
+int _osm_auth_store(OSMAuth *auth, const OSMInitView *view)
+{
+	uint8_t *key = malloc(view->keylen > 0 ? view->keylen : 1);
+	if (key == NULL)
+		return -1;
+	memcpy(key, view->key, view->keylen);
+
+	uint64_t uuid = osm_get_le64(view->uuid);
+	OSMAuthPeer *peer = _osm_auth_find(auth, uuid);
+	if (peer == NULL)
+	{
+		if ((auth->count + 1) * 4 > auth->size * 3 && _osm_auth_grow(auth) == -1)
+		{
+			free(key);
+			return -1;
+		}
+
+		unsigned int mask = auth->size - 1;
+		unsigned int i = _osm_auth_slot(auth, uuid);
+		while (auth->peers[i].used)
+			i = (i + 1) & mask;
+
+		peer = &auth->peers[i];
+		peer->used = true;
+		peer->uuid = uuid;
+		auth->count++;
+	}
+	else
+	{
+		free(peer->key);
+	}
+
+	peer->keytype = view->keytype;
+	peer->keylen = view->keylen;
+	peer->key = key;
+	return 0;
+}
+
+/**
+ * Default session key derivation: BLAKE2s keyed with the pairing secret over
+ * both init frames, sender first
+ */
+int _osm_auth_derive(uint8_t key[OSM_AUTH_KEY_LEN], const uint8_t *secret, size_t secret_len,
+	const OSMInitView *from, const OSMInitView *to, void *data)
+{
+	uint8_t short_secret[OSM_BLAKE2S_LEN];
+	OSMBlake2s s;
+
+	// Secrets longer than a BLAKE2s key are hashed down first
+	if (secret_len > OSM_BLAKE2S_LEN)
+	{
+		osm_blake2s_init(&s, OSM_BLAKE2S_LEN, NULL, 0);
+		osm_blake2s_update(&s, secret, secret_len);
+		osm_blake2s_final(&s, short_secret);
+		secret = short_secret;
+		secret_len = OSM_BLAKE2S_LEN;
+	}
+
+	if (osm_blake2s_init(&s, OSM_AUTH_KEY_LEN, secret, secret_len) == -1)
+		return -1;
+
+	osm_blake2s_update(&s, OSM_AUTH_LABEL, sizeof(OSM_AUTH_LABEL) - 1);
+
+	const OSMInitView *sides[2] = { from, to };
+	for (int i = 0; i < 2; i++)
+	{
+		uint8_t head[12];
+		head[0] = sides[i]->version;
+		memcpy(head + 1, sides[i]->uuid, 8);
+		head[9] = sides[i]->keytype;
+		osm_put_le16(head + 10, sides[i]->keylen);
+
+		osm_blake2s_update(&s, head, sizeof(head));
+		osm_blake2s_update(&s, sides[i]->key, sides[i]->keylen);
+	}
+
+	osm_blake2s_final(&s, key);
+	explicit_bzero(short_secret, sizeof(short_secret));
+	explicit_bzero(&s, sizeof(s));
+	return 0;
+}
+
+/**
+ * Compute a tag from parts with the session's MAC
+ * keyed - the precomputed keyed state for the direction
+ */
+void _osm_auth_tag(OSMAuthSession *session, const uint8_t *key, const OSMBlake2s *keyed, uint64_t seq,
+	const struct iovec *parts, unsigned int count, uint8_t tag[OSM_AUTH_TAG_LEN])
+{
+	OSMAuth *auth = session->auth;
+
+	if (auth->ops.mac != NULL)
+	{
+		auth->ops.mac(tag, key, seq, parts, count, auth->ops.data);
+		return;
+	}
+
+	// The key block was hashed once when the session started
+	OSMBlake2s s = *keyed;
+	uint8_t seq_le[8];
+	osm_put_le64(seq_le, seq);
+
+	osm_blake2s_update(&s, seq_le, sizeof(seq_le));
+	for (unsigned int i = 0; i < count; i++)
+		osm_blake2s_update(&s, parts[i].iov_base, parts[i].iov_len);
+	osm_blake2s_final(&s, tag);
+}
+
+/**
+ * Compare tags in constant time
+ */
+bool _osm_auth_tag_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint8_t diff = 0;
+	for (int i = 0; i < OSM_AUTH_TAG_LEN; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+int osm_auth_init(OSMAuth *auth, const OSMAuthOps *ops)
+{
+	memset(auth, 0, sizeof(*auth));
+	if (ops != NULL)
+		auth->ops = *ops;
+
+	auth->size = OSM_AUTH_CACHE_SIZE;
+	auth->peers = calloc(auth->size, sizeof(OSMAuthPeer));
+	if (auth->peers == NULL)
+		return -1;
+
+	if (mtx_init(&auth->lock, mtx_plain) != thrd_success)
+	{
+		free(auth->peers);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+bool osm_auth_trusted(OSMAuth *auth, const OSMInitView *peer)
+{
+	mtx_lock(&auth->lock);
+	OSMAuthPeer *cached = _osm_auth_find(auth, osm_get_le64(peer->uuid));
+	bool trusted = cached != NULL && _osm_auth_same_key(cached, peer);
+	mtx_unlock(&auth->lock);
+	return trusted;
+}
+
+void osm_auth_forget(OSMAuth *auth, const uint8_t uuid[8])
+{
+	mtx_lock(&auth->lock);
+
+	OSMAuthPeer *peer = _osm_auth_find(auth, osm_get_le64(uuid));
+	if (peer == NULL)
+	{
+		mtx_unlock(&auth->lock);
+		return;
+	}
+
+	free(peer->key);
+	peer->used = false;
+	auth->count--;
+
+	// Shift later entries of the probe run back into the hole
+	unsigned int mask = auth->size - 1;
+	unsigned int hole = peer - auth->peers;
+	for (unsigned int i = (hole + 1) & mask; auth->peers[i].used; i = (i + 1) & mask)
+	{
+		unsigned int home = _osm_auth_slot(auth, auth->peers[i].uuid);
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			auth->peers[hole] = auth->peers[i];
+			auth->peers[i].used = false;
+			hole = i;
+		}
+	}
+
+	mtx_unlock(&auth->lock);
+}
+
+int osm_auth_session(OSMAuth *auth, OSMAuthSession *session, const OSMInitView *local,
+	const OSMInitView *peer, const uint8_t *secret, size_t secret_len)
+{
+	memset(session, 0, sizeof(*session));
+	session->auth = auth;
+	memcpy(session->uuid, peer->uuid, 8);
+
+	// The slow key check only runs for peers we haven't seen with this key
+	if (!osm_auth_trusted(auth, peer))
+	{
+		if (auth->ops.verify_key != NULL && auth->ops.verify_key(peer, auth->ops.data) != 0)
+		{
+			errno = EACCES;
+			return -1;
+		}
+
+		mtx_lock(&auth->lock);
+		int ret = _osm_auth_store(auth, peer);
+		mtx_unlock(&auth->lock);
+		if (ret == -1)
+			return -1;
+	}
+
+	int (*derive)(uint8_t *, const uint8_t *, size_t, const OSMInitView *, const OSMInitView *, void *) =
+		auth->ops.derive != NULL ? auth->ops.derive : _osm_auth_derive;
+
+	if (derive(session->tx_key, secret, secret_len, local, peer, auth->ops.data) == -1
+		|| derive(session->rx_key, secret, secret_len, peer, local, auth->ops.data) == -1)
+	{
+		osm_auth_session_end(session);
+		return -1;
+	}
+
+	if (auth->ops.mac == NULL)
+	{
+		osm_blake2s_init(&session->tx_mac, OSM_AUTH_TAG_LEN, session->tx_key, OSM_AUTH_KEY_LEN);
+		osm_blake2s_init(&session->rx_mac, OSM_AUTH_TAG_LEN, session->rx_key, OSM_AUTH_KEY_LEN);
+
+		// Tagged messages always start with the sequence number
+		osm_blake2s_precompute(&session->tx_mac);
+		osm_blake2s_precompute(&session->rx_mac);
+	}
+
+	return 0;
+}
+
+void osm_auth_sign(OSMAuthSession *session, const uint8_t *frame, size_t len, uint8_t tag[OSM_AUTH_TAG_LEN])
+{
+	struct iovec part = { .iov_base = (void *) frame, .iov_len = len };
+	_osm_auth_tag(session, session->tx_key, &session->tx_mac, session->tx_seq++, &part, 1, tag);
+}
+
+void osm_auth_sign_out(OSMAuthSession *session, OSMFrameOut *frame, uint8_t *tag)
+{
+	struct iovec parts[3];
+	unsigned int count = 0;
+
+	parts[count++] = (struct iovec) { .iov_base = frame->header, .iov_len = sizeof(OSMFrameHeader) };
+	if (frame->sub_len > 0)
+		parts[count++] = (struct iovec) { .iov_base = frame->sub, .iov_len = frame->sub_len };
+	if (frame->payload != NULL && frame->payload_len > 0)
+		parts[count++] = (struct iovec) { .iov_base = frame->payload, .iov_len = frame->payload_len };
+
+	_osm_auth_tag(session, session->tx_key, &session->tx_mac, session->tx_seq++, parts, count, tag);
+	frame->tag = tag;
+	frame->tag_len = OSM_AUTH_TAG_LEN;
+}
+
+int osm_auth_verify(OSMAuthSession *session, const uint8_t *frame, size_t len)
+{
+	if (len < OSM_AUTH_TAG_LEN)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	uint8_t tag[OSM_AUTH_TAG_LEN];
+	struct iovec part = { .iov_base = (void *) frame, .iov_len = len - OSM_AUTH_TAG_LEN };
+	_osm_auth_tag(session, session->rx_key, &session->rx_mac, session->rx_seq, &part, 1, tag);
+
+	if (!_osm_auth_tag_equal(tag, frame + part.iov_len))
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	session->rx_seq++;
+	return 0;
+}
+
+unsigned int osm_auth_verify_batch(OSMAuthSession *session, const OSMFrameIn *frames, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (frames[i].truncated || osm_auth_verify(session, frames[i].buf, frames[i].len) == -1)
+		{
+			errno = EBADMSG;
+			return i;
+		}
+	}
+
+	return count;
+}
+
+void osm_auth_session_end(OSMAuthSession *session)
+{
+	explicit_bzero(session->tx_key, sizeof(session->tx_key));
+	explicit_bzero(session->rx_key, sizeof(session->rx_key));
+	explicit_bzero(&session->tx_mac, sizeof(session->tx_mac));
+	explicit_bzero(&session->rx_mac, sizeof(session->rx_mac));
+}
+
+void osm_auth_end(OSMAuth *auth)
+{
+	for (unsigned int i = 0; i < auth->size; i++)
+	{
+		if (auth->peers[i].used)
+			free(auth->peers[i].key);
+	}
+
+	free(auth->peers);
+	auth->peers = NULL;
+	mtx_destroy(&auth->lock);
+}
@@ -0,0 +1,408 @@
+#include "osm/batch.h"
+#include "osm/codec.h"
+#include "osm/device.h"
+#include "osm/framer.h"
+#include "osm/metrics.h"
+#include "osm/trace.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+/**
+ * Account for an answered or failed frame of a batch
+ */
+void _osm_batch_finish(OSMBatch *batch)
+{
+	batch->pending--;
+	if (batch->pending == 0 && batch->sent == batch->count && batch->done != NULL)
+		batch->done(batch, batch->data);
+}
+
+/**
+ * Account for a request frame leaving the pipeline
+ * now - when its reply arrived, or 0 if it failed without one
+ */
+void _osm_batch_account(OSMDeviceConn *conn, const OSMBatchPart *part, bool failed, uint64_t now)
+{
+	conn->stats.calls++;
+	osm_metric_add(OSM_M_DEVICE_CALLS, 1);
+	osm_metric_sub(OSM_M_DEVICE_INFLIGHT, 1);
+
+	if (failed)
+	{
+		conn->stats.errors++;
+		osm_metric_add(OSM_M_DEVICE_ERRORS, 1);
+	}
+
+	if (now != 0)
+	{
+		uint64_t latency = now > part->sent_at ? now - part->sent_at : 0;
+		osm_hist_add(&conn->stats.latency, latency);
+		osm_metric_record(OSM_H_DEVICE_CALL, latency);
+	}
+}
+
+void osm_batch_fail_all(OSMDeviceConn *conn, int error)
+{
+	// A frame which was only partly sent can't be finished
+	conn->out_len = 0;
+	conn->out_off = 0;
+
+	while (conn->tail != conn->head)
+	{
+		OSMBatchPart *part = &conn->inflight[conn->tail % conn->depth];
+		OSMBatch *batch = part->batch;
+		conn->tail++;
+		_osm_batch_account(conn, part, true, 0);
+		if (batch->error == 0)
+			batch->error = error;
+		_osm_batch_finish(batch);
+	}
+}
+
+/**
+ * Match a reply to the oldest request in flight
+ * now - when the reply was received
+ * return - 1 if a request was completed, 0 if the frame was ignored
+ */
+int _osm_batch_reply(OSMDeviceConn *conn, const uint8_t *buf, size_t len, uint64_t now)
+{
+	OSMFrameView view;
+	if (osm_frame_parse(&view, buf, len) != 0 || view.frame_type != OSM_FT_RES)
+		return 0;
+
+	// Nothing asked for it
+	if (conn->tail == conn->head)
+		return 0;
+
+	OSMBatchPart *part = &conn->inflight[conn->tail % conn->depth];
+	OSMBatch *batch = part->batch;
+	OSMBatchItem *items = batch->items + part->first;
+	conn->tail++;
+	OSM_TRACE2(frame_dispatch, view.frame_type, batch);
+
+	if (view.sub.res.res_type != batch->frame_type)
+	{
+		_osm_batch_account(conn, part, true, now);
+		if (batch->error == 0)
+			batch->error = EPROTO;
+		_osm_batch_finish(batch);
+		return 1;
+	}
+
+	if (batch->frame_type == OSM_FT_SET)
+	{
+		for (unsigned int i = 0; i < part->count; i++)
+			items[i].valid = true;
+		_osm_batch_account(conn, part, false, now);
+		_osm_batch_finish(batch);
+		return 1;
+	}
+
+	for (unsigned int r = 0; r < view.sub.res.num_res; r++)
+	{
+		const OSMControl *control = osm_view_control(&view, r);
+		uint64_t id = osm_control_id(control);
+
+		// Devices normally answer in the order asked
+		unsigned int i = r;
+		if (i >= part->count || items[i].id != id)
+		{
+			for (i = 0; i < part->count && items[i].id != id; i++);
+			if (i == part->count)
+				continue;
+		}
+
+		items[i].value = osm_control_value(control);
+		items[i].valid = true;
+	}
+
+	bool missing = false;
+	for (unsigned int i = 0; i < part->count; i++)
+		missing |= !items[i].valid;
+	if (missing && batch->error == 0)
+		batch->error = ENOENT;
+
+	_osm_batch_account(conn, part, missing, now);
+	_osm_batch_finish(batch);
+	return 1;
+}
+
+/**
+ * Fail every request in flight and close the connection, whose replies
+ * can no longer be matched to requests
+ */
+void _osm_batch_drop(OSMDevice *dev, int error)
+{
+	osm_batch_fail_all(dev->conn, error);
+	osm_device_disconnect(dev);
+	errno = error;
+}
+
+/**
+ * Send what is left of the frame in the encode buffer
+ * return - 1 once it is all sent, 0 if a non-blocking socket is full, -1 on error
+ */
+int _osm_batch_flush(OSMDeviceConn *conn)
+{
+	while (conn->out_off < conn->out_len)
+	{
+		ssize_t ret = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		conn->out_off += ret;
+		conn->stats.bytes_out += ret;
+		osm_metric_add(OSM_M_BYTES_OUT, ret);
+	}
+
+	conn->out_len = 0;
+	conn->out_off = 0;
+	return 1;
+}
+
+OSMBatch osm_batch(uint8_t frame_type, OSMBatchItem *items, unsigned int count)
+{
+	OSMBatch out = {
+		.frame_type = frame_type,
+		.items = items,
+		.count = count,
+		.sent = 0,
+		.pending = 0,
+		.error = 0,
+		.done = NULL,
+		.data = NULL,
+	};
+
+	for (unsigned int i = 0; i < count; i++)
+		items[i].valid = false;
+
+	return out;
+}
+
+int osm_batch_submit(OSMDevice *dev, OSMBatch *batch)
+{
+	OSMDeviceConn *conn = dev->conn;
+	if (conn == NULL)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (batch->frame_type != OSM_FT_GET && batch->frame_type != OSM_FT_SET)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t size = OSM_WIRE_FRAME_HEADER + OSM_WIRE_SUB_MAX + OSM_BATCH_FRAME_MAX * OSM_WIRE_CONTROL;
+
+	while (1)
+	{
+		// Finish the last frame before encoding the next
+		int ret = _osm_batch_flush(conn);
+		if (ret == -1)
+		{
+			_osm_batch_drop(dev, errno);
+			return -1;
+		}
+		if (ret == 0)
+			return 0;
+
+		if (batch->sent == batch->count)
+			break;
+
+		// Wait for replies to make room in the pipeline
+		if (conn->head - conn->tail == conn->depth)
+			return 0;
+
+		unsigned int count = batch->count - batch->sent;
+		if (count > OSM_BATCH_FRAME_MAX)
+			count = OSM_BATCH_FRAME_MAX;
+
+		conn->header.frame_type = batch->frame_type;
+
+		OSMGetHeader get = {
+			.num_get = count,
+		};
+		OSMSetHeader set = {
+			.num_set = count,
+		};
+		size_t len = osm_frame_encode(conn->out, size, &conn->header,
+			batch->frame_type == OSM_FT_GET ? (void *) &get : (void *) &set);
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			OSMBatchItem *item = &batch->items[batch->sent + i];
+			if (batch->frame_type == OSM_FT_GET)
+			{
+				osm_put_le64(conn->out + len, item->id);
+				len += OSM_WIRE_CONTROL_ID;
+			}
+			else
+			{
+				osm_control_set((OSMControl *)(conn->out + len), item->id, item->value);
+				len += OSM_WIRE_CONTROL;
+			}
+		}
+
+		// The frame is in flight from here, even if only partly sent
+		conn->out_len = len;
+		conn->out_off = 0;
+
+		OSMBatchPart *part = &conn->inflight[conn->head % conn->depth];
+		part->batch = batch;
+		part->first = batch->sent;
+		part->count = count;
+		part->sent_at = osm_metrics_now();
+		conn->head++;
+		conn->stats.frames_out++;
+		osm_metric_add(OSM_M_FRAMES_OUT, 1);
+		osm_metric_add(OSM_M_DEVICE_INFLIGHT, 1);
+		OSM_TRACE3(frame_send, conn->fd, batch->frame_type, len);
+		batch->pending++;
+		batch->sent += count;
+	}
+
+	// Nothing was sent for an empty batch
+	if (batch->count == 0 && batch->done != NULL)
+		batch->done(batch, batch->data);
+
+	return 1;
+}
+
+int osm_batch_send(OSMDevice *dev, OSMBatch *batch)
+{
+	while (1)
+	{
+		int ret = osm_batch_submit(dev, batch);
+		if (ret != 0)
+			return ret == 1 ? 0 : -1;
+
+		if (osm_device_poll(dev, true) == -1)
+			return -1;
+	}
+}
+
+const OSMConnStats *osm_device_stats(const OSMDevice *dev)
+{
+	return dev->conn != NULL ? &dev->conn->stats : NULL;
+}
+
+bool osm_device_want_write(OSMDevice *dev)
+{
+	return dev->conn != NULL && dev->conn->out_off < dev->conn->out_len;
+}
+
+int osm_device_poll(OSMDevice *dev, bool wait)
+{
+	OSMDeviceConn *conn = dev->conn;
+	if (conn == NULL)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	int done = 0;
+	while (1)
+	{
+		// Only block until something completes
+		int flags = wait && done == 0 ? 0 : MSG_DONTWAIT;
+		ssize_t ret;
+
+		if (conn->stream)
+		{
+			size_t len;
+			uint8_t *space = osm_framer_space(&conn->framer, &len);
+			ret = recv(conn->fd, space, len, flags);
+			if (ret > 0)
+			{
+				// The framer counts the bytes and frames for the global metrics
+				osm_framer_produce(&conn->framer, ret);
+				conn->stats.bytes_in += ret;
+
+				uint64_t now = osm_metrics_now();
+				const uint8_t *frame;
+				size_t frame_len;
+				while (osm_framer_next(&conn->framer, &frame, &frame_len))
+				{
+					conn->stats.frames_in++;
+					done += _osm_batch_reply(conn, frame, frame_len, now);
+				}
+			}
+		}
+		else
+		{
+			ret = recv(conn->fd, conn->in, OSM_WIRE_FRAME_MAX, flags);
+			if (ret > 0)
+			{
+				conn->stats.frames_in++;
+				conn->stats.bytes_in += ret;
+				osm_metric_add(OSM_M_FRAMES_IN, 1);
+				OSM_TRACE2(frame_recv, conn->fd, ret);
+				osm_metric_add(OSM_M_BYTES_IN, ret);
+				done += _osm_batch_reply(conn, conn->in, ret, osm_metrics_now());
+			}
+		}
+
+		if (ret > 0)
+			continue;
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// A blocking read only fails like this when the device timed out.
+			// Its late replies would answer the next requests, so start over
+			// on a new connection.
+			if (flags == 0)
+			{
+				_osm_batch_drop(dev, ETIMEDOUT);
+				return -1;
+			}
+			return done;
+		}
+
+		_osm_batch_drop(dev, ret == 0 ? ECONNRESET : errno);
+		return -1;
+	}
+}
+
+int osm_batch_wait(OSMDevice *dev, OSMBatch *batch)
+{
+	while (batch->pending > 0)
+	{
+		if (osm_device_poll(dev, true) == -1)
+			break;
+	}
+
+	if (batch->error != 0)
+	{
+		errno = batch->error;
+		return -1;
+	}
+	return 0;
+}
+
+int osm_batch_run(OSMDevice *dev, OSMBatch *batch)
+{
+	if (osm_batch_send(dev, batch) != 0)
+	{
+		// Frames already sent are still answered
+		int error = errno;
+		osm_batch_wait(dev, batch);
+		errno = error;
+		return -1;
+	}
+
+	return osm_batch_wait(dev, batch);
+}
@@ -1,6 +1,13 @@
 #include "osm/bind.h"
+#include "osm/conn.h"
+#include "osm/loop.h"
+#include "osm/metrics.h"
+#include "osm/trace.h"
+#include "osm/uring.h"
+#include "osm/workers.h"
 #include "osm/utils.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -8,7 +15,10 @@
 #include <stddef.h>
 #include <unistd.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 #include <threads.h>
@@ -16,6 +26,9 @@
 
 #define MAX_ID 0xFFFF
 
+/// Milliseconds to wait before probing a refusing socket again
+#define STALE_RETRY_MS 10
+
 /**
  * The required characters to represent an id as a file name
  * id - the id to get translated to a file name
@@ -59,13 +72,182 @@ void _write_name(int id, char *start)
 	}
 }
 
+/**
+ * Read an id back from a file name written by _write_name
+ * name - the file name
+ * return - the id, or -1 if the name is not an id
+ */
+int _read_name(const char *name)
+{
+	int id = 0;
+	int i = 0;
+
+	for (; name[i] != 0; i++)
+	{
+		// More characters than MAX_ID needs
+		if (i >= _need_chars(MAX_ID))
+			return -1;
+
+		char c = name[i];
+		if (c >= '0' && c <= '9')
+			id = id * 16 + (c - '0');
+		else if (c >= 'a' && c <= 'f')
+			id = id * 16 + (c - 'a' + 10);
+		else
+			return -1;
+	}
+
+	// _write_name never writes leading zeros
+	if (i == 0 || (i > 1 && name[0] == '0'))
+		return -1;
+
+	return id;
+}
+
+#define ID_WORDS ((MAX_ID + 1) / 64)
+
+/// Bitmap of onboard socket ids
+typedef struct {
+	uint64_t words[ID_WORDS];
+} _OSMIdSet;
+
+void _id_mark(_OSMIdSet *set, int id)
+{
+	set->words[id / 64] |= (uint64_t) 1 << (id % 64);
+}
+
+bool _id_marked(const _OSMIdSet *set, int id)
+{
+	return set->words[id / 64] & ((uint64_t) 1 << (id % 64));
+}
+
+/**
+ * Find the lowest id which isn't marked
+ * return - the id, or -1 if all are taken
+ */
+int _id_first_free(const _OSMIdSet *set)
+{
+	for (int i = 0; i < ID_WORDS; i++)
+	{
+		if (~set->words[i] != 0)
+			return i * 64 + __builtin_ctzll(~set->words[i]);
+	}
+
+	return -1;
+}
+
+/**
+ * Mark the ids of all live sockets bound directly under a path prefix
+ * prefix - the socket directory with a trailing slash ('@' first if abstract)
+ * return - false if the live sockets could not be listed
+ */
+bool _osm_live_ids(const char *prefix, _OSMIdSet *live)
+{
+	FILE *f = fopen("/proc/net/unix", "r");
+	if (f == NULL)
+		return false;
+
+	size_t len = strlen(prefix);
+	char line[512];
+
+	// Skip the column names
+	if (fgets(line, sizeof(line), f) == NULL)
+	{
+		fclose(f);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		// Path is the eighth column, and is missing for unbound sockets
+		char *path = line;
+		for (int field = 0; field < 7 && path != NULL; field++)
+		{
+			path += strspn(path, " ");
+			path = strchr(path, ' ');
+		}
+		if (path == NULL)
+			continue;
+
+		path += strspn(path, " ");
+		path[strcspn(path, "\n")] = 0;
+
+		if (strncmp(path, prefix, len) != 0)
+			continue;
+
+		int id = _read_name(path + len);
+		if (id >= 0)
+			_id_mark(live, id);
+	}
+
+	fclose(f);
+	return true;
+}
+
+/**
+ * Try to connect to a unix socket
+ * return - true if the connection was refused
+ */
+bool _osm_socket_refused(struct sockaddr_un *name, socklen_t len)
+{
+	int fd = socket(AF_LOCAL, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return false;
+
+	errno = 0;
+	bool refused = connect(fd, (struct sockaddr *) name, len) == -1 && errno == ECONNREFUSED;
+	close(fd);
+	return refused;
+}
+
+/**
+ * Check if a socket file is left over from a process which has exited
+ *
+ * A process which has just bound the socket refuses connections until it
+ * calls listen, so a refused socket is probed again after STALE_RETRY_MS.
+ * One which takes longer than that to start listening can still be taken
+ * for stale.
+ */
+bool _osm_socket_stale(struct sockaddr_un *name, socklen_t len)
+{
+	if (!_osm_socket_refused(name, len))
+		return false;
+
+	thrd_sleep(&(struct timespec){ .tv_nsec = STALE_RETRY_MS * 1000000L }, NULL);
+	return _osm_socket_refused(name, len);
+}
+
+/**
+ * Check if a unix socket file is left over from a process which has exited
+ * return - true only if path is a socket which refuses connections
+ */
+bool osm_socket_stale(const char *path)
+{
+	struct sockaddr_un name;
+	memset(&name, 0, sizeof(name));
+	name.sun_family = AF_LOCAL;
+
+	struct stat st;
+	if (strlen(path) >= sizeof(name.sun_path) || lstat(path, &st) != 0 || !S_ISSOCK(st.st_mode))
+		return false;
+
+	strcpy(name.sun_path, path);
+	return _osm_socket_stale(&name, sizeof(name));
+}
+
 /**
  * Bind to the next available onboard socket in the given directory
  * sock_dir - The directory containing osm sockets (or null for the default)
+ *
+ * The directory is scanned once to find the ids in use, unlinking sockets
+ * left behind by processes which have exited.  If sock_dir starts with '@'
+ * the socket is bound in the abstract namespace instead and no directory is
+ * needed.
  */
 int osm_bind_local(int sockfd, const char *sock_dir)
 {
 	struct sockaddr_un name;
+	memset(&name, 0, sizeof(name));
 	name.sun_family = AF_LOCAL;
 	
 	strncpy(name.sun_path, sock_dir, sizeof(name.sun_path));
@@ -74,6 +256,9 @@ int osm_bind_local(int sockfd, const char *sock_dir)
 	// Check for slash at end of path
 	int len = strlen(name.sun_path);
 
+	if (len == 0)
+		return -1;
+
 	if (name.sun_path[len - 1] != '/')
 	{
 		name.sun_path[len] = '/';
@@ -81,29 +266,75 @@ int osm_bind_local(int sockfd, const char *sock_dir)
 	}
 
 	// check that we won't overflow the buffer
-	if (len > sizeof(name.sun_path) - 2)
+	if (len + _need_chars(MAX_ID) > sizeof(name.sun_path) - 1)
 	{
 		return -1;
 	}
 
-	// sequentially try to bind
-	unsigned int id = 0;
+	// /proc/net/unix shows abstract names starting with '@'
+	char prefix[sizeof(name.sun_path)];
+	memcpy(prefix, name.sun_path, len);
+	prefix[len] = 0;
+
+	bool abstract = name.sun_path[0] == '@';
+	if (abstract)
+		name.sun_path[0] = 0;
+
+	_OSMIdSet used = {0};
+	_OSMIdSet live = {0};
+	bool have_live = _osm_live_ids(prefix, &live);
 	unsigned int offset = offsetof(struct sockaddr_un, sun_path);
-	while(_need_chars(id) + len < sizeof(name.sun_path) - 1)
+
+	if (abstract)
+	{
+		// Abstract names go away with their socket, nothing to clean up
+		used = live;
+	}
+	else
 	{
-		if (id > MAX_ID)
+		DIR *d = opendir(prefix);
+		if (d == NULL)
 			return -1;
 
-		// write file name
+		struct dirent *dir;
+		while ((dir = readdir(d)) != NULL)
+		{
+			if (dir->d_type != DT_SOCK && dir->d_type != DT_UNKNOWN)
+				continue;
+
+			int id = _read_name(dir->d_name);
+			if (id < 0)
+				continue;
+
+			// Not listed as bound, remove it if nobody answers
+			if (have_live && !_id_marked(&live, id))
+			{
+				_write_name(id, name.sun_path + len);
+				name.sun_path[len + _need_chars(id)] = 0;
+
+				if (_osm_socket_stale(&name, offset + strlen(name.sun_path)) && unlink(name.sun_path) == 0)
+					continue;
+			}
+
+			_id_mark(&used, id);
+		}
+
+		closedir(d);
+	}
+
+	// Another process may take an id between the scan and bind
+	int id;
+	while ((id = _id_first_free(&used)) != -1)
+	{
 		_write_name(id, name.sun_path + len);
-		
-		// try to bind
+		name.sun_path[len + _need_chars(id)] = 0;
+
 		errno = 0;
-		int err = bind(sockfd, (struct sockaddr *) &name, offset + strlen(name.sun_path));
+		int err = bind(sockfd, (struct sockaddr *) &name, offset + len + _need_chars(id));
 
 		if (err == 0)
 		{
-			printf("Bound!\n");
+			OSM_TRACE2(bind, sockfd, id);
 			return 0;
 		}
 		else if (errno != EADDRINUSE)
@@ -113,8 +344,7 @@ int osm_bind_local(int sockfd, const char *sock_dir)
 			return -1;
 		}
 
-		// inc id
-		id++;
+		_id_mark(&used, id);
 	}
 
 	return -1;
@@ -136,7 +366,7 @@ int osm_open_onboard(char *sock_dir)
 	int bound = -1;
 	if (sock_dir == NULL)
 	{
-		bound = osm_bind_local(sockfd, "/run/osm/onboard/");
+		bound = osm_bind_local(sockfd, OSM_ONBOARD_DIR);
 	}
 	else
 	{
@@ -153,53 +383,256 @@ int osm_open_onboard(char *sock_dir)
 	return sockfd;
 }
 
+/// State shared with the accept callback of osm_listen_and_dispatch
+typedef struct {
+	OSMWorkerPool *pool;
+	thrd_start_t callback;
+} _OSMAcceptState;
+
 /**
- * Listen for and return connections for a socket
- * return - a vector containing all the threads which this function started
+ * Queue a connection task on the worker pool for each accepted connection
  */
-Vector osm_listen_and_accept(int sockfd, thrd_start_t callback)
+void _osm_dispatch_connection(OSMLoop *loop, int fd, void *data)
 {
-	Vector out = vect_init(sizeof(thrd_t));
-	thrd_t thread;
+	_OSMAcceptState *state = data;
 
-	while(1)
+	if (fd == -1)
 	{
-		// Try to accept a connection
-		errno = 0;
-		int fd = accept(sockfd, NULL, NULL);
-		if (fd == -1)
-		{
-			if (errno != ECONNABORTED && errno != EINTR)
-			{
-				break;
-			}
-			else
-				continue;
-		}
-		
-		// Create and store the connection thread
-		errno = 0;
-		int ret = thrd_create(&thread, callback, (void*)(uintptr_t)fd);
-		if(ret == thrd_success)
-		{
-			vect_push(&out, &thread);
-		}
-		else
+		osm_loop_stop(loop);
+		return;
+	}
+
+	if (osm_workers_submit(state->pool, state->callback, (void*)(uintptr_t)fd) != 0)
+	{
+		fprintf(stderr, "Worker pool out of memory. Shutting down.\n");
+		close(fd);
+		osm_loop_stop(loop);
+	}
+}
+
+/// Milliseconds to wait before accepting again when out of fds or memory
+#define ACCEPT_RETRY_MS 10
+
+/// State for accepting on io_uring
+typedef struct {
+	_OSMAcceptState accept;
+	int sockfd;
+	bool started, unsupported, stopped;
+} _OSMUringAcceptState;
+
+/**
+ * Check whether a failed accept may succeed if tried again
+ * err - the (positive) errno
+ */
+bool _osm_accept_transient(int err)
+{
+	switch (err)
+	{
+		case ECONNABORTED:
+		case EINTR:
+		case EAGAIN:
+		case EPROTO:
+		case EPERM:
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Multishot accept completion
+ * The kernel ends a multishot accept on any error, so it is queued again
+ * unless the error is fatal.
+ */
+void _osm_uring_dispatch_connection(OSMUring *ring, int res, bool more, void *data)
+{
+	_OSMUringAcceptState *state = data;
+
+	if (res >= 0)
+	{
+		state->started = true;
+		osm_metric_add(OSM_M_ACCEPTS, 1);
+		OSM_TRACE1(accept, res);
+		if (osm_workers_submit(state->accept.pool, state->accept.callback, (void*)(uintptr_t)res) != 0)
 		{
-			if (ret == thrd_error)
-			{
-				perror("Error creating thread");
-			}
-			else if (ret == thrd_nomem)
-			{
-				fprintf(stderr, "Thread out of memory. Shutting down.\n");
-			}
-			break;
+			fprintf(stderr, "Worker pool out of memory. Shutting down.\n");
+			close(res);
+			state->stopped = true;
 		}
+	}
+	else if (!state->started && res == -EINVAL)
+	{
+		// Kernel without multishot accept
+		state->unsupported = true;
+		state->stopped = true;
+	}
+	else if (!_osm_accept_transient(-res))
+	{
+		osm_metric_add(OSM_M_ACCEPT_ERRORS, 1);
+		errno = -res;
+		perror("Error accepting connection");
+		state->stopped = true;
+	}
+	else if (res != -ECONNABORTED && res != -EINTR && res != -EAGAIN)
+	{
+		// Out of fds or memory, give connections a moment to close
+		thrd_sleep(&(struct timespec){ .tv_nsec = ACCEPT_RETRY_MS * 1000000L }, NULL);
+	}
 
+	if (state->stopped)
+	{
+		osm_uring_stop(ring);
+		return;
 	}
 
-	return out;
+	if (!more && osm_uring_accept(ring, state->sockfd, _osm_uring_dispatch_connection, state) != 0)
+	{
+		perror("Error accepting connection");
+		state->stopped = true;
+		osm_uring_stop(ring);
+	}
+}
+
+/**
+ * Accept on io_uring if possible
+ * return - 0 once the socket has failed, -1 if io_uring can't be used
+ */
+int _osm_listen_uring(int sockfd, _OSMAcceptState *accept)
+{
+	OSMUring ring;
+	if (osm_uring_init(&ring, 64) != 0)
+		return -1;
+
+	_OSMUringAcceptState state = {
+		.accept = *accept,
+		.sockfd = sockfd,
+	};
+
+	int ret = -1;
+	if (osm_uring_accept(&ring, sockfd, _osm_uring_dispatch_connection, &state) == 0)
+	{
+		osm_uring_run(&ring);
+		ret = state.unsupported ? -1 : 0;
+	}
+
+	osm_uring_end(&ring);
+	return ret;
+}
+
+/**
+ * Listen for connections and hand them to a worker pool
+ * Accepts on io_uring when it is available, otherwise on an OSMLoop.
+ * return - 0 once the socket has failed, -1 if listening could not start
+ */
+int osm_listen_and_dispatch(int sockfd, OSMWorkerPool *pool, thrd_start_t callback)
+{
+	_OSMAcceptState state = {
+		.pool = pool,
+		.callback = callback,
+	};
+
+	if (_osm_listen_uring(sockfd, &state) == 0)
+		return 0;
+
+	OSMLoop loop;
+	if (osm_loop_init(&loop) != 0)
+		return -1;
+
+	int ret = 0;
+	if (osm_loop_listen(&loop, sockfd, _osm_dispatch_connection, &state) == NULL)
+		ret = -1;
+	else
+		osm_loop_run(&loop);
+
+	osm_loop_end(&loop);
+	return ret;
+}
+
+/**
+ * Listen for connections on a socket, starting a thread for each one
+ * At most OSM_CONN_DEFAULT_MAX connections are handled at a time, and they
+ * are drained before returning.
+ * return - 0 once the socket has failed, -1 if listening could not start
+ */
+int osm_listen_and_serve(int sockfd, thrd_start_t callback)
+{
+	OSMConnManager manager;
+	OSMLoop loop;
+	if (osm_conn_init(&manager, 0, NULL, callback) != 0)
+	{
+		perror("Error creating connection manager");
+		return -1;
+	}
+
+	if (osm_loop_init(&loop) != 0)
+	{
+		perror("Error creating event loop");
+		osm_conn_end(&manager);
+		return -1;
+	}
+
+	int ret = 0;
+	if (osm_conn_listen(&manager, &loop, sockfd) != 0)
+	{
+		perror("Error listening on socket");
+		ret = -1;
+	}
+	else
+	{
+		osm_loop_run(&loop);
+	}
+
+	osm_conn_shutdown(&manager, 0);
+	osm_conn_end(&manager);
+	osm_loop_end(&loop);
+	return ret;
+}
+
+/**
+ * Listen for and return connections for a socket
+ * return - an empty vector, connection threads are detached
+ */
+Vector osm_listen_and_accept(int sockfd, thrd_start_t callback)
+{
+	osm_listen_and_serve(sockfd, callback);
+	return vect_init(sizeof(thrd_t));
+}
+
+/**
+ * Set an integer socket option
+ */
+int _osm_setsockopt(int fd, int level, int opt, int val)
+{
+	return setsockopt(fd, level, opt, &val, sizeof(val));
+}
+
+/**
+ * Set the options for small control frames on a TCP socket
+ * return - 0 on success, -1 on error
+ */
+int osm_tune_network(int fd)
+{
+	// Frames are small and latency sensitive, don't wait to coalesce them
+	if (_osm_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1) != 0)
+		return -1;
+
+	// Notice dead controllers in well under a minute
+	if (_osm_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, 1) != 0 ||
+		_osm_setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, OSM_NETWORK_KEEPIDLE) != 0 ||
+		_osm_setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, OSM_NETWORK_KEEPINTVL) != 0 ||
+		_osm_setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, OSM_NETWORK_KEEPCNT) != 0)
+		return -1;
+
+	// Don't let unacknowledged frames sit in the send queue forever either
+	if (_osm_setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+		(OSM_NETWORK_KEEPIDLE + OSM_NETWORK_KEEPINTVL * OSM_NETWORK_KEEPCNT) * 1000) != 0)
+		return -1;
+
+	return 0;
 }
 
 /**
@@ -210,11 +643,79 @@ Vector osm_listen_and_accept(int sockfd, thrd_start_t callback)
  * master process to handle internet traffic and export each device as a
  * sub-device.
  *
- * return - a negative number on error, or the 
+ * port - the port to listen on (0 for OSM_NETWORK_PORT)
+ * reuseport - set SO_REUSEPORT so more listeners can share the port
+ * return - a negative number on error, or the listening socket fd
  */
-int osm_open_network()
+int osm_open_network(uint16_t port, bool reuseport)
 {
-	int sockfd = socket(AF_INET6, SOCK_STREAM, 0);
+	int sockfd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd == -1)
+		return -1;
+
+	if (port == 0)
+		port = OSM_NETWORK_PORT;
+
+	// Accept IPv4 connections as mapped addresses too
+	if (_osm_setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, 0) != 0 ||
+		_osm_setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, 1) != 0)
+		goto fail;
+
+	if (reuseport && _osm_setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, 1) != 0)
+		goto fail;
+
+	// Accepted connections inherit these from the listener
+	if (osm_tune_network(sockfd) != 0)
+		goto fail;
+
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+
+	if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		goto fail;
+
+	if (listen(sockfd, SOMAXCONN) != 0)
+		goto fail;
+
+	OSM_TRACE2(bind_network, sockfd, port);
 	return sockfd;
+
+fail:
+	close(sockfd);
+	return -1;
 }
 
+/**
+ * Open a group of SO_REUSEPORT listeners on the same port
+ * return - a vector of listening socket fds, empty on error
+ */
+Vector osm_open_network_group(uint16_t port, unsigned int count)
+{
+	Vector out = vect_init(sizeof(int));
+
+	if (count == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? cpus : 1;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int fd = osm_open_network(port, true);
+		if (fd == -1)
+		{
+			// Don't hand back a partial group
+			for (unsigned int j = 0; j < out.count; j++)
+				close(*(int *) vect_get(&out, j));
+			vect_clear(&out);
+			break;
+		}
+
+		vect_push(&out, &fd);
+	}
+
+	return out;
+}
@@ -0,0 +1,170 @@
+#include "osm/blake2s.h"
+#include "osm/codec.h"
+
+#include <errno.h>
+#include <string.h>
+
+static const uint32_t BLAKE2S_IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint8_t BLAKE2S_SIGMA[10][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+};
+
+static inline uint32_t _osm_rotr32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+#define G(a, b, c, d, x, y) \
+	do { \
+		a = a + b + x; d = _osm_rotr32(d ^ a, 16); \
+		c = c + d;     b = _osm_rotr32(b ^ c, 12); \
+		a = a + b + y; d = _osm_rotr32(d ^ a, 8); \
+		c = c + d;     b = _osm_rotr32(b ^ c, 7); \
+	} while (0)
+
+/**
+ * Compress one block into the state
+ */
+void _osm_blake2s_compress(OSMBlake2s *s, const uint8_t *block, bool last)
+{
+	uint32_t m[16], v[16];
+
+	for (int i = 0; i < 16; i++)
+		m[i] = osm_get_le32(block + i * 4);
+
+	for (int i = 0; i < 8; i++)
+	{
+		v[i] = s->h[i];
+		v[i + 8] = BLAKE2S_IV[i];
+	}
+	v[12] ^= s->t[0];
+	v[13] ^= s->t[1];
+	if (last)
+		v[14] = ~v[14];
+
+	for (int r = 0; r < 10; r++)
+	{
+		const uint8_t *sg = BLAKE2S_SIGMA[r];
+		G(v[0], v[4], v[8],  v[12], m[sg[0]],  m[sg[1]]);
+		G(v[1], v[5], v[9],  v[13], m[sg[2]],  m[sg[3]]);
+		G(v[2], v[6], v[10], v[14], m[sg[4]],  m[sg[5]]);
+		G(v[3], v[7], v[11], v[15], m[sg[6]],  m[sg[7]]);
+		G(v[0], v[5], v[10], v[15], m[sg[8]],  m[sg[9]]);
+		G(v[1], v[6], v[11], v[12], m[sg[10]], m[sg[11]]);
+		G(v[2], v[7], v[8],  v[13], m[sg[12]], m[sg[13]]);
+		G(v[3], v[4], v[9],  v[14], m[sg[14]], m[sg[15]]);
+	}
+
+	for (int i = 0; i < 8; i++)
+		s->h[i] ^= v[i] ^ v[i + 8];
+}
+
+/**
+ * Count bytes towards the block counter
+ */
+void _osm_blake2s_count(OSMBlake2s *s, uint32_t len)
+{
+	s->t[0] += len;
+	if (s->t[0] < len)
+		s->t[1]++;
+}
+
+int osm_blake2s_init(OSMBlake2s *s, size_t outlen, const void *key, size_t keylen)
+{
+	if (outlen == 0 || outlen > OSM_BLAKE2S_LEN || keylen > OSM_BLAKE2S_LEN || (key == NULL && keylen > 0))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(s->h, BLAKE2S_IV, sizeof(s->h));
+	s->h[0] ^= 0x01010000 ^ (keylen << 8) ^ outlen;
+	s->t[0] = 0;
+	s->t[1] = 0;
+	s->buflen = 0;
+	s->outlen = outlen;
+
+	// The key is hashed as a whole first block
+	if (keylen > 0)
+	{
+		memset(s->buf, 0, OSM_BLAKE2S_BLOCK);
+		memcpy(s->buf, key, keylen);
+		s->buflen = OSM_BLAKE2S_BLOCK;
+	}
+
+	return 0;
+}
+
+void osm_blake2s_precompute(OSMBlake2s *s)
+{
+	if (s->buflen == OSM_BLAKE2S_BLOCK)
+	{
+		_osm_blake2s_count(s, OSM_BLAKE2S_BLOCK);
+		_osm_blake2s_compress(s, s->buf, false);
+		s->buflen = 0;
+	}
+}
+
+void osm_blake2s_update(OSMBlake2s *s, const void *data, size_t len)
+{
+	const uint8_t *in = data;
+
+	while (len > 0)
+	{
+		// The last block is only compressed in final, so a full buffer waits
+		// until more data arrives
+		if (s->buflen == OSM_BLAKE2S_BLOCK)
+		{
+			_osm_blake2s_count(s, OSM_BLAKE2S_BLOCK);
+			_osm_blake2s_compress(s, s->buf, false);
+			s->buflen = 0;
+		}
+
+		// Compress whole blocks straight from the input
+		if (s->buflen == 0)
+		{
+			while (len > OSM_BLAKE2S_BLOCK)
+			{
+				_osm_blake2s_count(s, OSM_BLAKE2S_BLOCK);
+				_osm_blake2s_compress(s, in, false);
+				in += OSM_BLAKE2S_BLOCK;
+				len -= OSM_BLAKE2S_BLOCK;
+			}
+		}
+
+		size_t n = OSM_BLAKE2S_BLOCK - s->buflen;
+		if (n > len)
+			n = len;
+
+		memcpy(s->buf + s->buflen, in, n);
+		s->buflen += n;
+		in += n;
+		len -= n;
+	}
+}
+
+void osm_blake2s_final(OSMBlake2s *s, uint8_t *out)
+{
+	_osm_blake2s_count(s, s->buflen);
+	memset(s->buf + s->buflen, 0, OSM_BLAKE2S_BLOCK - s->buflen);
+	_osm_blake2s_compress(s, s->buf, true);
+
+	uint8_t digest[OSM_BLAKE2S_LEN];
+	for (int i = 0; i < 8; i++)
+		osm_put_le32(digest + i * 4, s->h[i]);
+
+	memcpy(out, digest, s->outlen);
+}
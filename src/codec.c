@@ -0,0 +1,298 @@
+#include "osm/codec.h"
+#include "osm/protocol.h"
+#include "osm/trace.h"
+
+#include <errno.h>
+#include <string.h>
+
+// Frame headers are all bytes and are gathered as they are by osm_send_frames
+_Static_assert(sizeof(OSMFrameHeader) == OSM_WIRE_FRAME_HEADER, "OSMFrameHeader must match its wire layout");
+// Controls are read in place from the payload
+_Static_assert(sizeof(OSMControl) == OSM_WIRE_CONTROL, "OSMControl must match its wire layout");
+_Static_assert(_Alignof(OSMControl) == 1, "OSMControl must not need alignment");
+
+ssize_t osm_wire_sub_len(uint8_t frame_type)
+{
+	switch (frame_type)
+	{
+		case OSM_FT_RES:
+			return 2;
+		case OSM_FT_SET:
+		case OSM_FT_GET:
+			return 1;
+		case OSM_FT_DAT:
+			return 3;
+		case OSM_FT_SVO:
+			return 12;
+		case OSM_FT_SVI:
+			return 14;
+		case OSM_FT_SCL:
+			return 1;
+	}
+
+	return -1;
+}
+
+/**
+ * Length of the payload following a secondary header on the wire
+ */
+size_t _osm_payload_len(uint8_t frame_type, const uint8_t *sub)
+{
+	switch (frame_type)
+	{
+		case OSM_FT_RES:
+			return (size_t) sub[1] * OSM_WIRE_CONTROL;
+		case OSM_FT_SET:
+			return (size_t) sub[0] * OSM_WIRE_CONTROL;
+		case OSM_FT_GET:
+			return (size_t) sub[0] * OSM_WIRE_CONTROL_ID;
+		case OSM_FT_DAT:
+			return osm_get_le16(sub + 1);
+	}
+
+	return 0;
+}
+
+/**
+ * Check as much of a magic number as is available
+ */
+bool _osm_magic_prefix(const uint8_t *buf, size_t len, const char magic[4])
+{
+	return memcmp(buf, magic, len < 4 ? len : 4) == 0;
+}
+
+ssize_t osm_frame_len(const uint8_t *buf, size_t len)
+{
+	bool frame = _osm_magic_prefix(buf, len, OSM_MAGIC_FRAME);
+	bool init = _osm_magic_prefix(buf, len, OSM_MAGIC_INIT);
+
+	if (!frame && !init)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (len < 4)
+		return 0;
+
+	if (init)
+	{
+		if (len < OSM_WIRE_INIT_HEADER)
+			return 0;
+
+		uint16_t keylen = osm_get_le16(buf + 14);
+		if (keylen > OSM_WIRE_KEY_MAX)
+		{
+			errno = EBADMSG;
+			return -1;
+		}
+		return OSM_WIRE_INIT_HEADER + keylen;
+	}
+
+	if (len < OSM_WIRE_FRAME_HEADER)
+		return 0;
+
+	uint8_t frame_type = buf[20];
+	ssize_t sub_len = osm_wire_sub_len(frame_type);
+	if (sub_len == -1)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (len < OSM_WIRE_FRAME_HEADER + (size_t) sub_len)
+		return 0;
+
+	return OSM_WIRE_FRAME_HEADER + sub_len + _osm_payload_len(frame_type, buf + OSM_WIRE_FRAME_HEADER);
+}
+
+int osm_frame_parse(OSMFrameView *view, const uint8_t *buf, size_t len)
+{
+	if (len < OSM_WIRE_FRAME_HEADER || memcmp(buf, OSM_MAGIC_FRAME, 4) != 0)
+	{
+		OSM_TRACE3(frame_decode, -1, len, -1);
+		errno = EBADMSG;
+		return -1;
+	}
+
+	uint8_t frame_type = buf[20];
+	ssize_t sub_len = osm_wire_sub_len(frame_type);
+	if (sub_len == -1 || len < OSM_WIRE_FRAME_HEADER + (size_t) sub_len)
+	{
+		OSM_TRACE3(frame_decode, frame_type, len, -1);
+		errno = EBADMSG;
+		return -1;
+	}
+
+	const uint8_t *sub = buf + OSM_WIRE_FRAME_HEADER;
+	size_t payload_len = _osm_payload_len(frame_type, sub);
+	size_t frame_len = OSM_WIRE_FRAME_HEADER + sub_len + payload_len;
+	if (len < frame_len)
+	{
+		OSM_TRACE3(frame_decode, frame_type, len, -1);
+		errno = EBADMSG;
+		return -1;
+	}
+
+	memset(&view->sub, 0, sizeof(view->sub));
+	switch (frame_type)
+	{
+		case OSM_FT_RES:
+			view->sub.res.res_type = sub[0];
+			view->sub.res.num_res = sub[1];
+			break;
+		case OSM_FT_SET:
+			view->sub.set.num_set = sub[0];
+			break;
+		case OSM_FT_GET:
+			view->sub.get.num_get = sub[0];
+			break;
+		case OSM_FT_DAT:
+			view->sub.data.number = sub[0];
+			view->sub.data.len = osm_get_le16(sub + 1);
+			break;
+		case OSM_FT_SVO:
+			view->sub.stream_out.number = sub[0];
+			view->sub.stream_out.flags = sub[1];
+			view->sub.stream_out.credits = osm_get_le16(sub + 2);
+			view->sub.stream_out.control_id = osm_get_le64(sub + 4);
+			break;
+		case OSM_FT_SVI:
+			view->sub.stream_in.number = sub[0];
+			view->sub.stream_in.flags = sub[1];
+			view->sub.stream_in.credits = osm_get_le16(sub + 2);
+			view->sub.stream_in.control_id = osm_get_le64(sub + 4);
+			view->sub.stream_in.max_len = osm_get_le16(sub + 12);
+			break;
+		case OSM_FT_SCL:
+			view->sub.stream_close.number = sub[0];
+			break;
+	}
+
+	view->uuid = buf + 4;
+	view->sub_uuid = buf + 12;
+	view->frame_type = frame_type;
+	view->payload = sub + sub_len;
+	view->payload_len = payload_len;
+	view->len = frame_len;
+	OSM_TRACE3(frame_decode, frame_type, frame_len, 0);
+	return 0;
+}
+
+int osm_init_parse(OSMInitView *view, const uint8_t *buf, size_t len)
+{
+	if (len < OSM_WIRE_INIT_HEADER || memcmp(buf, OSM_MAGIC_INIT, 4) != 0)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	uint16_t keylen = osm_get_le16(buf + 14);
+	if (keylen > OSM_WIRE_KEY_MAX || len < OSM_WIRE_INIT_HEADER + (size_t) keylen)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	view->version = buf[4];
+	view->uuid = buf + 5;
+	view->keytype = buf[13];
+	view->keylen = keylen;
+	view->key = buf + OSM_WIRE_INIT_HEADER;
+	view->len = OSM_WIRE_INIT_HEADER + keylen;
+	return 0;
+}
+
+ssize_t osm_sub_encode(uint8_t *buf, uint8_t frame_type, const void *sub_header)
+{
+	ssize_t sub_len = osm_wire_sub_len(frame_type);
+	if (sub_len <= 0)
+		return sub_len;
+
+	// Frame types with a secondary header send zeroes if none is given
+	if (sub_header == NULL)
+	{
+		memset(buf, 0, sub_len);
+		return sub_len;
+	}
+
+	switch (frame_type)
+	{
+		case OSM_FT_RES:
+		{
+			const OSMResHeader *res = sub_header;
+			buf[0] = res->res_type;
+			buf[1] = res->num_res;
+			break;
+		}
+		case OSM_FT_SET:
+			buf[0] = ((const OSMSetHeader *) sub_header)->num_set;
+			break;
+		case OSM_FT_GET:
+			buf[0] = ((const OSMGetHeader *) sub_header)->num_get;
+			break;
+		case OSM_FT_DAT:
+		{
+			const OSMDataHeader *data = sub_header;
+			buf[0] = data->number;
+			osm_put_le16(buf + 1, data->len);
+			break;
+		}
+		case OSM_FT_SVO:
+		{
+			const OSMStreamOutHeader *out = sub_header;
+			buf[0] = out->number;
+			buf[1] = out->flags;
+			osm_put_le16(buf + 2, out->credits);
+			osm_put_le64(buf + 4, out->control_id);
+			break;
+		}
+		case OSM_FT_SVI:
+		{
+			const OSMStreamInHeader *in = sub_header;
+			buf[0] = in->number;
+			buf[1] = in->flags;
+			osm_put_le16(buf + 2, in->credits);
+			osm_put_le64(buf + 4, in->control_id);
+			osm_put_le16(buf + 12, in->max_len);
+			break;
+		}
+		case OSM_FT_SCL:
+			buf[0] = ((const OSMStreamCloseHeader *) sub_header)->number;
+			break;
+	}
+
+	return sub_len;
+}
+
+size_t osm_frame_encode(uint8_t *buf, size_t size, const OSMFrameHeader *header, const void *sub_header)
+{
+	ssize_t sub_len = osm_wire_sub_len(header->frame_type);
+	if (sub_len == -1 || size < OSM_WIRE_FRAME_HEADER + (size_t) sub_len)
+		return 0;
+
+	memcpy(buf, OSM_MAGIC_FRAME, 4);
+	memcpy(buf + 4, header->uuid, 8);
+	memcpy(buf + 12, header->sub_uuid, 8);
+	buf[20] = header->frame_type;
+
+	osm_sub_encode(buf + OSM_WIRE_FRAME_HEADER, header->frame_type, sub_header);
+	return OSM_WIRE_FRAME_HEADER + sub_len;
+}
+
+size_t osm_init_encode(uint8_t *buf, size_t size, const OSMInitFrameHeader *header, const uint8_t *key)
+{
+	if (header->keylen > OSM_WIRE_KEY_MAX || size < OSM_WIRE_INIT_HEADER + (size_t) header->keylen)
+		return 0;
+
+	memcpy(buf, OSM_MAGIC_INIT, 4);
+	buf[4] = header->version;
+	memcpy(buf + 5, header->uuid, 8);
+	buf[13] = header->keytype;
+	osm_put_le16(buf + 14, header->keylen);
+
+	if (header->keylen > 0)
+		memcpy(buf + OSM_WIRE_INIT_HEADER, key, header->keylen);
+
+	return OSM_WIRE_INIT_HEADER + header->keylen;
+}
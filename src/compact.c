@@ -0,0 +1,223 @@
+#include "osm/compact.h"
+#include "osm/device.h"
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Kinds of controls, in the low bits of their first byte
+ */
+#define OSM_COMPACT_FALSE 0
+#define OSM_COMPACT_TRUE  1
+#define OSM_COMPACT_INT   2
+#define OSM_COMPACT_FLOAT 3
+
+/// Set in the control byte of a float which changed
+#define OSM_COMPACT_XOR 0x80
+
+void osm_compact_reset(OSMCompactState *state)
+{
+	memset(state, 0, sizeof(*state));
+}
+
+/**
+ * Encode a float as the bytes which differ from the previous one
+ */
+size_t _osm_compact_put_float(OSMCompactState *state, uint8_t *buf, uint64_t bits)
+{
+	uint64_t x = bits ^ state->bits;
+	state->bits = bits;
+
+	if (x == 0)
+	{
+		buf[0] = 0;
+		return 1;
+	}
+
+	unsigned int lead = __builtin_clzll(x) / 8;
+	unsigned int trail = __builtin_ctzll(x) / 8;
+	unsigned int n = 8 - lead - trail;
+
+	buf[0] = OSM_COMPACT_XOR | lead << 3 | trail;
+	x >>= trail * 8;
+	for (unsigned int i = 0; i < n; i++)
+		buf[1 + i] = x >> (i * 8);
+
+	return 1 + n;
+}
+
+ssize_t _osm_compact_get_float(OSMCompactState *state, const uint8_t *buf, size_t len, uint64_t *value)
+{
+	if (len < 1)
+		goto bad;
+
+	if (buf[0] == 0)
+	{
+		*value = state->bits;
+		return 1;
+	}
+
+	unsigned int lead = (buf[0] >> 3) & 0x7;
+	unsigned int trail = buf[0] & 0x7;
+	if (!(buf[0] & OSM_COMPACT_XOR) || (buf[0] & 0x40) || lead + trail >= 8)
+		goto bad;
+
+	unsigned int n = 8 - lead - trail;
+	if (len < 1 + n)
+		goto bad;
+
+	uint64_t x = 0;
+	for (unsigned int i = 0; i < n; i++)
+		x |= (uint64_t) buf[1 + i] << (i * 8);
+
+	state->bits ^= x << (trail * 8);
+	*value = state->bits;
+	return 1 + n;
+
+bad:
+	errno = EBADMSG;
+	return -1;
+}
+
+size_t osm_compact_put_value(OSMCompactState *state, uint8_t *buf, uint8_t type, uint64_t value)
+{
+	switch (type)
+	{
+		case OSM_TYPE_BOOL:
+			buf[0] = value ? 1 : 0;
+			return 1;
+		case OSM_TYPE_INT:
+		{
+			int64_t delta = (int64_t)(value - state->integer);
+			state->integer = value;
+			return osm_put_varint(buf, osm_zigzag(delta));
+		}
+		case OSM_TYPE_FLOAT:
+			return _osm_compact_put_float(state, buf, value);
+	}
+
+	errno = EOPNOTSUPP;
+	return 0;
+}
+
+ssize_t osm_compact_get_value(OSMCompactState *state, const uint8_t *buf, size_t len, uint8_t type, uint64_t *value)
+{
+	switch (type)
+	{
+		case OSM_TYPE_BOOL:
+			if (len < 1 || buf[0] > 1)
+				break;
+			*value = buf[0];
+			return 1;
+		case OSM_TYPE_INT:
+		{
+			uint64_t zz;
+			size_t n = osm_get_varint(buf, len, &zz);
+			if (n == 0)
+				break;
+			state->integer += (uint64_t) osm_unzigzag(zz);
+			*value = state->integer;
+			return n;
+		}
+		case OSM_TYPE_FLOAT:
+			return _osm_compact_get_float(state, buf, len, value);
+		default:
+			errno = EOPNOTSUPP;
+			return -1;
+	}
+
+	errno = EBADMSG;
+	return -1;
+}
+
+size_t osm_compact_put_control(OSMCompactState *state, uint8_t *buf, uint8_t type, uint64_t id, uint64_t value)
+{
+	uint8_t kind;
+	switch (type)
+	{
+		case OSM_TYPE_BOOL:
+			kind = value ? OSM_COMPACT_TRUE : OSM_COMPACT_FALSE;
+			break;
+		case OSM_TYPE_INT:
+			kind = OSM_COMPACT_INT;
+			break;
+		case OSM_TYPE_FLOAT:
+			kind = OSM_COMPACT_FLOAT;
+			break;
+		default:
+			errno = EOPNOTSUPP;
+			return 0;
+	}
+
+	// The first byte holds a continuation bit, the kind and 5 bits of the
+	// id's difference, the rest of which follows as a varint
+	uint64_t zz = osm_zigzag((int64_t)(id - state->id));
+	state->id = id;
+
+	size_t n = 1;
+	buf[0] = kind << 5 | (zz & 0x1f);
+	if (zz >> 5)
+	{
+		buf[0] |= 0x80;
+		n += osm_put_varint(buf + 1, zz >> 5);
+	}
+
+	if (type == OSM_TYPE_BOOL)
+		return n;
+	return n + osm_compact_put_value(state, buf + n, type, value);
+}
+
+ssize_t osm_compact_get_control(OSMCompactState *state, const uint8_t *buf, size_t len,
+	uint8_t *type, uint64_t *id, uint64_t *value)
+{
+	if (len < 1)
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	uint8_t kind = (buf[0] >> 5) & 0x3;
+	uint64_t zz = buf[0] & 0x1f;
+	size_t n = 1;
+
+	if (buf[0] & 0x80)
+	{
+		uint64_t high;
+		size_t m = osm_get_varint(buf + 1, len - 1, &high);
+		if (m == 0 || high >> 59)
+		{
+			errno = EBADMSG;
+			return -1;
+		}
+		zz |= high << 5;
+		n += m;
+	}
+
+	switch (kind)
+	{
+		case OSM_COMPACT_FALSE:
+		case OSM_COMPACT_TRUE:
+			*type = OSM_TYPE_BOOL;
+			*value = kind == OSM_COMPACT_TRUE;
+			break;
+		case OSM_COMPACT_INT:
+			*type = OSM_TYPE_INT;
+			break;
+		default:
+			*type = OSM_TYPE_FLOAT;
+			break;
+	}
+
+	// The state is only updated once the whole control has been decoded
+	if (*type != OSM_TYPE_BOOL)
+	{
+		ssize_t m = osm_compact_get_value(state, buf + n, len - n, *type, value);
+		if (m == -1)
+			return -1;
+		n += m;
+	}
+
+	state->id += (uint64_t) osm_unzigzag(zz);
+	*id = state->id;
+	return n;
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include "osm/conn.h"
+#include "osm/loop.h"
+#include "osm/metrics.h"
+#include "osm/trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define CONN_NONE ((unsigned int) -1)
+
+/// File descriptors left for everything but connections when sizing the table
+#define CONN_RESERVED_FDS 64
+
+/// How long accepting pauses after running out of fds or memory
+#define CONN_RETRY_MS 10
+
+/**
+ * Get the default connection limit: OSM_CONN_DEFAULT_MAX, or fewer if the
+ * fd limit can't hold that many.  Each connection uses two fds, the
+ * callback's and the manager's duplicate.
+ */
+unsigned int _osm_conn_default_max()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+		return OSM_CONN_DEFAULT_MAX;
+
+	if (limit.rlim_cur < CONN_RESERVED_FDS + 2)
+		return 1;
+
+	rlim_t fit = (limit.rlim_cur - CONN_RESERVED_FDS) / 2;
+	return fit < OSM_CONN_DEFAULT_MAX ? fit : OSM_CONN_DEFAULT_MAX;
+}
+
+int osm_conn_init(OSMConnManager *manager, unsigned int max, OSMWorkerPool *pool, thrd_start_t callback)
+{
+	if (max == 0)
+		max = _osm_conn_default_max();
+
+	manager->conns = calloc(max, sizeof(OSMConn));
+	if (manager->conns == NULL)
+		return -1;
+
+	if (mtx_init(&manager->lock, mtx_plain) != thrd_success)
+	{
+		free(manager->conns);
+		return -1;
+	}
+	if (cnd_init(&manager->drained) != thrd_success)
+	{
+		mtx_destroy(&manager->lock);
+		free(manager->conns);
+		return -1;
+	}
+
+	manager->max = max;
+	manager->active = 0;
+	manager->pool = pool;
+	manager->callback = callback;
+	manager->loop = NULL;
+	manager->listener = NULL;
+	manager->retry = NULL;
+	manager->paused = false;
+	manager->shutting_down = false;
+
+	// Chain every slot into the free list
+	for (unsigned int i = 0; i < max; i++)
+	{
+		manager->conns[i].manager = manager;
+		manager->conns[i].fd = -1;
+		manager->conns[i].callback_fd = -1;
+		manager->conns[i].next_free = i + 1 < max ? i + 1 : CONN_NONE;
+	}
+	manager->free_head = 0;
+
+	return 0;
+}
+
+/**
+ * Start or stop watching the listener, manager lock must be held
+ */
+void _osm_conn_set_paused(OSMConnManager *manager, bool paused)
+{
+	if (manager->paused == paused || manager->listener == NULL)
+		return;
+
+	if (osm_loop_mod(manager->loop, manager->listener, paused ? 0 : OSM_LOOP_READ) == 0)
+		manager->paused = paused;
+}
+
+/**
+ * Stop accepting for a while after running out of fds or memory.  Accepting
+ * resumes when the retry timer fires or a connection's slot is freed.
+ * Manager lock must be held.
+ */
+void _osm_conn_back_off(OSMConnManager *manager)
+{
+	osm_metric_add(OSM_M_ACCEPT_ERRORS, 1);
+	_osm_conn_set_paused(manager, true);
+	osm_loop_timer_set(manager->loop, manager->retry, CONN_RETRY_MS, false);
+}
+
+/**
+ * Read callback for the retry timer
+ */
+void _osm_conn_retry(OSMLoop *loop, OSMLoopHandle *h, void *data)
+{
+	OSMConnManager *manager = data;
+
+	mtx_lock(&manager->lock);
+	if (!manager->shutting_down && manager->free_head != CONN_NONE)
+		_osm_conn_set_paused(manager, false);
+	mtx_unlock(&manager->lock);
+}
+
+/**
+ * Free a connection's slot, manager lock must be held
+ */
+void _osm_conn_free(OSMConnManager *manager, OSMConn *conn)
+{
+	close(conn->fd);
+	conn->fd = -1;
+	conn->callback_fd = -1;
+	conn->next_free = manager->free_head;
+	manager->free_head = conn - manager->conns;
+	manager->active--;
+}
+
+/**
+ * Run a connection's callback, then free its slot.  The callback closes its
+ * own fd, only the manager's duplicate is closed here.
+ */
+int _osm_conn_run(void *data)
+{
+	OSMConn *conn = data;
+	OSMConnManager *manager = conn->manager;
+
+	manager->callback((void*)(uintptr_t) conn->callback_fd);
+
+	mtx_lock(&manager->lock);
+
+	_osm_conn_free(manager, conn);
+
+	if (manager->shutting_down)
+	{
+		if (manager->active == 0)
+			cnd_broadcast(&manager->drained);
+	}
+	else
+	{
+		_osm_conn_set_paused(manager, false);
+	}
+
+	mtx_unlock(&manager->lock);
+	return 0;
+}
+
+/**
+ * Run a connection on the manager's pool, or on its own thread if it has none
+ * return - 0 on success, -1 on error
+ */
+int _osm_conn_start(OSMConnManager *manager, OSMConn *conn)
+{
+	if (manager->pool != NULL)
+		return osm_workers_submit(manager->pool, _osm_conn_run, conn);
+
+	thrd_t thread;
+	if (thrd_create(&thread, _osm_conn_run, conn) != thrd_success)
+		return -1;
+
+	thrd_detach(thread);
+	return 0;
+}
+
+/**
+ * Read callback for the listening socket: accept until out of slots
+ */
+void _osm_conn_accept(OSMLoop *loop, OSMLoopHandle *h, void *data)
+{
+	OSMConnManager *manager = data;
+
+	while (1)
+	{
+		mtx_lock(&manager->lock);
+		if (manager->shutting_down || manager->free_head == CONN_NONE)
+		{
+			if (!manager->shutting_down)
+				_osm_conn_set_paused(manager, true);
+			mtx_unlock(&manager->lock);
+			return;
+		}
+		mtx_unlock(&manager->lock);
+
+		int fd = accept4(h->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+			{
+				mtx_lock(&manager->lock);
+				_osm_conn_back_off(manager);
+				mtx_unlock(&manager->lock);
+				return;
+			}
+
+			osm_metric_add(OSM_M_ACCEPT_ERRORS, 1);
+			perror("Error accepting connection");
+			osm_loop_stop(loop);
+			return;
+		}
+
+		osm_metric_add(OSM_M_ACCEPTS, 1);
+		OSM_TRACE1(accept, fd);
+
+		// The callback may close its fd at any time, so drain through a
+		// duplicate whose number can't be reused while the slot is taken
+		int drain_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (drain_fd == -1)
+		{
+			// Out of fds between the two, drop this connection
+			close(fd);
+			mtx_lock(&manager->lock);
+			_osm_conn_back_off(manager);
+			mtx_unlock(&manager->lock);
+			return;
+		}
+
+		// Only this thread takes slots, so one is still free
+		mtx_lock(&manager->lock);
+		OSMConn *conn = &manager->conns[manager->free_head];
+		manager->free_head = conn->next_free;
+		manager->active++;
+		conn->fd = drain_fd;
+		conn->callback_fd = fd;
+		mtx_unlock(&manager->lock);
+
+		if (_osm_conn_start(manager, conn) != 0)
+		{
+			// Out of memory or threads, drop the connection and wait for
+			// some to finish
+			mtx_lock(&manager->lock);
+			close(conn->callback_fd);
+			_osm_conn_free(manager, conn);
+			_osm_conn_back_off(manager);
+			mtx_unlock(&manager->lock);
+			return;
+		}
+	}
+}
+
+int osm_conn_listen(OSMConnManager *manager, OSMLoop *loop, int sockfd)
+{
+	int flags = fcntl(sockfd, F_GETFL);
+	if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	// Created up front, as there may be no fds left once it is needed
+	OSMLoopHandle *retry = osm_loop_timer(loop, CONN_RETRY_MS, false, _osm_conn_retry, manager);
+	if (retry == NULL)
+		return -1;
+	if (osm_loop_timer_cancel(loop, retry) != 0)
+	{
+		osm_loop_del(loop, retry);
+		return -1;
+	}
+
+	mtx_lock(&manager->lock);
+	manager->loop = loop;
+	manager->retry = retry;
+	manager->listener = osm_loop_add(loop, sockfd, OSM_LOOP_READ, _osm_conn_accept, NULL, manager);
+	manager->paused = false;
+	mtx_unlock(&manager->lock);
+
+	return manager->listener == NULL ? -1 : 0;
+}
+
+unsigned int osm_conn_active(OSMConnManager *manager)
+{
+	mtx_lock(&manager->lock);
+	unsigned int active = manager->active;
+	mtx_unlock(&manager->lock);
+	return active;
+}
+
+int osm_conn_shutdown(OSMConnManager *manager, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	timespec_get(&deadline, TIME_UTC);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	mtx_lock(&manager->lock);
+
+	_osm_conn_set_paused(manager, true);
+	manager->shutting_down = true;
+
+	// Let callbacks finish reading what has already arrived
+	for (unsigned int i = 0; i < manager->max; i++)
+	{
+		if (manager->conns[i].fd != -1)
+			shutdown(manager->conns[i].fd, SHUT_RD);
+	}
+
+	int ret = 0;
+	while (manager->active > 0)
+	{
+		if (timeout_ms == 0)
+		{
+			cnd_wait(&manager->drained, &manager->lock);
+		}
+		else if (cnd_timedwait(&manager->drained, &manager->lock, &deadline) == thrd_timedout)
+		{
+			ret = -1;
+			break;
+		}
+	}
+
+	mtx_unlock(&manager->lock);
+	return ret;
+}
+
+void osm_conn_end(OSMConnManager *manager)
+{
+	if (manager->listener != NULL)
+		osm_loop_del(manager->loop, manager->listener);
+	if (manager->retry != NULL)
+		osm_loop_del(manager->loop, manager->retry);
+
+	manager->listener = NULL;
+	manager->retry = NULL;
+	manager->loop = NULL;
+
+	cnd_destroy(&manager->drained);
+	mtx_destroy(&manager->lock);
+	free(manager->conns);
+	manager->conns = NULL;
+}
@@ -0,0 +1,369 @@
+#include "osm/device.h"
+#include "osm/batch.h"
+#include "osm/bind.h"
+#include "osm/framer.h"
+#include "osm/trace.h"
+#include "osm/types.h"
+#include "osm/utils.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+OSMDevice osm_device_new(unsigned int conn_type, const char *address)
+{
+	OSMDevice out = {
+		.name = NULL,
+		.conn_type = conn_type,
+		.address = NULL,
+		.inputs = vect_init(sizeof(OSMDatapoint)),
+		.outputs = vect_init(sizeof(OSMDatapoint)),
+		.conn = NULL,
+		.alloc = NULL,
+	};
+
+	if (address != NULL)
+	{
+		size_t len = strlen(address) + 1;
+		out.address = malloc(len);
+		if (out.address != NULL)
+			memcpy(out.address, address, len);
+	}
+
+	return out;
+}
+
+/**
+ * Free the names of a vector of datapoints and the vector itself
+ */
+void _osm_datapoints_free(Vector *points)
+{
+	for (unsigned int i = 0; i < points->count; i++)
+	{
+		OSMDatapoint *p = vect_get(points, i);
+		free(p->name);
+	}
+
+	vect_end(points);
+}
+
+void osm_device_free(OSMDevice *dev)
+{
+	osm_device_disconnect(dev);
+
+	free(dev->name);
+	free(dev->address);
+	dev->name = NULL;
+	dev->address = NULL;
+
+	_osm_datapoints_free(&dev->inputs);
+	_osm_datapoints_free(&dev->outputs);
+}
+
+/**
+ * Open a socket to a TCP device
+ */
+int _osm_device_tcp_socket(const char *address, int type)
+{
+	// Address is host:port, with brackets around IPv6 hosts
+	char host[INET6_ADDRSTRLEN + 2], port[8];
+	const char *colon;
+	size_t hlen = strlen(address);
+
+	if (address[0] == '[')
+	{
+		// Only a colon after the closing bracket starts a port
+		const char *end = strchr(address, ']');
+		if (end == NULL || (end[1] != 0 && end[1] != ':'))
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		colon = end[1] == ':' ? end + 1 : NULL;
+	}
+	else
+	{
+		// A bare IPv6 address has colons but no port
+		colon = strchr(address, ':');
+		if (colon != NULL && strchr(colon + 1, ':') != NULL)
+			colon = NULL;
+	}
+
+	if (colon != NULL)
+	{
+		snprintf(port, sizeof(port), "%s", colon + 1);
+		hlen = colon - address;
+	}
+	else
+	{
+		snprintf(port, sizeof(port), "%d", OSM_NETWORK_PORT);
+	}
+
+	if (hlen >= 2 && address[0] == '[' && address[hlen - 1] == ']')
+	{
+		address++;
+		hlen -= 2;
+	}
+	if (hlen >= sizeof(host))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host, address, hlen);
+	host[hlen] = 0;
+
+	// Numeric only, name resolution would block
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = socket(res->ai_family, type, 0);
+	if (fd != -1 && (osm_tune_network(fd) != 0 ||
+		(connect(fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS)))
+	{
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+int osm_device_socket(OSMDevice *dev, bool nonblock)
+{
+	int flags = SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0);
+
+	if (dev->address == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (dev->conn_type == OSM_CT_TCP)
+		return _osm_device_tcp_socket(dev->address, SOCK_STREAM | flags);
+
+	if (dev->conn_type != OSM_CT_FILE)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct sockaddr_un name;
+	memset(&name, 0, sizeof(name));
+	name.sun_family = AF_LOCAL;
+
+	if (strlen(dev->address) >= sizeof(name.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(name.sun_path, dev->address);
+
+	int fd = socket(AF_LOCAL, SOCK_SEQPACKET | flags, 0);
+	if (fd == -1)
+		return -1;
+
+	// Unix sockets connect immediately or not at all (EAGAIN if the backlog is full)
+	if (connect(fd, (struct sockaddr *) &name, sizeof(name)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int osm_device_connect(OSMDevice *dev, unsigned int depth)
+{
+	if (dev->conn != NULL)
+		return 0;
+
+	int fd = osm_device_socket(dev, false);
+	if (fd == -1)
+		return -1;
+
+	return osm_device_connect_fd(dev, fd, depth);
+}
+
+int osm_device_connect_fd(OSMDevice *dev, int fd, unsigned int depth)
+{
+	if (dev->conn != NULL)
+	{
+		close(fd);
+		errno = EISCONN;
+		return -1;
+	}
+
+	if (depth == 0)
+		depth = OSM_DEVICE_DEFAULT_DEPTH;
+
+	OSMDeviceConn *conn = osm_alloc(dev->alloc, sizeof(OSMDeviceConn));
+	if (conn == NULL)
+	{
+		close(fd);
+		return -1;
+	}
+	memset(conn, 0, sizeof(OSMDeviceConn));
+	conn->alloc = dev->alloc;
+	conn->fd = fd;
+
+	// Don't wait forever on a device which stopped answering
+	struct timeval timeout = {
+		.tv_sec = OSM_DEVICE_TIMEOUT_MS / 1000,
+		.tv_usec = (OSM_DEVICE_TIMEOUT_MS % 1000) * 1000,
+	};
+	setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	conn->stream = dev->conn_type == OSM_CT_TCP;
+	conn->depth = depth;
+	conn->inflight = osm_alloc(conn->alloc, depth * sizeof(OSMBatchPart));
+	if (conn->inflight != NULL)
+		memset(conn->inflight, 0, depth * sizeof(OSMBatchPart));
+	conn->out = osm_alloc(conn->alloc, OSM_WIRE_FRAME_HEADER + OSM_WIRE_SUB_MAX + OSM_BATCH_FRAME_MAX * OSM_WIRE_CONTROL);
+
+	int ret = 0;
+	if (conn->stream)
+		ret = osm_framer_init(&conn->framer, 0);
+	else if ((conn->in = osm_alloc(conn->alloc, OSM_WIRE_FRAME_MAX)) == NULL)
+		ret = -1;
+
+	dev->conn = conn;
+	if (ret != 0 || conn->inflight == NULL || conn->out == NULL)
+	{
+		osm_device_disconnect(dev);
+		return -1;
+	}
+
+	osm_metric_add(OSM_M_CONNECTS, 1);
+
+	return 0;
+}
+
+void osm_device_disconnect(OSMDevice *dev)
+{
+	OSMDeviceConn *conn = dev->conn;
+	if (conn == NULL)
+		return;
+
+	// Fail whatever is still waiting for a reply
+	if (conn->inflight != NULL)
+		osm_batch_fail_all(conn, ECONNRESET);
+
+	if (conn->fd != -1)
+		close(conn->fd);
+	if (conn->stream)
+		osm_framer_end(&conn->framer);
+
+	osm_free(conn->alloc, conn->in);
+	osm_free(conn->alloc, conn->out);
+	osm_free(conn->alloc, conn->inflight);
+	osm_free(conn->alloc, conn);
+	dev->conn = NULL;
+}
+
+int osm_datapoint_encode(const OSMDatapoint *dat, const void *value, uint64_t *raw)
+{
+	switch (dat->type)
+	{
+		case OSM_TYPE_BOOL:
+			*raw = *(const OSMBool *) value ? 1 : 0;
+			return 0;
+		case OSM_TYPE_INT:
+			*raw = (uint64_t) *(const OSMInteger *) value;
+			return 0;
+		case OSM_TYPE_FLOAT:
+			*raw = *(const OSMFloat *) value;
+			return 0;
+	}
+
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int osm_datapoint_decode(const OSMDatapoint *dat, uint64_t raw, void *value)
+{
+	switch (dat->type)
+	{
+		case OSM_TYPE_BOOL:
+			*(OSMBool *) value = raw ? OSMTrue : OSMFalse;
+			return 0;
+		case OSM_TYPE_INT:
+			*(OSMInteger *) value = (OSMInteger) raw;
+			return 0;
+		case OSM_TYPE_FLOAT:
+			*(OSMFloat *) value = raw;
+			return 0;
+	}
+
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/**
+ * Read a datapoint, between the read tracepoints
+ */
+int _osm_read_datapoint(OSMDevice *dev, OSMDatapoint *dat, void *in)
+{
+	// Check the type can be read before talking to the device
+	uint64_t raw;
+	if (osm_datapoint_decode(dat, 0, &raw) != 0)
+		return -1;
+
+	if (osm_device_connect(dev, 0) != 0)
+		return -1;
+
+	OSMBatchItem item = {
+		.id = dat->id,
+	};
+	OSMBatch batch = osm_batch(OSM_FT_GET, &item, 1);
+	if (osm_batch_run(dev, &batch) != 0)
+		return -1;
+
+	return osm_datapoint_decode(dat, item.value, in);
+}
+
+int osm_read_datapoint(OSMDevice *dev, OSMDatapoint *dat, void *in)
+{
+	OSM_TRACE2(read_start, dev, dat->id);
+	int ret = _osm_read_datapoint(dev, dat, in);
+	OSM_TRACE3(read_done, dev, dat->id, ret);
+	return ret;
+}
+
+/**
+ * Write a datapoint, between the write tracepoints
+ */
+int _osm_write_datapoint(OSMDevice *dev, OSMDatapoint *dat, void *out)
+{
+	OSMBatchItem item = {
+		.id = dat->id,
+	};
+	if (osm_datapoint_encode(dat, out, &item.value) != 0)
+		return -1;
+
+	if (osm_device_connect(dev, 0) != 0)
+		return -1;
+
+	OSMBatch batch = osm_batch(OSM_FT_SET, &item, 1);
+	return osm_batch_run(dev, &batch);
+}
+
+int osm_write_datapoint(OSMDevice *dev, OSMDatapoint *dat, void *out)
+{
+	OSM_TRACE2(write_start, dev, dat->id);
+	int ret = _osm_write_datapoint(dev, dat, out);
+	OSM_TRACE3(write_done, dev, dat->id, ret);
+	return ret;
+}
@@ -1,13 +1,75 @@
+#include "osm/discover.h"
+#include "osm/device.h"
 #include "osm/utils.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <dirent.h>
 #include <stddef.h>
 #include <errno.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+/**
+ * Join a directory and file name into a new string
+ */
+char *_osm_join_path(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir);
+	size_t nlen = strlen(name);
+	bool slash = dlen > 0 && dir[dlen - 1] == '/';
+
+	char *out = malloc(dlen + !slash + nlen + 1);
+	if (out == NULL)
+		return NULL;
+
+	memcpy(out, dir, dlen);
+	if (!slash)
+		out[dlen++] = '/';
+	memcpy(out + dlen, name, nlen + 1);
+
+	return out;
+}
+
+/**
+ * Add a device for a socket in the directory, if it is one
+ */
+bool _osm_discover_add(Vector *out, const char *dir, const char *name, unsigned char type)
+{
+	char *path = _osm_join_path(dir, name);
+	if (path == NULL)
+		return false;
+
+	// Some filesystems don't fill in d_type
+	if (type == DT_UNKNOWN)
+	{
+		struct stat st;
+		if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+			type = DT_SOCK;
+	}
+
+	bool added = false;
+	if (type == DT_SOCK)
+	{
+		OSMDevice dev = osm_device_new(OSM_CT_FILE, path);
+		added = vect_push(out, &dev);
+		if (!added)
+			osm_device_free(&dev);
+	}
+
+	free(path);
+	return added;
+}
 
 Vector osm_discover_onboard(char *sock_dir)
 {
-	Vector out = vect_init(sizeof(char));
+	Vector out = vect_init(sizeof(OSMDevice));
+
+	if (sock_dir == NULL)
+		sock_dir = OSM_ONBOARD_DIR;
 
 	DIR *d = opendir(sock_dir);
 	if (d)
@@ -15,9 +77,7 @@ Vector osm_discover_onboard(char *sock_dir)
 		struct dirent *dir;
 		while((dir = readdir(d)) != NULL)
 		{
-			if (dir->d_type == DT_SOCK)
-			{
-			}
+			_osm_discover_add(&out, sock_dir, dir->d_name, dir->d_type);
 		}
 		errno = 0;
 		closedir(d);
@@ -30,4 +90,103 @@ Vector osm_discover_onboard(char *sock_dir)
 	return out;
 }
 
+int osm_discover_watch(OSMDiscoverWatch *watch, char *sock_dir)
+{
+	if (sock_dir == NULL)
+		sock_dir = OSM_ONBOARD_DIR;
+
+	watch->dir = malloc(strlen(sock_dir) + 1);
+	if (watch->dir == NULL)
+		return -1;
+	strcpy(watch->dir, sock_dir);
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd == -1)
+	{
+		free(watch->dir);
+		return -1;
+	}
+
+	// Sockets appear when bound and vanish when unlinked
+	watch->wd = inotify_add_watch(watch->fd, sock_dir,
+		IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM |
+		IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	if (watch->wd == -1)
+	{
+		close(watch->fd);
+		free(watch->dir);
+		return -1;
+	}
 
+	return 0;
+}
+
+int osm_discover_watch_fd(OSMDiscoverWatch *watch)
+{
+	return watch->fd;
+}
+
+int osm_discover_watch_read(OSMDiscoverWatch *watch, Vector *added, Vector *removed)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changes = 0;
+	bool rescan = false;
+
+	while (1)
+	{
+		ssize_t len = read(watch->fd, buf, sizeof(buf));
+		if (len == -1)
+		{
+			if (errno == EAGAIN)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (char *p = buf; p < buf + len; )
+		{
+			struct inotify_event *ev = (struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			// Events were dropped, or the directory itself is gone and
+			// the watch with it
+			if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+			{
+				if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+					watch->wd = -1;
+				rescan = true;
+				continue;
+			}
+
+			if (ev->len == 0 || (ev->mask & IN_ISDIR))
+				continue;
+
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			{
+				if (_osm_discover_add(added, watch->dir, ev->name, DT_UNKNOWN))
+					changes++;
+			}
+			else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			{
+				// The file is gone, so there's no telling if it was a socket
+				char *path = _osm_join_path(watch->dir, ev->name);
+				if (path != NULL && vect_push(removed, &path))
+					changes++;
+				else
+					free(path);
+			}
+		}
+	}
+
+	return rescan ? OSM_DISCOVER_RESCAN : changes;
+}
+
+void osm_discover_watch_end(OSMDiscoverWatch *watch)
+{
+	close(watch->fd);
+	free(watch->dir);
+	watch->fd = -1;
+	watch->wd = -1;
+	watch->dir = NULL;
+}
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include "osm/framer.h"
+#include "osm/codec.h"
+#include "osm/metrics.h"
+#include "osm/trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Find the next place a magic number could start: an "OS" pair, or an 'O'
+ * as the very last byte
+ * return - its offset, or len if there is none
+ */
+size_t _osm_framer_find(const uint8_t *buf, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Compare 16 positions at a time against both of the first two bytes
+	const __m128i o = _mm_set1_epi8('O');
+	const __m128i s = _mm_set1_epi8('S');
+	for (; i + 17 <= len; i += 16)
+	{
+		__m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), o);
+		__m128i second = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), s);
+		int mask = _mm_movemask_epi8(_mm_and_si128(first, second));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+	while (i < len)
+	{
+		const uint8_t *p = memchr(buf + i, 'O', len - i);
+		if (p == NULL)
+			return len;
+
+		i = p - buf;
+		if (i + 1 == len || buf[i + 1] == 'S')
+			return i;
+		i++;
+	}
+
+	return len;
+}
+
+int osm_framer_init(OSMFramer *framer, size_t size)
+{
+	memset(framer, 0, sizeof(*framer));
+
+	if (size == 0)
+		size = OSM_FRAMER_DEFAULT_SIZE;
+
+	size_t min = sysconf(_SC_PAGESIZE);
+	if (min < OSM_WIRE_FRAME_MAX)
+		min = OSM_WIRE_FRAME_MAX;
+	if (size < min)
+		size = min;
+
+	// Power of two so positions can be masked
+	size_t ring = 1;
+	while (ring < size)
+		ring <<= 1;
+
+	int memfd = memfd_create("osm-framer", MFD_CLOEXEC);
+	if (memfd == -1)
+		return -1;
+
+	if (ftruncate(memfd, ring) != 0)
+	{
+		close(memfd);
+		return -1;
+	}
+
+	// Reserve room for both mappings, then map the memfd into each half
+	uint8_t *base = mmap(NULL, ring * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+	{
+		close(memfd);
+		return -1;
+	}
+
+	if (mmap(base, ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED ||
+		mmap(base + ring, ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, 0) == MAP_FAILED)
+	{
+		munmap(base, ring * 2);
+		close(memfd);
+		return -1;
+	}
+
+	// The mappings keep the memory alive
+	close(memfd);
+
+	framer->buf = base;
+	framer->size = ring;
+	return 0;
+}
+
+uint8_t *osm_framer_space(OSMFramer *framer, size_t *len)
+{
+	framer->keep = framer->tail;
+	*len = framer->size - (framer->head - framer->keep);
+	return framer->buf + (framer->head & (framer->size - 1));
+}
+
+void osm_framer_produce(OSMFramer *framer, size_t len)
+{
+	framer->head += len;
+	osm_metric_add(OSM_M_BYTES_IN, len);
+}
+
+ssize_t osm_framer_read(OSMFramer *framer, int fd)
+{
+	size_t len;
+	uint8_t *space = osm_framer_space(framer, &len);
+
+	// The ring always fits a whole frame, so it is only full if the caller
+	// stopped taking frames
+	if (len == 0)
+	{
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	ssize_t ret;
+	do
+	{
+		ret = recv(fd, space, len, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret > 0)
+		osm_framer_produce(framer, ret);
+	return ret;
+}
+
+int osm_framer_next(OSMFramer *framer, const uint8_t **frame, size_t *len)
+{
+	while (framer->tail != framer->head)
+	{
+		size_t avail = framer->head - framer->tail;
+		const uint8_t *p = framer->buf + (framer->tail & (framer->size - 1));
+
+		ssize_t frame_len = osm_frame_len(p, avail);
+
+		// Init frames are sent before a session exists and never carry a trailer
+		if (frame_len > 0 && memcmp(p, OSM_MAGIC_FRAME, 4) == 0)
+			frame_len += framer->trailer;
+
+		if (frame_len == 0 || (frame_len > 0 && (size_t) frame_len > avail))
+			return 0;
+
+		if (frame_len > 0)
+		{
+			*frame = p;
+			*len = frame_len;
+			framer->tail += frame_len;
+			osm_metric_add(OSM_M_FRAMES_IN, 1);
+			OSM_TRACE2(frame_recv, -1, frame_len);
+			return 1;
+		}
+
+		// Not a frame, skip to the next possible magic number
+		size_t skip = 1 + _osm_framer_find(p + 1, avail - 1);
+		framer->tail += skip;
+		framer->skipped += skip;
+		osm_metric_add(OSM_M_FRAME_ERRORS, 1);
+	}
+
+	return 0;
+}
+
+void osm_framer_reset(OSMFramer *framer)
+{
+	framer->head = 0;
+	framer->tail = 0;
+	framer->keep = 0;
+}
+
+void osm_framer_end(OSMFramer *framer)
+{
+	if (framer->buf != NULL)
+		munmap(framer->buf, framer->size * 2);
+	framer->buf = NULL;
+}
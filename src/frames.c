@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+
+#include "osm/frames.h"
+#include "osm/codec.h"
+#include "osm/metrics.h"
+#include "osm/trace.h"
+#include "osm/protocol.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+size_t osm_sub_header_len(uint8_t frame_type)
+{
+	ssize_t len = osm_wire_sub_len(frame_type);
+	return len > 0 ? len : 0;
+}
+
+OSMFrameOut osm_frame_out(OSMFrameHeader *header, const void *sub_header, void *payload, size_t payload_len)
+{
+	OSMFrameOut out = {
+		.header = header,
+		.payload = payload,
+		.payload_len = payload ? payload_len : 0,
+	};
+
+	ssize_t sub_len = osm_sub_encode(out.sub, header->frame_type, sub_header);
+	out.sub_len = sub_len > 0 ? sub_len : 0;
+	return out;
+}
+
+int osm_send_frames(int fd, OSMFrameOut *frames, unsigned int count, int flags)
+{
+	struct mmsghdr msgs[OSM_FRAME_BATCH];
+	struct iovec iov[OSM_FRAME_BATCH * 4];
+	unsigned int sent = 0;
+
+	while (sent < count)
+	{
+		unsigned int n = count - sent;
+		if (n > OSM_FRAME_BATCH)
+			n = OSM_FRAME_BATCH;
+
+		memset(msgs, 0, sizeof(struct mmsghdr) * n);
+
+		// Gather each frame from up to four pieces
+		for (unsigned int i = 0; i < n; i++)
+		{
+			OSMFrameOut *f = &frames[sent + i];
+			struct iovec *v = &iov[i * 4];
+			unsigned int parts = 0;
+
+			v[parts].iov_base = f->header;
+			v[parts].iov_len = sizeof(OSMFrameHeader);
+			parts++;
+
+			if (f->sub_len > 0)
+			{
+				v[parts].iov_base = f->sub;
+				v[parts].iov_len = f->sub_len;
+				parts++;
+			}
+
+			if (f->payload != NULL && f->payload_len > 0)
+			{
+				v[parts].iov_base = f->payload;
+				v[parts].iov_len = f->payload_len;
+				parts++;
+			}
+
+			if (f->tag != NULL && f->tag_len > 0)
+			{
+				v[parts].iov_base = (void *) f->tag;
+				v[parts].iov_len = f->tag_len;
+				parts++;
+			}
+
+			msgs[i].msg_hdr.msg_iov = v;
+			msgs[i].msg_hdr.msg_iovlen = parts;
+		}
+
+		int ret = sendmmsg(fd, msgs, n, flags | MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return sent > 0 ? (int) sent : -1;
+		}
+
+		size_t bytes = 0;
+		for (int i = 0; i < ret; i++)
+		{
+			bytes += msgs[i].msg_len;
+			OSM_TRACE3(frame_send, fd, frames[sent + i].header->frame_type, msgs[i].msg_len);
+		}
+		osm_metric_add(OSM_M_FRAMES_OUT, ret);
+		osm_metric_add(OSM_M_BYTES_OUT, bytes);
+
+		sent += ret;
+
+		// The socket buffer is full
+		if ((unsigned int) ret < n)
+			break;
+	}
+
+	return sent;
+}
+
+int osm_recv_frames(int fd, OSMFrameIn *frames, unsigned int count, int flags)
+{
+	struct mmsghdr msgs[OSM_FRAME_BATCH];
+	struct iovec iov[OSM_FRAME_BATCH];
+
+	if (count > OSM_FRAME_BATCH)
+		count = OSM_FRAME_BATCH;
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		iov[i].iov_base = frames[i].buf;
+		iov[i].iov_len = frames[i].size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int ret;
+	do
+	{
+		ret = recvmmsg(fd, msgs, count, flags | MSG_WAITFORONE, NULL);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret <= 0)
+		return ret;
+
+	size_t bytes = 0;
+	unsigned int truncated = 0;
+	for (int i = 0; i < ret; i++)
+	{
+		frames[i].len = msgs[i].msg_len;
+		frames[i].truncated = msgs[i].msg_hdr.msg_flags & MSG_TRUNC;
+		bytes += frames[i].len;
+		truncated += frames[i].truncated;
+		OSM_TRACE2(frame_recv, fd, frames[i].len);
+	}
+	osm_metric_add(OSM_M_FRAMES_IN, ret);
+	osm_metric_add(OSM_M_BYTES_IN, bytes);
+	osm_metric_add(OSM_M_FRAME_ERRORS, truncated);
+
+	// A zero length message is the end of the connection
+	if (frames[0].len == 0)
+		return 0;
+
+	for (int i = 1; i < ret; i++)
+	{
+		if (frames[i].len == 0)
+			return i;
+	}
+
+	return ret;
+}
@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+
+#include "osm/loop.h"
+#include "osm/metrics.h"
+#include "osm/trace.h"
+#include "osm/utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#define LOOP_MAX_EVENTS 64
+
+/// Tasks which can be posted before they overflow into a locked queue
+#define LOOP_POSTED 1024
+
+/// Tasks popped from the ring at once
+#define LOOP_POSTED_BATCH 64
+
+/// How long a listener pauses after running out of fds or memory
+#define LOOP_ACCEPT_RETRY_MS 10
+
+/// A function posted from another thread
+typedef struct {
+	OSMLoopTask task;
+	void *data;
+} _OSMLoopPosted;
+
+/**
+ * Translate OSM_LOOP_* flags into epoll flags
+ */
+uint32_t _osm_loop_epoll_events(unsigned int events)
+{
+	uint32_t out = 0;
+	if (events & OSM_LOOP_READ)
+		out |= EPOLLIN | EPOLLRDHUP;
+	if (events & OSM_LOOP_WRITE)
+		out |= EPOLLOUT;
+	return out;
+}
+
+int osm_loop_init(OSMLoop *loop)
+{
+	loop->running = false;
+	loop->handles = NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1)
+		return -1;
+
+	// The ring is aligned to cache lines, which the loop itself may not be
+	loop->posted = aligned_alloc(alignof(OSMMpscRing), sizeof(OSMMpscRing));
+	if (loop->posted == NULL)
+	{
+		close(loop->epfd);
+		return -1;
+	}
+
+	if (osm_mpsc_init(loop->posted, sizeof(_OSMLoopPosted), LOOP_POSTED) != 0)
+	{
+		free(loop->posted);
+		close(loop->epfd);
+		return -1;
+	}
+
+	// the ring's wake fd is the only registration without a handle
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, osm_mpsc_fd(loop->posted), &ev) == -1
+		|| mtx_init(&loop->lock, mtx_plain) != thrd_success)
+	{
+		osm_mpsc_end(loop->posted);
+		free(loop->posted);
+		close(loop->epfd);
+		return -1;
+	}
+
+	loop->closed = vect_init(sizeof(OSMLoopHandle *));
+	loop->overflow = vect_init(sizeof(_OSMLoopPosted));
+	atomic_init(&loop->overflowing, false);
+
+	return 0;
+}
+
+/**
+ * Run everything which has been posted to the loop
+ */
+void _osm_loop_run_posted(OSMLoop *loop)
+{
+	osm_mpsc_ack(loop->posted);
+
+	// Only what was there to begin with, tasks posted by these tasks run
+	// in the next iteration
+	unsigned int left;
+	bool overflowed = atomic_load_explicit(&loop->overflowing, memory_order_acquire);
+	Vector tasks;
+	if (overflowed)
+	{
+		// Swap the overflow out and let posts use the ring again.  Every task
+		// in the overflow was posted after the ones its thread left in the
+		// ring, which are all counted here, and later posts are not.
+		mtx_lock(&loop->lock);
+		left = osm_mpsc_count(loop->posted);
+		tasks = loop->overflow;
+		loop->overflow = vect_init(sizeof(_OSMLoopPosted));
+		atomic_store_explicit(&loop->overflowing, false, memory_order_release);
+		mtx_unlock(&loop->lock);
+	}
+	else
+	{
+		left = osm_mpsc_count(loop->posted);
+	}
+
+	_OSMLoopPosted batch[LOOP_POSTED_BATCH];
+	while (left > 0)
+	{
+		unsigned int n = osm_mpsc_pop_n(loop->posted, batch,
+			left < LOOP_POSTED_BATCH ? left : LOOP_POSTED_BATCH);
+		if (n == 0)
+		{
+			if (!overflowed)
+				break;
+
+			// The overflow must wait for a producer which has claimed a
+			// slot but not yet filled it
+			thrd_yield();
+			continue;
+		}
+
+		for (unsigned int i = 0; i < n; i++)
+			batch[i].task(loop, batch[i].data);
+		left -= n;
+	}
+
+	if (!overflowed)
+		return;
+
+	for (unsigned int i = 0; i < tasks.count; i++)
+	{
+		_OSMLoopPosted *p = vect_get(&tasks, i);
+		p->task(loop, p->data);
+	}
+
+	vect_end(&tasks);
+}
+
+/**
+ * Free the handles removed during the last iteration
+ */
+void _osm_loop_collect(OSMLoop *loop)
+{
+	for (unsigned int i = 0; i < loop->closed.count; i++)
+	{
+		OSMLoopHandle **h = vect_get(&loop->closed, i);
+		free(*h);
+	}
+
+	if (loop->closed.count > 0)
+		vect_clear(&loop->closed);
+}
+
+/**
+ * Call the handle's callbacks for the given epoll events
+ */
+void _osm_loop_dispatch(OSMLoop *loop, OSMLoopHandle *h, uint32_t events)
+{
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	{
+		if (h->timer)
+		{
+			uint64_t expirations;
+			if (read(h->fd, &expirations, sizeof(expirations)) < 0)
+				return;
+		}
+
+		if (h->on_read)
+			h->on_read(loop, h, h->data);
+	}
+
+	// Removed by its own read callback
+	if (h->closed)
+		return;
+
+	if ((events & EPOLLOUT) && h->on_write)
+		h->on_write(loop, h, h->data);
+}
+
+int osm_loop_run(OSMLoop *loop)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	loop->running = true;
+
+	while (loop->running)
+	{
+		// Posting only wakes the loop through the ring's fd while it is
+		// armed, if tasks are waiting just poll what else is ready
+		bool posted = !osm_mpsc_arm(loop->posted);
+
+		int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, posted ? 0 : -1);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			loop->running = false;
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			OSMLoopHandle *h = events[i].data.ptr;
+
+			if (h == NULL)
+				posted = true;
+			else if (!h->closed)
+				_osm_loop_dispatch(loop, h, events[i].events);
+		}
+
+		if (posted)
+			_osm_loop_run_posted(loop);
+
+		_osm_loop_collect(loop);
+	}
+
+	return 0;
+}
+
+/**
+ * Posted by osm_loop_stop
+ */
+void _osm_loop_stop_task(OSMLoop *loop, void *data)
+{
+	loop->running = false;
+}
+
+void osm_loop_stop(OSMLoop *loop)
+{
+	osm_loop_post(loop, _osm_loop_stop_task, NULL);
+}
+
+int osm_loop_post(OSMLoop *loop, OSMLoopTask task, void *data)
+{
+	_OSMLoopPosted p = {
+		.task = task,
+		.data = data,
+	};
+
+	// Once a post has overflowed, later ones follow it so a thread's
+	// tasks still run in order
+	if (!atomic_load_explicit(&loop->overflowing, memory_order_acquire)
+		&& osm_mpsc_push(loop->posted, &p))
+		return 0;
+
+	mtx_lock(&loop->lock);
+	atomic_store_explicit(&loop->overflowing, true, memory_order_relaxed);
+	bool ok = vect_push(&loop->overflow, &p);
+	mtx_unlock(&loop->lock);
+
+	if (!ok)
+		return -1;
+
+	// Rare enough to wake the loop whether it is armed or not
+	uint64_t one = 1;
+	if (write(osm_mpsc_fd(loop->posted), &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+
+	return 0;
+}
+
+void osm_loop_end(OSMLoop *loop)
+{
+	OSMLoopHandle *h = loop->handles;
+	while (h != NULL)
+	{
+		OSMLoopHandle *next = h->next;
+		if (h->timer)
+			close(h->fd);
+		free(h);
+		h = next;
+	}
+	loop->handles = NULL;
+
+	_osm_loop_collect(loop);
+	vect_end(&loop->closed);
+	vect_end(&loop->overflow);
+	mtx_destroy(&loop->lock);
+
+	osm_mpsc_end(loop->posted);
+	free(loop->posted);
+	close(loop->epfd);
+}
+
+OSMLoopHandle *osm_loop_add(OSMLoop *loop, int fd, unsigned int events,
+	OSMLoopCallback on_read, OSMLoopCallback on_write, void *data)
+{
+	OSMLoopHandle *h = calloc(1, sizeof(OSMLoopHandle));
+	if (h == NULL)
+		return NULL;
+
+	h->fd = fd;
+	h->events = events;
+	h->on_read = on_read;
+	h->on_write = on_write;
+	h->data = data;
+
+	struct epoll_event ev = {
+		.events = _osm_loop_epoll_events(events),
+		.data.ptr = h,
+	};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		free(h);
+		return NULL;
+	}
+
+	// Link into the handle list
+	h->next = loop->handles;
+	if (loop->handles != NULL)
+		loop->handles->prev = h;
+	loop->handles = h;
+
+	return h;
+}
+
+int osm_loop_mod(OSMLoop *loop, OSMLoopHandle *handle, unsigned int events)
+{
+	if (handle->closed)
+		return -1;
+
+	if (handle->events == events)
+		return 0;
+
+	struct epoll_event ev = {
+		.events = _osm_loop_epoll_events(events),
+		.data.ptr = handle,
+	};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, handle->fd, &ev) == -1)
+		return -1;
+
+	handle->events = events;
+	return 0;
+}
+
+void osm_loop_del(OSMLoop *loop, OSMLoopHandle *handle)
+{
+	if (handle->closed)
+		return;
+
+	handle->closed = true;
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handle->fd, NULL);
+
+	if (handle->timer)
+		close(handle->fd);
+	if (handle->retry != NULL)
+		osm_loop_del(loop, handle->retry);
+
+	// Unlink from the handle list
+	if (handle->prev != NULL)
+		handle->prev->next = handle->next;
+	else
+		loop->handles = handle->next;
+	if (handle->next != NULL)
+		handle->next->prev = handle->prev;
+
+	// Events for this handle may still be pending in this iteration
+	if (!vect_push(&loop->closed, &handle))
+		fprintf(stderr, "libopensmarts: unable to queue closed loop handle\n");
+}
+
+/**
+ * Arm a timerfd to expire after ms milliseconds
+ */
+int _osm_loop_timer_set(int fd, unsigned int ms, bool repeat)
+{
+	struct itimerspec spec = {0};
+	spec.it_value.tv_sec = ms / 1000;
+	spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+
+	// A zero timer would never fire
+	if (ms == 0)
+		spec.it_value.tv_nsec = 1;
+
+	if (repeat)
+		spec.it_interval = spec.it_value;
+
+	return timerfd_settime(fd, 0, &spec, NULL);
+}
+
+OSMLoopHandle *osm_loop_timer(OSMLoop *loop, unsigned int ms, bool repeat,
+	OSMLoopCallback callback, void *data)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd == -1)
+		return NULL;
+
+	if (_osm_loop_timer_set(fd, ms, repeat) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	OSMLoopHandle *h = osm_loop_add(loop, fd, OSM_LOOP_READ, callback, NULL, data);
+	if (h == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	h->timer = true;
+	return h;
+}
+
+int osm_loop_timer_set(OSMLoop *loop, OSMLoopHandle *timer, unsigned int ms, bool repeat)
+{
+	if (!timer->timer || timer->closed)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	return _osm_loop_timer_set(timer->fd, ms, repeat);
+}
+
+int osm_loop_timer_cancel(OSMLoop *loop, OSMLoopHandle *timer)
+{
+	if (!timer->timer || timer->closed)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct itimerspec spec = {0};
+	return timerfd_settime(timer->fd, 0, &spec, NULL);
+}
+
+/**
+ * Read callback for listening sockets
+ */
+void _osm_loop_accept(OSMLoop *loop, OSMLoopHandle *h, void *data)
+{
+	while (!h->closed)
+	{
+		errno = 0;
+		int fd = accept4(h->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+
+			// Out of fds or memory, stop polling the socket until the
+			// retry timer fires instead of spinning on it
+			if ((errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+				&& osm_loop_mod(loop, h, 0) == 0
+				&& _osm_loop_timer_set(h->retry->fd, LOOP_ACCEPT_RETRY_MS, false) == 0)
+			{
+				osm_metric_add(OSM_M_ACCEPT_ERRORS, 1);
+				return;
+			}
+
+			// Unrecoverable, give up on the socket
+			int err = errno;
+			osm_loop_del(loop, h);
+			osm_metric_add(OSM_M_ACCEPT_ERRORS, 1);
+			errno = err;
+			h->on_accept(loop, -1, data);
+			return;
+		}
+
+		osm_metric_add(OSM_M_ACCEPTS, 1);
+		OSM_TRACE1(accept, fd);
+		h->on_accept(loop, fd, data);
+	}
+}
+
+/**
+ * Read callback for a listener's retry timer, resumes accepting
+ */
+void _osm_loop_accept_retry(OSMLoop *loop, OSMLoopHandle *h, void *data)
+{
+	OSMLoopHandle *listener = data;
+	if (osm_loop_mod(loop, listener, OSM_LOOP_READ) == -1)
+	{
+		int err = errno;
+		osm_loop_del(loop, listener);
+		errno = err;
+		listener->on_accept(loop, -1, listener->data);
+	}
+}
+
+OSMLoopHandle *osm_loop_listen(OSMLoop *loop, int sockfd, OSMAcceptCallback callback, void *data)
+{
+	int flags = fcntl(sockfd, F_GETFL);
+	if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return NULL;
+
+	// Created up front, as there may be no fds left once it is needed
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd == -1)
+		return NULL;
+
+	OSMLoopHandle *h = osm_loop_add(loop, sockfd, OSM_LOOP_READ, _osm_loop_accept, NULL, data);
+	if (h == NULL)
+	{
+		close(tfd);
+		return NULL;
+	}
+
+	h->on_accept = callback;
+	h->retry = osm_loop_add(loop, tfd, OSM_LOOP_READ, _osm_loop_accept_retry, NULL, h);
+	if (h->retry == NULL)
+	{
+		close(tfd);
+		osm_loop_del(loop, h);
+		return NULL;
+	}
+
+	h->retry->timer = true;
+	return h;
+}
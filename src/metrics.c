@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+
+#include "osm/metrics.h"
+#include "osm/bind.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+thread_local OSMMetricsShard *osm_metrics_local __attribute__((tls_model("initial-exec"))) = NULL;
+
+/// Every shard ever allocated, only ever pushed to
+_Atomic(OSMMetricsShard *) _osm_metrics_shards = NULL;
+
+/// Releases the shard of a thread when it exits
+tss_t _osm_metrics_key;
+bool _osm_metrics_key_ok = false;
+once_flag _osm_metrics_once = ONCE_FLAG_INIT;
+
+const char *const _osm_metric_names[OSM_METRIC_COUNT] = {
+	[OSM_M_ACCEPTS] = "accepts",
+	[OSM_M_ACCEPT_ERRORS] = "accept_errors",
+	[OSM_M_CONNECTS] = "connects",
+	[OSM_M_FRAMES_IN] = "frames_in",
+	[OSM_M_FRAMES_OUT] = "frames_out",
+	[OSM_M_BYTES_IN] = "bytes_in",
+	[OSM_M_BYTES_OUT] = "bytes_out",
+	[OSM_M_FRAME_ERRORS] = "frame_errors",
+	[OSM_M_DEVICE_CALLS] = "device_calls",
+	[OSM_M_DEVICE_ERRORS] = "device_errors",
+	[OSM_M_DEVICE_INFLIGHT] = "device_inflight",
+};
+
+const char *const _osm_hist_names[OSM_HIST_COUNT] = {
+	[OSM_H_DEVICE_CALL] = "device_call_ns",
+};
+
+/**
+ * Thread exit: leave the counts, but let another thread take the shard
+ */
+void _osm_metrics_release(void *data)
+{
+	OSMMetricsShard *shard = data;
+	atomic_store_explicit(&shard->free, true, memory_order_release);
+}
+
+void _osm_metrics_init(void)
+{
+	_osm_metrics_key_ok = tss_create(&_osm_metrics_key, _osm_metrics_release) == thrd_success;
+}
+
+OSMMetricsShard *osm_metrics_attach(void)
+{
+	if (osm_metrics_local != NULL)
+		return osm_metrics_local;
+
+	call_once(&_osm_metrics_once, _osm_metrics_init);
+
+	// Take over the shard of a thread which has exited
+	OSMMetricsShard *shard = atomic_load_explicit(&_osm_metrics_shards, memory_order_acquire);
+	for (; shard != NULL; shard = shard->next)
+	{
+		bool expected = true;
+		if (atomic_compare_exchange_strong(&shard->free, &expected, false))
+			break;
+	}
+
+	if (shard == NULL)
+	{
+		shard = aligned_alloc(alignof(OSMMetricsShard), sizeof(OSMMetricsShard));
+		if (shard == NULL)
+			return NULL;
+		memset(shard, 0, sizeof(OSMMetricsShard));
+		atomic_init(&shard->free, false);
+
+		shard->next = atomic_load_explicit(&_osm_metrics_shards, memory_order_relaxed);
+		while (!atomic_compare_exchange_weak_explicit(&_osm_metrics_shards, &shard->next, shard,
+			memory_order_release, memory_order_relaxed));
+	}
+
+	// Without the key the shard is never released, which only costs memory
+	if (_osm_metrics_key_ok)
+		tss_set(_osm_metrics_key, shard);
+
+	osm_metrics_local = shard;
+	return shard;
+}
+
+uint64_t osm_metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void osm_hist_merge(OSMHist *hist, const OSMHist *other)
+{
+	for (unsigned int i = 0; i < OSM_HIST_BUCKETS; i++)
+		hist->counts[i] += __atomic_load_n(&other->counts[i], __ATOMIC_RELAXED);
+
+	hist->count += __atomic_load_n(&other->count, __ATOMIC_RELAXED);
+	hist->sum += __atomic_load_n(&other->sum, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&other->max, __ATOMIC_RELAXED);
+	if (max > hist->max)
+		hist->max = max;
+}
+
+uint64_t osm_hist_percentile(const OSMHist *hist, double p)
+{
+	// The total is summed from the buckets, which a concurrent writer may
+	// have updated before count
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < OSM_HIST_BUCKETS; i++)
+		total += hist->counts[i];
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = total * p / 100, seen = 0;
+	for (unsigned int i = 0; i < OSM_HIST_BUCKETS; i++)
+	{
+		seen += hist->counts[i];
+		if (seen > rank)
+			return osm_hist_value(i);
+	}
+	return hist->max;
+}
+
+void osm_metrics_snapshot(OSMMetrics *metrics)
+{
+	memset(metrics, 0, sizeof(OSMMetrics));
+
+	OSMMetricsShard *shard = atomic_load_explicit(&_osm_metrics_shards, memory_order_acquire);
+	for (; shard != NULL; shard = shard->next)
+	{
+		for (unsigned int i = 0; i < OSM_METRIC_COUNT; i++)
+			metrics->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+		for (unsigned int i = 0; i < OSM_HIST_COUNT; i++)
+			osm_hist_merge(&metrics->hists[i], &shard->hists[i]);
+		metrics->shards++;
+	}
+}
+
+const char *osm_metric_name(unsigned int metric)
+{
+	return metric < OSM_METRIC_COUNT ? _osm_metric_names[metric] : NULL;
+}
+
+const char *osm_hist_name(unsigned int hist)
+{
+	return hist < OSM_HIST_COUNT ? _osm_hist_names[hist] : NULL;
+}
+
+/**
+ * snprintf which keeps counting past the end of the buffer
+ */
+void _osm_metrics_append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+void _osm_metrics_append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int ret = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0, fmt, args);
+	va_end(args);
+
+	if (ret > 0)
+		*len += ret;
+}
+
+size_t osm_metrics_format(const OSMMetrics *metrics, char *buf, size_t size)
+{
+	size_t len = 0;
+	if (size > 0)
+		buf[0] = 0;
+
+	_osm_metrics_append(buf, size, &len, "{\"shards\":%u,\"counters\":{", metrics->shards);
+	for (unsigned int i = 0; i < OSM_METRIC_COUNT; i++)
+	{
+		// Gauges may be briefly negative while threads race
+		if (i == OSM_M_DEVICE_INFLIGHT)
+			_osm_metrics_append(buf, size, &len, "%s\"%s\":%lld", i > 0 ? "," : "",
+				_osm_metric_names[i], (long long) metrics->counters[i]);
+		else
+			_osm_metrics_append(buf, size, &len, "%s\"%s\":%llu", i > 0 ? "," : "",
+				_osm_metric_names[i], (unsigned long long) metrics->counters[i]);
+	}
+
+	_osm_metrics_append(buf, size, &len, "},\"histograms\":{");
+	for (unsigned int i = 0; i < OSM_HIST_COUNT; i++)
+	{
+		const OSMHist *hist = &metrics->hists[i];
+		_osm_metrics_append(buf, size, &len,
+			"%s\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+			i > 0 ? "," : "", _osm_hist_names[i],
+			(unsigned long long) hist->count,
+			(unsigned long long) (hist->count > 0 ? hist->sum / hist->count : 0),
+			(unsigned long long) osm_hist_percentile(hist, 50),
+			(unsigned long long) osm_hist_percentile(hist, 90),
+			(unsigned long long) osm_hist_percentile(hist, 99),
+			(unsigned long long) osm_hist_percentile(hist, 99.9),
+			(unsigned long long) hist->max);
+	}
+
+	_osm_metrics_append(buf, size, &len, "}}\n");
+	return len;
+}
+
+/**
+ * Accept callback of the stats socket: write a snapshot and hang up
+ */
+void _osm_metrics_accept(OSMLoop *loop, int fd, void *data)
+{
+	if (fd == -1)
+		return;
+
+	OSMMetrics *metrics = malloc(sizeof(OSMMetrics));
+	if (metrics != NULL)
+	{
+		osm_metrics_snapshot(metrics);
+
+		char buf[2048];
+		size_t len = osm_metrics_format(metrics, buf, sizeof(buf));
+		if (len >= sizeof(buf))
+			len = sizeof(buf) - 1;
+
+		// Far smaller than the socket buffer, so this doesn't block the loop
+		if (send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+			perror("Error sending metrics");
+		free(metrics);
+	}
+
+	close(fd);
+}
+
+int osm_metrics_serve(OSMMetricsServer *server, OSMLoop *loop, const char *path)
+{
+	if (path == NULL)
+	{
+		path = OSM_METRICS_SOCKET;
+		if (mkdir("/run/osm", 0755) != 0 && errno != EEXIST)
+			return -1;
+	}
+
+	struct sockaddr_un name = {
+		.sun_family = AF_UNIX,
+	};
+	if (strlen(path) >= sizeof(name.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(name.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	// Only replace a socket left by a server which has exited, a live
+	// server or any other file fails the bind with EADDRINUSE
+	if (osm_socket_stale(path))
+		unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &name, sizeof(name)) != 0 || listen(fd, 16) != 0)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	server->handle = osm_loop_listen(loop, fd, _osm_metrics_accept, server);
+	if (server->handle == NULL)
+	{
+		int err = errno;
+		close(fd);
+		unlink(path);
+		errno = err;
+		return -1;
+	}
+
+	server->loop = loop;
+	strcpy(server->path, path);
+	return 0;
+}
+
+void osm_metrics_server_end(OSMMetricsServer *server)
+{
+	if (server->handle == NULL)
+		return;
+
+	int fd = server->handle->fd;
+	osm_loop_del(server->loop, server->handle);
+	close(fd);
+	unlink(server->path);
+	server->handle = NULL;
+}
@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+
+#include "osm/probe.h"
+#include "osm/codec.h"
+#include "osm/device.h"
+#include "osm/protocol.h"
+#include "osm/utils.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define PROBE_CONNECTING 0
+#define PROBE_WAITING 1
+#define PROBE_DONE 2
+#define PROBE_FAILED 3
+
+/// Probe state for one device
+typedef struct {
+	int fd;
+	int state;
+	uint64_t deadline;
+	size_t len;
+	uint8_t *buf;
+} _OSMProbe;
+
+/**
+ * Milliseconds on the monotonic clock
+ */
+uint64_t _osm_probe_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Default request: a GET frame asking for no datapoints
+ */
+size_t _osm_probe_default_request(OSMDevice *dev, uint8_t *buf, size_t size, void *data)
+{
+	OSMFrameHeader header;
+	memset(&header, 0, sizeof(header));
+	header.frame_type = OSM_FT_GET;
+
+	OSMGetHeader get = {
+		.num_get = 0,
+	};
+
+	return osm_frame_encode(buf, size, &header, &get);
+}
+
+/**
+ * Default reply handler: any result frame counts as an answer
+ */
+int _osm_probe_default_reply(OSMDevice *dev, const uint8_t *buf, size_t len, void *data)
+{
+	ssize_t frame_len = osm_frame_len(buf, len);
+	if (frame_len == -1)
+		return -1;
+	if (frame_len == 0 || (size_t) frame_len > len)
+		return 0;
+
+	OSMFrameView view;
+	if (osm_frame_parse(&view, buf, len) != 0)
+		return -1;
+
+	return view.frame_type == OSM_FT_RES ? 1 : 0;
+}
+
+/**
+ * Send the request once connected
+ */
+void _osm_probe_send(OSMDevice *dev, _OSMProbe *p, const OSMProbeOptions *opt)
+{
+	size_t len = opt->request(dev, p->buf, OSM_PROBE_BUF_SIZE, opt->data);
+
+	// Requests are small enough to always fit in an empty socket buffer
+	if (len == 0 || send(p->fd, p->buf, len, MSG_NOSIGNAL) != (ssize_t) len)
+	{
+		p->state = PROBE_FAILED;
+		return;
+	}
+
+	p->state = PROBE_WAITING;
+	p->len = 0;
+}
+
+/**
+ * Read what a device has sent and pass it to the reply handler
+ */
+void _osm_probe_recv(OSMDevice *dev, _OSMProbe *p, const OSMProbeOptions *opt)
+{
+	while (p->state == PROBE_WAITING)
+	{
+		if (p->len == OSM_PROBE_BUF_SIZE)
+		{
+			p->state = PROBE_FAILED;
+			return;
+		}
+
+		ssize_t n = recv(p->fd, p->buf + p->len, OSM_PROBE_BUF_SIZE - p->len, 0);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				p->state = PROBE_FAILED;
+			return;
+		}
+		if (n == 0)
+		{
+			p->state = PROBE_FAILED;
+			return;
+		}
+
+		p->len += n;
+
+		int ret = opt->reply(dev, p->buf, p->len, opt->data);
+		if (ret > 0)
+			p->state = PROBE_DONE;
+		else if (ret < 0)
+			p->state = PROBE_FAILED;
+		else if (dev->conn_type == OSM_CT_FILE)
+			p->len = 0;   // one frame per message
+	}
+}
+
+int osm_probe_devices(Vector *devices, Vector *timed_out, const OSMProbeOptions *opt)
+{
+	OSMProbeOptions o = {0};
+	if (opt != NULL)
+		o = *opt;
+	if (o.device_ms == 0)
+		o.device_ms = OSM_PROBE_DEVICE_MS;
+	if (o.total_ms == 0)
+		o.total_ms = OSM_PROBE_TOTAL_MS;
+	if (o.request == NULL)
+		o.request = _osm_probe_default_request;
+	if (o.reply == NULL)
+		o.reply = _osm_probe_default_reply;
+
+	unsigned int count = devices->count;
+	_OSMProbe *probes = calloc(count, sizeof(_OSMProbe));
+	uint8_t *bufs = malloc((size_t) count * OSM_PROBE_BUF_SIZE + 1);
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (probes == NULL || bufs == NULL || epfd == -1)
+	{
+		free(probes);
+		free(bufs);
+		if (epfd != -1)
+			close(epfd);
+		return -1;
+	}
+
+	uint64_t start = _osm_probe_now();
+	uint64_t end = start + o.total_ms;
+	unsigned int pending = 0;
+
+	// Connect to everything at once
+	for (unsigned int i = 0; i < count; i++)
+	{
+		OSMDevice *dev = vect_get(devices, i);
+		_OSMProbe *p = &probes[i];
+
+		p->buf = bufs + (size_t) i * OSM_PROBE_BUF_SIZE;
+		p->deadline = start + o.device_ms;
+		p->state = PROBE_CONNECTING;
+		p->fd = osm_device_socket(dev, true);
+
+		if (p->fd == -1)
+		{
+			p->state = PROBE_FAILED;
+			continue;
+		}
+
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLOUT,
+			.data.u32 = i,
+		};
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev) != 0)
+		{
+			p->state = PROBE_FAILED;
+			continue;
+		}
+
+		pending++;
+	}
+
+	struct epoll_event events[64];
+	while (pending > 0)
+	{
+		// Sleep until the next event or the nearest deadline
+		uint64_t now = _osm_probe_now();
+		uint64_t next = end;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (probes[i].state < PROBE_DONE && probes[i].deadline < next)
+				next = probes[i].deadline;
+		}
+
+		int n = 0;
+		if (next > now)
+		{
+			n = epoll_wait(epfd, events, 64, next - now);
+			if (n == -1 && errno != EINTR)
+				break;
+		}
+
+		for (int e = 0; e < n; e++)
+		{
+			unsigned int i = events[e].data.u32;
+			OSMDevice *dev = vect_get(devices, i);
+			_OSMProbe *p = &probes[i];
+
+			if (p->state == PROBE_CONNECTING && (events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+					p->state = PROBE_FAILED;
+				else
+					_osm_probe_send(dev, p, &o);
+
+				if (p->state == PROBE_WAITING)
+				{
+					struct epoll_event ev = {
+						.events = EPOLLIN,
+						.data.u32 = i,
+					};
+					epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &ev);
+				}
+			}
+			else if (p->state == PROBE_WAITING && (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			{
+				_osm_probe_recv(dev, p, &o);
+			}
+
+			if (p->state >= PROBE_DONE)
+			{
+				epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+				pending--;
+			}
+		}
+
+		// Expire everything past its deadline
+		now = _osm_probe_now();
+		for (unsigned int i = 0; i < count; i++)
+		{
+			_OSMProbe *p = &probes[i];
+			if (p->state < PROBE_DONE && (now >= p->deadline || now >= end))
+			{
+				p->state = PROBE_FAILED;
+				epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+				pending--;
+			}
+		}
+	}
+
+	// Split the devices into those which answered and the rest
+	Vector answered = vect_init(sizeof(OSMDevice));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		OSMDevice *dev = vect_get(devices, i);
+		if (probes[i].fd != -1)
+			close(probes[i].fd);
+
+		if (probes[i].state == PROBE_DONE)
+			vect_push(&answered, dev);
+		else
+			vect_push(timed_out, dev);
+	}
+
+	vect_end(devices);
+	*devices = answered;
+
+	close(epfd);
+	free(bufs);
+	free(probes);
+
+	return answered.count;
+}
@@ -2,3 +2,4 @@
 
 const char OSM_MAGIC_INIT[4] = "OSmI";
 const char OSM_MAGIC_FRAME[4] = "OSmF";
+const char OSM_MAGIC_SHM[4] = "OSmS";
@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+
+#include "osm/utils.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+/*
+ * Both rings count positions with free running indices, which are masked
+ * to find a position's element, so head - tail is always the number of
+ * elements even after the indices wrap.
+ */
+
+// Wake ups
+
+int _osm_ring_notify_init(OSMRingNotify *notify)
+{
+	notify->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (notify->fd == -1)
+		return -1;
+	atomic_init(&notify->sleeping, false);
+	return 0;
+}
+
+/**
+ * Producer side: wake the consumer if it is about to sleep.  The fence
+ * pairs with the one in _osm_ring_arm, so either the consumer sees the
+ * elements just pushed or this sees it sleeping.
+ */
+void _osm_ring_notify(OSMRingNotify *notify)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&notify->sleeping, memory_order_relaxed))
+		return;
+
+	// Only one producer writes to the eventfd for each sleep
+	if (atomic_exchange_explicit(&notify->sleeping, false, memory_order_relaxed))
+	{
+		uint64_t one = 1;
+		if (write(notify->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("Error waking ring consumer");
+	}
+}
+
+/**
+ * Consumer side: announce it is going to sleep, before checking one last
+ * time whether the ring is empty
+ */
+void _osm_ring_arm(OSMRingNotify *notify)
+{
+	atomic_store_explicit(&notify->sleeping, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void _osm_ring_disarm(OSMRingNotify *notify)
+{
+	atomic_store_explicit(&notify->sleeping, false, memory_order_relaxed);
+}
+
+void _osm_ring_ack(OSMRingNotify *notify)
+{
+	uint64_t count;
+	while (read(notify->fd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+/**
+ * Sleep on an armed ring until woken
+ * return - false on timeout
+ */
+bool _osm_ring_sleep(OSMRingNotify *notify, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = notify->fd,
+		.events = POLLIN,
+	};
+
+	int ret;
+	do
+		ret = poll(&pfd, 1, timeout_ms);
+	while (ret < 0 && errno == EINTR);
+
+	_osm_ring_ack(notify);
+	_osm_ring_disarm(notify);
+	return ret > 0;
+}
+
+/**
+ * Round a capacity up to a power of two
+ * return - the size, or 0 if the capacity is invalid
+ */
+size_t _osm_ring_size(unsigned int capacity)
+{
+	if (capacity == 0 || capacity > 1u << 31)
+	{
+		errno = EINVAL;
+		return 0;
+	}
+
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	return size;
+}
+
+/**
+ * Allocate a buffer on its own cache lines
+ */
+void *_osm_ring_alloc(size_t bytes)
+{
+	bytes = (bytes + OSM_CACHE_LINE - 1) & ~(size_t) (OSM_CACHE_LINE - 1);
+	return aligned_alloc(OSM_CACHE_LINE, bytes);
+}
+
+// Single producer
+
+int osm_spsc_init(OSMSpscRing *ring, unsigned int elsz, unsigned int capacity)
+{
+	size_t size = _osm_ring_size(capacity);
+	if (size == 0)
+		return -1;
+
+	ring->buf = _osm_ring_alloc(size * elsz);
+	if (ring->buf == NULL)
+		return -1;
+
+	if (_osm_ring_notify_init(&ring->notify) != 0)
+	{
+		free(ring->buf);
+		return -1;
+	}
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->tail_cache = 0;
+	ring->head_cache = 0;
+	ring->mask = size - 1;
+	ring->elsz = elsz;
+	return 0;
+}
+
+unsigned int osm_spsc_push_n(OSMSpscRing *ring, const void *els, unsigned int n)
+{
+	size_t size = ring->mask + 1;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	// Only look at the consumer's cache line when the cached tail says the
+	// ring is too full
+	if (size - (head - ring->tail_cache) < n)
+		ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	size_t room = size - (head - ring->tail_cache);
+	if (n > room)
+		n = room;
+	if (n == 0)
+		return 0;
+
+	size_t idx = head & ring->mask;
+	size_t first = size - idx < n ? size - idx : n;
+	memcpy(ring->buf + idx * ring->elsz, els, first * ring->elsz);
+	memcpy(ring->buf, (const unsigned char *) els + first * ring->elsz, (n - first) * ring->elsz);
+
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	_osm_ring_notify(&ring->notify);
+	return n;
+}
+
+bool osm_spsc_push(OSMSpscRing *ring, const void *el)
+{
+	return osm_spsc_push_n(ring, el, 1) == 1;
+}
+
+unsigned int osm_spsc_pop_n(OSMSpscRing *ring, void *els, unsigned int max)
+{
+	size_t size = ring->mask + 1;
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	if (ring->head_cache - tail < max)
+		ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	size_t n = ring->head_cache - tail;
+	if (n > max)
+		n = max;
+	if (n == 0)
+		return 0;
+
+	size_t idx = tail & ring->mask;
+	size_t first = size - idx < n ? size - idx : n;
+	memcpy(els, ring->buf + idx * ring->elsz, first * ring->elsz);
+	memcpy((unsigned char *) els + first * ring->elsz, ring->buf, (n - first) * ring->elsz);
+
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+	return n;
+}
+
+bool osm_spsc_pop(OSMSpscRing *ring, void *el)
+{
+	return osm_spsc_pop_n(ring, el, 1) == 1;
+}
+
+unsigned int osm_spsc_count(OSMSpscRing *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+}
+
+/**
+ * Returns false if the consumer has nothing to pop
+ */
+bool _osm_spsc_ready(OSMSpscRing *ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire)
+		!= atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+bool osm_spsc_arm(OSMSpscRing *ring)
+{
+	_osm_ring_arm(&ring->notify);
+	if (_osm_spsc_ready(ring))
+	{
+		_osm_ring_disarm(&ring->notify);
+		return false;
+	}
+	return true;
+}
+
+bool osm_spsc_wait(OSMSpscRing *ring, int timeout_ms)
+{
+	// A wake up left over from an earlier wait returns early, so go back
+	// to sleep until there really are elements
+	while (osm_spsc_arm(ring))
+	{
+		if (!_osm_ring_sleep(&ring->notify, timeout_ms))
+			return _osm_spsc_ready(ring);
+	}
+	return true;
+}
+
+int osm_spsc_fd(OSMSpscRing *ring)
+{
+	return ring->notify.fd;
+}
+
+void osm_spsc_ack(OSMSpscRing *ring)
+{
+	_osm_ring_ack(&ring->notify);
+}
+
+void osm_spsc_end(OSMSpscRing *ring)
+{
+	free(ring->buf);
+	ring->buf = NULL;
+	if (ring->notify.fd != -1)
+		close(ring->notify.fd);
+	ring->notify.fd = -1;
+}
+
+// Multi producer
+
+/**
+ * Get the sequence number of a slot, which is its position + 1 once its
+ * element has been written
+ */
+atomic_size_t *_osm_mpsc_seq(OSMMpscRing *ring, size_t pos)
+{
+	return (atomic_size_t *) (ring->slots + (pos & ring->mask) * ring->stride);
+}
+
+void *_osm_mpsc_data(OSMMpscRing *ring, size_t pos)
+{
+	return ring->slots + (pos & ring->mask) * ring->stride + sizeof(atomic_size_t);
+}
+
+int osm_mpsc_init(OSMMpscRing *ring, unsigned int elsz, unsigned int capacity)
+{
+	size_t size = _osm_ring_size(capacity);
+	if (size == 0)
+		return -1;
+
+	ring->stride = (sizeof(atomic_size_t) + elsz + alignof(atomic_size_t) - 1)
+		& ~(alignof(atomic_size_t) - 1);
+	ring->slots = _osm_ring_alloc(size * ring->stride);
+	if (ring->slots == NULL)
+		return -1;
+
+	if (_osm_ring_notify_init(&ring->notify) != 0)
+	{
+		free(ring->slots);
+		return -1;
+	}
+
+	ring->mask = size - 1;
+	ring->elsz = elsz;
+
+	// Position i is written when its sequence is i + 1, and no slot starts
+	// out looking like that
+	for (size_t i = 0; i < size; i++)
+		atomic_init(_osm_mpsc_seq(ring, i), i);
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+unsigned int osm_mpsc_push_n(OSMMpscRing *ring, const void *els, unsigned int n)
+{
+	size_t size = ring->mask + 1;
+
+	// The tail is read first, so head can only be ahead of it
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t claim;
+
+	// Claim consecutive slots which the consumer has finished with
+	for (;;)
+	{
+		// Once another producer has moved head, the tail read may be so old
+		// that head is more than a ring ahead of it
+		size_t room = head - tail < size ? size - (head - tail) : 0;
+		claim = n < room ? n : room;
+		if (claim == 0)
+		{
+			// Full as far as the tail read says, see if it has moved
+			size_t now = atomic_load_explicit(&ring->tail, memory_order_acquire);
+			if (now == tail)
+				return 0;
+			tail = now;
+			continue;
+		}
+
+		if (atomic_compare_exchange_weak_explicit(&ring->head, &head, head + claim,
+			memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+
+	const unsigned char *src = els;
+	for (size_t i = 0; i < claim; i++)
+	{
+		memcpy(_osm_mpsc_data(ring, head + i), src + i * ring->elsz, ring->elsz);
+		atomic_store_explicit(_osm_mpsc_seq(ring, head + i), head + i + 1, memory_order_release);
+	}
+
+	_osm_ring_notify(&ring->notify);
+	return claim;
+}
+
+bool osm_mpsc_push(OSMMpscRing *ring, const void *el)
+{
+	return osm_mpsc_push_n(ring, el, 1) == 1;
+}
+
+unsigned int osm_mpsc_pop_n(OSMMpscRing *ring, void *els, unsigned int max)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned char *dst = els;
+
+	unsigned int n = 0;
+	for (; n < max; n++)
+	{
+		if (atomic_load_explicit(_osm_mpsc_seq(ring, tail + n), memory_order_acquire) != tail + n + 1)
+			break;
+		memcpy(dst + (size_t) n * ring->elsz, _osm_mpsc_data(ring, tail + n), ring->elsz);
+	}
+
+	// Hands the slots back to the producers
+	if (n > 0)
+		atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+	return n;
+}
+
+bool osm_mpsc_pop(OSMMpscRing *ring, void *el)
+{
+	return osm_mpsc_pop_n(ring, el, 1) == 1;
+}
+
+unsigned int osm_mpsc_count(OSMMpscRing *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+}
+
+/**
+ * Returns false if the next element hasn't been written yet
+ */
+bool _osm_mpsc_ready(OSMMpscRing *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	return atomic_load_explicit(_osm_mpsc_seq(ring, tail), memory_order_acquire) == tail + 1;
+}
+
+bool osm_mpsc_arm(OSMMpscRing *ring)
+{
+	_osm_ring_arm(&ring->notify);
+	if (_osm_mpsc_ready(ring))
+	{
+		_osm_ring_disarm(&ring->notify);
+		return false;
+	}
+	return true;
+}
+
+bool osm_mpsc_wait(OSMMpscRing *ring, int timeout_ms)
+{
+	while (osm_mpsc_arm(ring))
+	{
+		if (!_osm_ring_sleep(&ring->notify, timeout_ms))
+			return _osm_mpsc_ready(ring);
+	}
+	return true;
+}
+
+int osm_mpsc_fd(OSMMpscRing *ring)
+{
+	return ring->notify.fd;
+}
+
+void osm_mpsc_ack(OSMMpscRing *ring)
+{
+	_osm_ring_ack(&ring->notify);
+}
+
+void osm_mpsc_end(OSMMpscRing *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+	if (ring->notify.fd != -1)
+		close(ring->notify.fd);
+	ring->notify.fd = -1;
+}
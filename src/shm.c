@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+
+#include "osm/shm.h"
+#include "osm/protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/// Records are padded to keep record headers aligned
+#define SHM_ALIGN 8
+/// Set in a record's size when it only pads out the end of the ring
+#define SHM_PAD_FLAG 0x80000000u
+
+/// Precedes every payload in the ring
+typedef struct {
+	uint32_t size;             // whole record, including padding
+	OSMDataHeader header;
+} _OSMShmRecord;
+
+/// Offer and answer exchanged on the socket
+typedef struct {
+	uint8_t magic[4];
+	uint32_t size;             // data area size, or 0 to refuse
+} _OSMShmHello;
+
+/**
+ * Size of the mapping for a data area of the given size
+ */
+size_t _osm_shm_map_len(uint32_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t header = (sizeof(OSMShmHeader) + page - 1) & ~(page - 1);
+	return header + size;
+}
+
+/**
+ * Map a ring's memfd
+ */
+int _osm_shm_map(OSMShm *shm, int memfd, uint32_t size)
+{
+	shm->map_len = _osm_shm_map_len(size);
+	void *map = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	shm->memfd = memfd;
+	shm->size = size;
+	shm->header = map;
+	shm->data = (uint8_t *) map + (shm->map_len - size);
+	shm->pos = 0;
+	shm->pending = 0;
+	return 0;
+}
+
+/**
+ * Ring the peer's doorbell if it is waiting
+ */
+void _osm_shm_ring(OSMShm *shm, atomic_uint *waiting)
+{
+	if (atomic_exchange(waiting, 0) == 0)
+		return;
+
+	uint8_t bell = 1;
+	send(shm->sockfd, &bell, sizeof(bell), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**
+ * Wait for the peer to ring the doorbell
+ * return - 0 on a doorbell, -1 if the peer went away
+ */
+int _osm_shm_wait(OSMShm *shm)
+{
+	uint8_t bell;
+	ssize_t ret;
+	do
+	{
+		ret = recv(shm->sockfd, &bell, sizeof(bell), 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret <= 0)
+	{
+		errno = ECONNRESET;
+		return -1;
+	}
+	return 0;
+}
+
+int osm_shm_offer(OSMShm *shm, int sockfd, uint32_t size)
+{
+	memset(shm, 0, sizeof(*shm));
+	shm->memfd = -1;
+
+	if (size == 0)
+		size = OSM_SHM_DEFAULT_SIZE;
+
+	// Power of two so positions can be masked
+	if ((size & (size - 1)) != 0 || size < 4096 || size & SHM_PAD_FLAG)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	int memfd = memfd_create("osm-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1)
+		return -1;
+
+	// The peer must not be able to shrink the ring under us
+	if (ftruncate(memfd, _osm_shm_map_len(size)) != 0 ||
+		fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+		_osm_shm_map(shm, memfd, size) != 0)
+	{
+		close(memfd);
+		return -1;
+	}
+
+	shm->sockfd = sockfd;
+	shm->producer = true;
+	memcpy(shm->header->magic, OSM_MAGIC_SHM, 4);
+	shm->header->size = size;
+	atomic_init(&shm->header->head, 0);
+	atomic_init(&shm->header->tail, 0);
+	atomic_init(&shm->header->producer_waiting, 0);
+	atomic_init(&shm->header->consumer_waiting, 0);
+
+	// Send the offer with the memfd attached
+	_OSMShmHello hello;
+	memcpy(hello.magic, OSM_MAGIC_SHM, 4);
+	hello.size = size;
+
+	struct iovec iov = {
+		.iov_base = &hello,
+		.iov_len = sizeof(hello),
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+	if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != sizeof(hello))
+		goto fail;
+
+	// Wait for the answer
+	_OSMShmHello answer;
+	if (recv(sockfd, &answer, sizeof(answer), 0) != sizeof(answer) ||
+		memcmp(answer.magic, OSM_MAGIC_SHM, 4) != 0 || answer.size != size)
+	{
+		errno = ECONNREFUSED;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	osm_shm_end(shm);
+	return -1;
+}
+
+int osm_shm_accept(OSMShm *shm, int sockfd)
+{
+	memset(shm, 0, sizeof(*shm));
+	shm->memfd = -1;
+
+	_OSMShmHello hello;
+	struct iovec iov = {
+		.iov_base = &hello,
+		.iov_len = sizeof(hello),
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello))
+		return -1;
+
+	int memfd = -1;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	_OSMShmHello answer;
+	memcpy(answer.magic, OSM_MAGIC_SHM, 4);
+	answer.size = 0;
+
+	bool valid = memfd != -1 && memcmp(hello.magic, OSM_MAGIC_SHM, 4) == 0 &&
+		hello.size >= 4096 && (hello.size & (hello.size - 1)) == 0 && !(hello.size & SHM_PAD_FLAG);
+
+	// Only map memory which can't shrink away from under us, and which is
+	// large enough already, touching past its end would raise SIGBUS
+	int seals = valid ? fcntl(memfd, F_GET_SEALS) : 0;
+	valid = valid && seals != -1 && (seals & F_SEAL_SHRINK);
+
+	struct stat st;
+	valid = valid && fstat(memfd, &st) == 0 && (size_t) st.st_size >= _osm_shm_map_len(hello.size);
+
+	if (valid && _osm_shm_map(shm, memfd, hello.size) == 0)
+	{
+		shm->sockfd = sockfd;
+		shm->producer = false;
+		answer.size = hello.size;
+	}
+	else if (memfd != -1)
+	{
+		close(memfd);
+	}
+
+	if (send(sockfd, &answer, sizeof(answer), MSG_NOSIGNAL) != sizeof(answer) || answer.size == 0)
+	{
+		if (answer.size != 0)
+			osm_shm_end(shm);
+		errno = ECONNREFUSED;
+		return -1;
+	}
+
+	return 0;
+}
+
+void *osm_shm_reserve(OSMShm *shm, const OSMDataHeader *header, bool wait)
+{
+	uint32_t mask = shm->size - 1;
+	uint32_t need = (sizeof(_OSMShmRecord) + header->len + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+
+	// Leave room to pad out the end of the ring
+	if (need > shm->size / 2)
+	{
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	uint32_t off = shm->pos & mask;
+	uint32_t pad = off + need > shm->size ? shm->size - off : 0;
+
+	while (shm->size - (shm->pos - atomic_load(&shm->header->tail)) < pad + need)
+	{
+		if (!wait)
+		{
+			errno = EAGAIN;
+			return NULL;
+		}
+
+		// Check again after announcing, the consumer may have just released
+		atomic_store(&shm->header->producer_waiting, 1);
+		if (shm->size - (shm->pos - atomic_load(&shm->header->tail)) >= pad + need)
+		{
+			atomic_store(&shm->header->producer_waiting, 0);
+			break;
+		}
+
+		if (_osm_shm_wait(shm) != 0)
+			return NULL;
+	}
+
+	if (pad > 0)
+	{
+		_OSMShmRecord *r = (_OSMShmRecord *)(shm->data + off);
+		r->size = pad | SHM_PAD_FLAG;
+		shm->pos += pad;
+		off = 0;
+	}
+
+	_OSMShmRecord *r = (_OSMShmRecord *)(shm->data + off);
+	r->size = need;
+	r->header = *header;
+	shm->pending = need;
+
+	return r + 1;
+}
+
+int osm_shm_commit(OSMShm *shm)
+{
+	if (shm->pending == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	shm->pos += shm->pending;
+	shm->pending = 0;
+	atomic_store(&shm->header->head, shm->pos);
+
+	_osm_shm_ring(shm, &shm->header->consumer_waiting);
+	return 0;
+}
+
+int osm_shm_send(OSMShm *shm, const OSMDataHeader *header, const void *payload, bool wait)
+{
+	void *dest = osm_shm_reserve(shm, header, wait);
+	if (dest == NULL)
+		return -1;
+
+	memcpy(dest, payload, header->len);
+	return osm_shm_commit(shm);
+}
+
+const void *osm_shm_recv(OSMShm *shm, OSMDataHeader *header, bool wait)
+{
+	uint32_t mask = shm->size - 1;
+
+	// Finish with the previous payload if the caller didn't
+	if (shm->pending != 0)
+		osm_shm_release(shm);
+
+	while (1)
+	{
+		uint64_t head = atomic_load(&shm->header->head);
+
+		if (shm->pos == head)
+		{
+			if (!wait)
+			{
+				errno = EAGAIN;
+				return NULL;
+			}
+
+			atomic_store(&shm->header->consumer_waiting, 1);
+			if (atomic_load(&shm->header->head) != shm->pos)
+			{
+				atomic_store(&shm->header->consumer_waiting, 0);
+				continue;
+			}
+
+			if (_osm_shm_wait(shm) != 0)
+				return NULL;
+			continue;
+		}
+
+		_OSMShmRecord *r = (_OSMShmRecord *)(shm->data + (shm->pos & mask));
+		uint32_t size = r->size;
+
+		// Skip the padding at the end of the ring
+		if (size & SHM_PAD_FLAG)
+		{
+			if ((size & ~SHM_PAD_FLAG) != shm->size - (shm->pos & mask))
+			{
+				errno = EPROTO;
+				return NULL;
+			}
+
+			shm->pos += size & ~SHM_PAD_FLAG;
+			continue;
+		}
+
+		// The other process may still change the record, so check the
+		// copy which is handed out rather than the shared memory
+		OSMDataHeader copy;
+		memcpy(&copy, &r->header, sizeof(copy));
+
+		// Don't trust a corrupted size from the other process
+		if (size < sizeof(_OSMShmRecord) || size > shm->size - (shm->pos & mask) ||
+			copy.len > size - sizeof(_OSMShmRecord))
+		{
+			errno = EPROTO;
+			return NULL;
+		}
+
+		*header = copy;
+		shm->pending = size;
+		return r + 1;
+	}
+}
+
+void osm_shm_release(OSMShm *shm)
+{
+	if (shm->pending == 0)
+		return;
+
+	shm->pos += shm->pending;
+	shm->pending = 0;
+	atomic_store(&shm->header->tail, shm->pos);
+
+	_osm_shm_ring(shm, &shm->header->producer_waiting);
+}
+
+void osm_shm_end(OSMShm *shm)
+{
+	if (shm->header != NULL)
+		munmap(shm->header, shm->map_len);
+	if (shm->memfd != -1)
+		close(shm->memfd);
+
+	shm->header = NULL;
+	shm->data = NULL;
+	shm->memfd = -1;
+}
@@ -0,0 +1,530 @@
+#include "osm/stream.h"
+#include "osm/codec.h"
+#include "osm/frames.h"
+#include "osm/trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Send a frame without a payload, or a data frame
+ */
+int _osm_stream_send(OSMStreamEngine *engine, uint8_t frame_type, const void *sub_header, const void *payload, size_t len)
+{
+	engine->header.frame_type = frame_type;
+	OSMFrameOut out = osm_frame_out(&engine->header, sub_header, (void *) payload, len);
+	return engine->send(&out, engine->data);
+}
+
+void _osm_stream_event(OSMStreamEngine *engine, uint8_t number, int event)
+{
+	if (engine->event != NULL)
+		engine->event(engine, number, event, engine->data);
+}
+
+/**
+ * Free a stream's buffers and mark it closed
+ */
+void _osm_stream_free(OSMStream *stream)
+{
+	free(stream->slots);
+	free(stream->lens);
+	memset(stream, 0, sizeof(*stream));
+}
+
+/**
+ * Set up an incoming stream's buffers
+ */
+int _osm_stream_setup_in(OSMStream *stream, uint64_t control_id, unsigned int window, unsigned int max_len)
+{
+	if (window > UINT16_MAX || max_len > UINT16_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	stream->slots = malloc((size_t) window * max_len);
+	stream->lens = malloc(sizeof(uint16_t) * window);
+	if (stream->slots == NULL || stream->lens == NULL)
+	{
+		_osm_stream_free(stream);
+		return -1;
+	}
+
+	stream->state = OSM_STREAM_OPEN;
+	stream->outgoing = false;
+	stream->control_id = control_id;
+	stream->window = window;
+	stream->max_len = max_len;
+	stream->head = 0;
+	stream->tail = 0;
+	stream->granted = window;
+	return 0;
+}
+
+/**
+ * Grant the sender of an incoming stream some credits
+ */
+int _osm_stream_grant(OSMStreamEngine *engine, uint8_t number, unsigned int credits)
+{
+	OSMStream *stream = &engine->streams[number];
+	OSMStreamInHeader in = {
+		.number = number,
+		.flags = OSM_STREAM_F_CREDIT | (stream->compact ? OSM_STREAM_F_COMPACT : 0),
+		.credits = credits,
+		.control_id = stream->control_id,
+		.max_len = stream->max_len,
+	};
+
+	stream->granted += credits;
+	return _osm_stream_send(engine, OSM_FT_SVI, &in, NULL, 0);
+}
+
+/**
+ * Refuse a stream the peer tried to open
+ */
+int _osm_stream_refuse(OSMStreamEngine *engine, uint8_t number)
+{
+	OSMStreamCloseHeader close = {
+		.number = number,
+	};
+	return _osm_stream_send(engine, OSM_FT_SCL, &close, NULL, 0);
+}
+
+void osm_stream_init(OSMStreamEngine *engine, const OSMFrameHeader *header, OSMStreamSend send, OSMStreamEvent event, void *data)
+{
+	memset(engine, 0, sizeof(*engine));
+	engine->header = *header;
+	engine->send = send;
+	engine->event = event;
+	engine->data = data;
+	engine->window = OSM_STREAM_DEFAULT_WINDOW;
+	engine->max_len = OSM_STREAM_DEFAULT_MAX_LEN;
+}
+
+void osm_stream_compact(OSMStreamEngine *engine, bool enable)
+{
+	engine->compact = enable;
+}
+
+void osm_stream_limits(OSMStreamEngine *engine, unsigned int window, unsigned int max_len)
+{
+	engine->window = window ? window : OSM_STREAM_DEFAULT_WINDOW;
+	engine->max_len = max_len ? max_len : OSM_STREAM_DEFAULT_MAX_LEN;
+}
+
+int osm_stream_handle(OSMStreamEngine *engine, const OSMFrameView *view)
+{
+	OSM_TRACE2(frame_dispatch, view->frame_type, engine);
+
+	switch (view->frame_type)
+	{
+		case OSM_FT_DAT:
+		{
+			uint8_t number = view->sub.data.number;
+			OSMStream *stream = &engine->streams[number];
+
+			// Data frames outside of a stream aren't ours
+			if (stream->state != OSM_STREAM_OPEN || stream->outgoing)
+				return 0;
+
+			if (stream->granted == 0 || view->payload_len > stream->max_len)
+			{
+				errno = EPROTO;
+				return -1;
+			}
+
+			unsigned int slot = stream->head % stream->window;
+			memcpy(stream->slots + (size_t) slot * stream->max_len, view->payload, view->payload_len);
+			stream->lens[slot] = view->payload_len;
+			stream->head++;
+			stream->granted--;
+
+			_osm_stream_event(engine, number, OSM_STREAM_EV_DATA);
+			return 1;
+		}
+
+		case OSM_FT_SVO:
+		{
+			uint8_t number = view->sub.stream_out.number;
+			OSMStream *stream = &engine->streams[number];
+			uint8_t flags = view->sub.stream_out.flags;
+
+			// The sender of a stream we asked for accepts compact samples
+			if (flags & OSM_STREAM_F_CREDIT)
+			{
+				if (stream->state == OSM_STREAM_CLOSED)
+					return 1;
+
+				if (stream->outgoing)
+				{
+					errno = EPROTO;
+					return -1;
+				}
+
+				stream->compact = engine->compact && (flags & OSM_STREAM_F_COMPACT);
+				return 1;
+			}
+
+			// The peer wants to send to us
+			if (stream->state != OSM_STREAM_CLOSED ||
+				_osm_stream_setup_in(stream, view->sub.stream_out.control_id, engine->window, engine->max_len) != 0)
+				return _osm_stream_refuse(engine, number) == 0 ? 1 : -1;
+
+			stream->compact = engine->compact && (flags & OSM_STREAM_F_COMPACT);
+
+			// Its first credits are the whole window
+			stream->granted = 0;
+			if (_osm_stream_grant(engine, number, stream->window) != 0)
+				return -1;
+
+			_osm_stream_event(engine, number, OSM_STREAM_EV_OPENED);
+			return 1;
+		}
+
+		case OSM_FT_SVI:
+		{
+			uint8_t number = view->sub.stream_in.number;
+			OSMStream *stream = &engine->streams[number];
+
+			if (view->sub.stream_in.flags & OSM_STREAM_F_CREDIT)
+			{
+				// Credits may still arrive after we closed the stream
+				if (stream->state == OSM_STREAM_CLOSED)
+					return 1;
+
+				if (!stream->outgoing)
+				{
+					errno = EPROTO;
+					return -1;
+				}
+
+				stream->credits += view->sub.stream_in.credits;
+				if (stream->state == OSM_STREAM_OPENING)
+				{
+					stream->state = OSM_STREAM_OPEN;
+					stream->max_len = view->sub.stream_in.max_len;
+					stream->compact = engine->compact && (view->sub.stream_in.flags & OSM_STREAM_F_COMPACT);
+					_osm_stream_event(engine, number, OSM_STREAM_EV_OPENED);
+				}
+				else
+				{
+					_osm_stream_event(engine, number, OSM_STREAM_EV_CREDIT);
+				}
+				return 1;
+			}
+
+			// The peer asks us to send to it
+			if (stream->state != OSM_STREAM_CLOSED)
+				return _osm_stream_refuse(engine, number) == 0 ? 1 : -1;
+
+			stream->state = OSM_STREAM_OPEN;
+			stream->outgoing = true;
+			stream->control_id = view->sub.stream_in.control_id;
+			stream->credits = view->sub.stream_in.credits;
+			stream->max_len = view->sub.stream_in.max_len;
+
+			// As the sender of the data we accept compact samples with an SVO
+			if (engine->compact && (view->sub.stream_in.flags & OSM_STREAM_F_COMPACT))
+			{
+				OSMStreamOutHeader accept = {
+					.number = number,
+					.flags = OSM_STREAM_F_CREDIT | OSM_STREAM_F_COMPACT,
+					.control_id = stream->control_id,
+				};
+				if (_osm_stream_send(engine, OSM_FT_SVO, &accept, NULL, 0) != 0)
+				{
+					_osm_stream_free(stream);
+					return -1;
+				}
+				stream->compact = true;
+			}
+
+			_osm_stream_event(engine, number, OSM_STREAM_EV_OPENED);
+			return 1;
+		}
+
+		case OSM_FT_SCL:
+		{
+			uint8_t number = view->sub.stream_close.number;
+			OSMStream *stream = &engine->streams[number];
+
+			if (stream->state != OSM_STREAM_CLOSED)
+			{
+				_osm_stream_free(stream);
+				_osm_stream_event(engine, number, OSM_STREAM_EV_CLOSED);
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int osm_stream_open_out(OSMStreamEngine *engine, uint8_t number, uint64_t control_id)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (stream->state != OSM_STREAM_CLOSED)
+	{
+		errno = EBUSY;
+		return -1;
+	}
+
+	OSMStreamOutHeader out = {
+		.number = number,
+		.flags = engine->compact ? OSM_STREAM_F_COMPACT : 0,
+		.control_id = control_id,
+	};
+
+	// The peer's credits may be handled before the send returns
+	stream->state = OSM_STREAM_OPENING;
+	stream->outgoing = true;
+	stream->control_id = control_id;
+	stream->credits = 0;
+
+	if (_osm_stream_send(engine, OSM_FT_SVO, &out, NULL, 0) != 0)
+	{
+		_osm_stream_free(stream);
+		return -1;
+	}
+	return 0;
+}
+
+int osm_stream_open_in(OSMStreamEngine *engine, uint8_t number, uint64_t control_id, unsigned int window, unsigned int max_len)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (stream->state != OSM_STREAM_CLOSED)
+	{
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (_osm_stream_setup_in(stream, control_id, window ? window : engine->window, max_len ? max_len : engine->max_len) != 0)
+		return -1;
+
+	OSMStreamInHeader in = {
+		.number = number,
+		.flags = engine->compact ? OSM_STREAM_F_COMPACT : 0,
+		.credits = stream->window,
+		.control_id = control_id,
+		.max_len = stream->max_len,
+	};
+	if (_osm_stream_send(engine, OSM_FT_SVI, &in, NULL, 0) != 0)
+	{
+		_osm_stream_free(stream);
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned int osm_stream_credits(OSMStreamEngine *engine, uint8_t number)
+{
+	OSMStream *stream = &engine->streams[number];
+	return stream->outgoing && stream->state == OSM_STREAM_OPEN ? stream->credits : 0;
+}
+
+int osm_stream_write(OSMStreamEngine *engine, uint8_t number, const void *payload, uint16_t len)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (!stream->outgoing || stream->state == OSM_STREAM_CLOSED)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	if (stream->credits == 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (len > stream->max_len)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	OSMDataHeader data = {
+		.number = number,
+		.len = len,
+	};
+	if (_osm_stream_send(engine, OSM_FT_DAT, &data, payload, len) != 0)
+		return -1;
+
+	stream->credits--;
+	return 0;
+}
+
+const void *osm_stream_read(OSMStreamEngine *engine, uint8_t number, uint16_t *len)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (stream->outgoing || stream->state == OSM_STREAM_CLOSED || stream->head == stream->tail)
+	{
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	unsigned int slot = stream->tail % stream->window;
+	*len = stream->lens[slot];
+	return stream->slots + (size_t) slot * stream->max_len;
+}
+
+int osm_stream_release(OSMStreamEngine *engine, uint8_t number)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (stream->outgoing || stream->state == OSM_STREAM_CLOSED || stream->head == stream->tail)
+		return 0;
+
+	stream->tail++;
+
+	// Grant credits back once half the window is free, not for every frame
+	unsigned int room = stream->window - (stream->head - stream->tail) - stream->granted;
+	unsigned int batch = stream->window / 2 ? stream->window / 2 : 1;
+	if (room >= batch)
+		return _osm_stream_grant(engine, number, room);
+
+	return 0;
+}
+
+int osm_stream_write_samples(OSMStreamEngine *engine, uint8_t number, uint8_t type, const uint64_t *values, unsigned int count)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (type != OSM_TYPE_BOOL && type != OSM_TYPE_INT && type != OSM_TYPE_FLOAT)
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	// The receiver's limit is only known once it has granted credits
+	if (osm_stream_credits(engine, number) == 0)
+	{
+		errno = stream->outgoing ? EAGAIN : EBADF;
+		return -1;
+	}
+
+	uint8_t buf[OSM_STREAM_DEFAULT_MAX_LEN];
+	size_t limit = stream->max_len < sizeof(buf) ? stream->max_len : sizeof(buf);
+	size_t len = 0;
+	unsigned int n = 0;
+
+	// The encoding state only moves on if the frame is sent
+	OSMCompactState saved = stream->samples;
+
+	for (; n < count; n++)
+	{
+		if (stream->compact)
+		{
+			if (len + OSM_COMPACT_VALUE_MAX > limit)
+				break;
+			len += osm_compact_put_value(&stream->samples, buf + len, type, values[n]);
+		}
+		else
+		{
+			if (len + 8 > limit)
+				break;
+			osm_put_le64(buf + len, values[n]);
+			len += 8;
+		}
+	}
+
+	if (n == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (osm_stream_write(engine, number, buf, len) != 0)
+	{
+		stream->samples = saved;
+		return -1;
+	}
+
+	return n;
+}
+
+int osm_stream_read_samples(OSMStreamEngine *engine, uint8_t number, uint8_t type, uint64_t *values, unsigned int max)
+{
+	OSMStream *stream = &engine->streams[number];
+	uint16_t len;
+
+	const uint8_t *payload = osm_stream_read(engine, number, &len);
+	if (payload == NULL)
+		return -1;
+
+	size_t off = stream->offset;
+	unsigned int n = 0;
+	bool invalid = false;
+
+	while (n < max && off < len)
+	{
+		if (stream->compact)
+		{
+			ssize_t used = osm_compact_get_value(&stream->samples, payload + off, len - off, type, &values[n]);
+			if (used == -1)
+			{
+				// The caller asked for the wrong type, the frame is fine
+				if (errno == EOPNOTSUPP && n == 0)
+					return -1;
+				invalid = true;
+				break;
+			}
+			off += used;
+		}
+		else
+		{
+			if (len - off < 8)
+			{
+				invalid = true;
+				break;
+			}
+			values[n] = osm_get_le64(payload + off);
+			off += 8;
+		}
+		n++;
+	}
+
+	// Hand over the samples read so far, the next call reports the error
+	if (off < len && (n > 0 || !invalid))
+	{
+		stream->offset = off;
+		return n;
+	}
+
+	// Done with the frame, or it can't be decoded any further: drop it so
+	// its credit goes back to the sender
+	stream->offset = 0;
+	if (osm_stream_release(engine, number) != 0)
+		return -1;
+
+	if (invalid)
+	{
+		errno = EPROTO;
+		return -1;
+	}
+	return n;
+}
+
+int osm_stream_close(OSMStreamEngine *engine, uint8_t number)
+{
+	OSMStream *stream = &engine->streams[number];
+	if (stream->state == OSM_STREAM_CLOSED)
+		return 0;
+
+	_osm_stream_free(stream);
+
+	OSMStreamCloseHeader close = {
+		.number = number,
+	};
+	return _osm_stream_send(engine, OSM_FT_SCL, &close, NULL, 0);
+}
+
+void osm_stream_end(OSMStreamEngine *engine)
+{
+	for (unsigned int i = 0; i < OSM_STREAM_MAX; i++)
+	{
+		if (engine->streams[i].state != OSM_STREAM_CLOSED)
+			_osm_stream_free(&engine->streams[i]);
+	}
+}
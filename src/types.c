@@ -317,29 +317,38 @@ int8_t osm_is_infinity(OSMFloat f)
 
 
 OSMColor osm_rgb_to_color(uint8_t r, uint8_t g, uint8_t b)
+{
+	return osm_rgb_to_color_in(NULL, r, g, b);
+}
+
+OSMColor osm_rgb_to_color_in(OSMAllocator *alloc, uint8_t r, uint8_t g, uint8_t b)
 {
 	OSMColor out = {
 		.r = r,
 		.g = g,
 		.b = b,
-		.extra = vect_init(sizeof(OSMColorChannel)),
+		.extra = svect_init_in(sizeof(OSMColorChannel), alloc),
 	};
 	return out;
 }
 
 OSMColor osm_color_copy(OSMColor *color)
 {
+	return osm_color_copy_in(color->extra.alloc, color);
+}
 
+OSMColor osm_color_copy_in(OSMAllocator *alloc, OSMColor *color)
+{
 	OSMColor out = {
 		.r = color->r,
 		.g = color->g,
 		.b = color->b,
-		.extra = vect_init(sizeof(OSMColorChannel)),
+		.extra = svect_init_in(sizeof(OSMColorChannel), alloc),
 	};
 
 	for (uint8_t i = 0; i < color->extra.count; i++)
 	{
-		OSMColorChannel *c = vect_get(&color->extra, i);
+		OSMColorChannel *c = svect_get(&color->extra, i);
 		osm_add_channel(&out, c->val, c->name);
 	}
 
@@ -354,11 +363,11 @@ void osm_color_free(OSMColor *color)
 
 	for (uint8_t i = 0; i < color->extra.count; i++)
 	{
-		OSMColorChannel *c = vect_get(&color->extra, i);
-		free(c->name);
+		OSMColorChannel *c = svect_get(&color->extra, i);
+		osm_free(color->extra.alloc, c->name);
 	}
 
-	vect_end(&color->extra);
+	svect_end(&color->extra);
 }
 
 void osm_add_channel(OSMColor *color, uint8_t val, uint8_t *name)
@@ -366,11 +375,15 @@ void osm_add_channel(OSMColor *color, uint8_t val, uint8_t *name)
 	size_t len = strlen((char *)name) + 1;
 	OSMColorChannel add = {
 		.val = val,
-		.name = malloc(len)
+		.name = osm_alloc(color->extra.alloc, len)
 	};
 
+	if (add.name == NULL)
+		return;
+
 	memcpy(add.name, name, len);
 
-	vect_push(&color->extra, &add);
+	if (!svect_push(&color->extra, &add))
+		osm_free(color->extra.alloc, add.name);
 }
 
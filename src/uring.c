@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+
+#include "osm/uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef OSM_USE_IO_URING
+
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+struct OSMUringOp {
+	OSMUringCallback callback;
+	void *data;
+	OSMUringOp *next;
+};
+
+int _osm_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int _osm_uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+bool osm_uring_available()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = _osm_uring_setup(2, &p);
+	if (fd == -1)
+		return false;
+
+	close(fd);
+	return true;
+}
+
+/**
+ * Take an op from the free list
+ */
+OSMUringOp *_osm_uring_op(OSMUring *ring, OSMUringCallback callback, void *data)
+{
+	OSMUringOp *op = ring->ops_free;
+	if (op == NULL)
+	{
+		errno = EBUSY;
+		return NULL;
+	}
+
+	ring->ops_free = op->next;
+	ring->inflight++;
+
+	op->callback = callback;
+	op->data = data;
+	op->next = NULL;
+	return op;
+}
+
+/**
+ * Give an op back to the free list
+ */
+void _osm_uring_op_free(OSMUring *ring, OSMUringOp *op)
+{
+	op->next = ring->ops_free;
+	ring->ops_free = op;
+	ring->inflight--;
+}
+
+/**
+ * Get the next submission queue entry, flushing the queue if it is full
+ */
+struct io_uring_sqe *_osm_uring_sqe(OSMUring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *ring->sq_tail;
+
+	if (tail - head > *ring->sq_mask)
+	{
+		if (osm_uring_submit(ring) <= 0)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head > *ring->sq_mask)
+			return NULL;
+	}
+
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *) ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+
+	return sqe;
+}
+
+/**
+ * Queue the read that wakes the ring when osm_uring_stop is called
+ */
+int _osm_uring_queue_wake(OSMUring *ring)
+{
+	OSMUringOp *op = _osm_uring_op(ring, NULL, NULL);
+	if (op == NULL)
+		return -1;
+
+	struct io_uring_sqe *sqe = _osm_uring_sqe(ring);
+	if (sqe == NULL)
+	{
+		_osm_uring_op_free(ring, op);
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ring->wakefd;
+	sqe->addr = (uintptr_t) &ring->wake_value;
+	sqe->len = sizeof(ring->wake_value);
+	sqe->user_data = (uintptr_t) op;
+	return 0;
+}
+
+int osm_uring_init(OSMUring *ring, unsigned int entries)
+{
+	int err;
+	memset(ring, 0, sizeof(*ring));
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = _osm_uring_setup(entries, &p);
+	if (ring->fd == -1)
+		return -1;
+
+	ring->wakefd = -1;
+
+	// Map the rings
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+	{
+		ring->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+		{
+			ring->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	// In flight operations are bounded by the completion queue
+	ring->ops = calloc(p.cq_entries, sizeof(OSMUringOp));
+	if (ring->ops == NULL)
+		goto fail;
+	for (unsigned int i = 0; i < p.cq_entries; i++)
+	{
+		ring->ops[i].next = ring->ops_free;
+		ring->ops_free = &ring->ops[i];
+	}
+
+	ring->wakefd = eventfd(0, EFD_CLOEXEC);
+	if (ring->wakefd == -1)
+		goto fail;
+
+	if (_osm_uring_queue_wake(ring) != 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	err = errno;
+	osm_uring_end(ring);
+	errno = err;
+	return -1;
+}
+
+void osm_uring_end(OSMUring *ring)
+{
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr != NULL)
+		munmap(ring->sq_ptr, ring->sq_len);
+
+	if (ring->wakefd != -1)
+		close(ring->wakefd);
+	if (ring->fd != -1)
+		close(ring->fd);
+
+	free(ring->ops);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	ring->wakefd = -1;
+}
+
+int osm_uring_submit(OSMUring *ring)
+{
+	if (ring->queued == 0)
+		return 0;
+
+	int ret;
+	do
+	{
+		ret = _osm_uring_enter(ring->fd, ring->queued, 0, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret < 0)
+		return -1;
+
+	ring->queued -= ret;
+	return ret;
+}
+
+/**
+ * Dispatch every completion currently in the completion queue
+ */
+void _osm_uring_reap(OSMUring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail)
+	{
+		struct io_uring_cqe *cqe = (struct io_uring_cqe *) ring->cqes + (head & *ring->cq_mask);
+		OSMUringOp *op = (OSMUringOp *)(uintptr_t) cqe->user_data;
+		int res = cqe->res;
+		bool more = cqe->flags & IORING_CQE_F_MORE;
+
+		// Let the kernel reuse the entry before running callbacks
+		head++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (op->callback == NULL)
+		{
+			// The wake read
+			_osm_uring_op_free(ring, op);
+			ring->running = false;
+			_osm_uring_queue_wake(ring);
+		}
+		else
+		{
+			OSMUringCallback callback = op->callback;
+			void *data = op->data;
+
+			if (!more)
+				_osm_uring_op_free(ring, op);
+
+			callback(ring, res, more, data);
+		}
+
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+int osm_uring_run(OSMUring *ring)
+{
+	ring->running = true;
+
+	while (ring->running)
+	{
+		int ret = _osm_uring_enter(ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0)
+		{
+			// EBUSY means the completion queue needs to be drained first
+			if (errno != EINTR && errno != EBUSY)
+			{
+				ring->running = false;
+				return -1;
+			}
+		}
+		else
+		{
+			ring->queued -= ret;
+		}
+
+		_osm_uring_reap(ring);
+	}
+
+	return 0;
+}
+
+void osm_uring_stop(OSMUring *ring)
+{
+	uint64_t one = 1;
+	if (write(ring->wakefd, &one, sizeof(one)) < 0)
+		return;
+}
+
+int osm_uring_accept(OSMUring *ring, int sockfd, OSMUringCallback callback, void *data)
+{
+	OSMUringOp *op = _osm_uring_op(ring, callback, data);
+	if (op == NULL)
+		return -1;
+
+	struct io_uring_sqe *sqe = _osm_uring_sqe(ring);
+	if (sqe == NULL)
+	{
+		_osm_uring_op_free(ring, op);
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sockfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = (uintptr_t) op;
+	return 0;
+}
+
+#else
+
+// Built without io_uring support: everything fails so callers use OSMLoop
+
+bool osm_uring_available()
+{
+	return false;
+}
+
+int osm_uring_init(OSMUring *ring, unsigned int entries)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void osm_uring_end(OSMUring *ring)
+{
+}
+
+int osm_uring_run(OSMUring *ring)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void osm_uring_stop(OSMUring *ring)
+{
+}
+
+int osm_uring_submit(OSMUring *ring)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int osm_uring_accept(OSMUring *ring, int sockfd, OSMUringCallback callback, void *data)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -1,87 +1,134 @@
 #include "../include/osm/utils.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define VECT_MAX_GROW 1024
 #define VECT_INIT_CAP 4
 
 /**
  * Initialize a new vector
  */
 Vector vect_init(unsigned int elsz)
+{
+	return vect_init_in(elsz, NULL);
+}
+
+/**
+ * Initialize a new vector using an allocator
+ */
+Vector vect_init_in(unsigned int elsz, OSMAllocator *alloc)
 {
 	Vector out = {
 		.elsz = elsz,
 		.size = VECT_INIT_CAP,
-		.count = 0
+		.count = 0,
+		.alloc = alloc,
 	};
 
-	out.data = malloc(out.elsz * out.size);
+	out.data = osm_alloc(alloc, (size_t) out.elsz * out.size);
+	if (out.data == NULL)
+		out.size = 0;
 
 	return out;
 }
 
 /**
- * Unexported function for auto-growing the vector
+ * Unexported function to reallocate the vector's storage
+ * Returns false (leaving the vector as it was) if out of memory
  */
-void _vect_grow(Vector *vec)
+bool _vect_realloc(Vector *vec, unsigned int size)
+{
+	void *data = osm_realloc(vec->alloc, vec->data, (size_t) vec->size * vec->elsz, (size_t) size * vec->elsz);
+	if (data == NULL && size > 0)
+		return false;
+
+	vec->data = data;
+	vec->size = size;
+	return true;
+}
+
+/**
+ * Unexported function for auto-growing the vector to fit at least count
+ * elements, at least doubling it so adding elements one at a time is
+ * amortized O(1)
+ */
+bool _vect_grow(Vector *vec, unsigned int count)
 {
 	if (vec->elsz == 0)
-	{
-		return;
-	}
+		return false;
 
-	if (vec->size == 0)
-	{
-		vec->size = VECT_INIT_CAP;
-		vec->data = realloc(vec->data, vec->size * vec->elsz);
-		return;
-	}
+	if (count <= vec->size)
+		return true;
 
-	if (vec->size > VECT_MAX_GROW)
-	{
-		vec->size += VECT_MAX_GROW;
-	}
-	else
-	{
-		vec->size *= 2;
-	}
+	unsigned int size = vec->size < VECT_INIT_CAP ? VECT_INIT_CAP : vec->size;
+	while (size < count)
+		size = size > UINT32_MAX / 2 ? count : size * 2;
 
-	vec->data = realloc(vec->data, vec->size * vec->elsz);
+	return _vect_realloc(vec, size);
 }
 
 /**
- * Unexported function for auto-shrinking the vector
+ * Unexported function for auto-shrinking the vector once it is mostly
+ * empty
  */
 void _vect_shrink(Vector *vec)
 {
-	if (vec->size / 2 < VECT_INIT_CAP)
-	{
-		return;
-	}
+	unsigned int size = vec->size;
+	while (vec->count < size / 3 && size / 2 >= VECT_INIT_CAP)
+		size /= 2;
 
-	vec->size /= 2;
-	vec->data = realloc(vec->data, vec->size * vec->elsz);
+	// Keeping the larger buffer is fine if this fails
+	if (size != vec->size)
+		_vect_realloc(vec, size);
+}
+
+/**
+ * Make room for count elements
+ * Returns false if the vector was invalid or out of memory
+ */
+bool vect_reserve(Vector *vec, unsigned int count)
+{
+	if (vec->elsz == 0)
+		return false;
+
+	return count <= vec->size || _vect_realloc(vec, count);
 }
 
 /**
  * Push a new element to the end of the vector
- * Returns false if the vector was invalid
+ * Returns false if the vector was invalid or out of memory
  */
 bool vect_push(Vector *vec, void *el)
 {
-	if (vec->elsz == 0 || vec->size == 0)
-		return false;
+	// Growing may free el if it points into the vector, which
+	// vect_insert_n copies first
+	if (vec->count == vec->size)
+		return vect_insert_n(vec, vec->count, el, 1);
 
-	memcpy(vec->data + (vec->count * vec->elsz), el, vec->elsz);
+	memcpy(vec->data + ((size_t) vec->count * vec->elsz), el, vec->elsz);
 	vec->count++;
+	return true;
+}
 
-	if (vec->size == vec->count)
-	{
-		_vect_grow(vec);
-	}
+/**
+ * Push n elements to the end of the vector
+ * Returns false if the vector was invalid or out of memory
+ */
+bool vect_push_n(Vector *vec, const void *els, unsigned int n)
+{
+	return vect_insert_n(vec, vec->count, els, n);
+}
 
-	return true;
+/**
+ * Push every element of another vector
+ * Returns false if the element sizes differ or out of memory
+ */
+bool vect_extend(Vector *vec, const Vector *other)
+{
+	if (vec->elsz != other->elsz)
+		return false;
+
+	return vect_insert_n(vec, vec->count, other->data, other->count);
 }
 
 /**
@@ -94,7 +141,7 @@ bool vect_pop(Vector *vec)
 		return false;
 
 	vec->count--;
-	
+
 	if (vec->count < vec->size / 3)
 	{
 		_vect_shrink(vec);
@@ -112,7 +159,7 @@ void *vect_get(Vector *vec, unsigned int index)
 	if (index >= vec->count)
 		return NULL;
 
-	return vec->data + (index * vec->elsz);
+	return vec->data + ((size_t) index * vec->elsz);
 }
 
 /**
@@ -124,7 +171,7 @@ bool vect_set(Vector *vec, unsigned int index, void *el)
 	if (index >= vec->count)
 		return false;
 
-	memcpy(vec->data + (index * vec->elsz), el, vec->elsz);
+	memcpy(vec->data + ((size_t) index * vec->elsz), el, vec->elsz);
 	return true;
 }
 
@@ -135,64 +182,117 @@ bool vect_set(Vector *vec, unsigned int index, void *el)
  */
 bool vect_remove(Vector *vec, unsigned int index)
 {
-	if (index >= vec->count)
+	return vect_remove_range(vec, index, 1);
+}
+
+/**
+ * Remove n elements from the given position in the vector
+ * Returns false if the range was invalid
+ * O(n)
+ */
+bool vect_remove_range(Vector *vec, unsigned int index, unsigned int n)
+{
+	if (index > vec->count || n > vec->count - index)
 		return false;
 
-	if (index == vec->count - 1)
-	{
-		return vect_pop(vec);
-	}
+	if (n == 0)
+		return true;
 
-	char *curr = vec->data + (vec->elsz * index);
-	char *next = vec->data + (vec->elsz * (index + 1));
+	size_t elsz = vec->elsz;
+	memmove(vec->data + index * elsz, vec->data + (index + n) * elsz, (vec->count - index - n) * elsz);
+	vec->count -= n;
 
-	for(int i = 0; i < vec->elsz * (vec->count - (index + 1)); i++)
+	if (vec->count < vec->size / 3)
 	{
-		*(curr + i) = *(next + i);
+		_vect_shrink(vec);
 	}
-	
-	return vect_pop(vec);
+
+	return true;
 }
 
 /**
  * Add an element into the vector
- * Returns false if the index is invalid
+ * Returns false if the index is invalid or out of memory
  * O(n)
  */
+bool vect_add(Vector *vec, unsigned int index, void *el)
+{
+	return vect_insert_n(vec, index, el, 1);
+}
+
+/**
+ * Old name of vect_add
+ */
 bool vect_insert(Vector *vec, unsigned int index, void *el)
 {
-	if (index > vec->count)
-		return false;
+	return vect_insert_n(vec, index, el, 1);
+}
 
-	if (index == vec->count)
-		return vect_push(vec, el);
+/**
+ * Add n elements into the vector
+ * Returns false if the index is invalid or out of memory
+ * O(n)
+ */
+bool vect_insert_n(Vector *vec, unsigned int index, const void *els, unsigned int n)
+{
+	if (index > vec->count || n > UINT32_MAX - vec->count)
+		return false;
 
-	char *curr = vec->data + (vec->elsz * index);
-	char *next = vec->data + (vec->elsz * (index + 1));
+	if (n == 0)
+		return vec->elsz != 0;
 
-	for (int i = vec->elsz * (vec->count - (index + 1)); i > 0; i--)
+	// els may point into the vector itself (eg. vect_extend(vec, vec)),
+	// where growing or shifting would move it
+	size_t elsz = vec->elsz;
+	void *copy = NULL;
+	uintptr_t start = (uintptr_t) vec->data;
+	if ((uintptr_t) els >= start && (uintptr_t) els < start + (size_t) vec->size * elsz)
 	{
-		*(next + i - 1) = *(curr + i - 1);
+		copy = osm_alloc(vec->alloc, n * elsz);
+		if (copy == NULL)
+			return false;
+		memcpy(copy, els, n * elsz);
+		els = copy;
 	}
 
-	vec->count++;
-
-	if (vec->size == vec->count)
+	if (!_vect_grow(vec, vec->count + n))
 	{
-		_vect_grow(vec);
+		osm_free(vec->alloc, copy);
+		return false;
 	}
 
+	if (index < vec->count)
+		memmove(vec->data + (index + n) * elsz, vec->data + index * elsz, (vec->count - index) * elsz);
+	memcpy(vec->data + index * elsz, els, n * elsz);
+	vec->count += n;
+
+	osm_free(vec->alloc, copy);
 	return true;
 }
 
+/**
+ * Free the unused capacity of the vector
+ * Returns false if the vector was invalid or out of memory
+ */
+bool vect_shrink_to_fit(Vector *vec)
+{
+	if (vec->elsz == 0)
+		return false;
+
+	// Never down to nothing, so the vector stays valid
+	unsigned int size = vec->count < VECT_INIT_CAP ? VECT_INIT_CAP : vec->count;
+	return size >= vec->size || _vect_realloc(vec, size);
+}
+
 /**
  * Clear all data from the vector
  */
 void vect_clear(Vector *vec)
 {
 	int elsz = vec->elsz;
+	OSMAllocator *alloc = vec->alloc;
 	vect_end(vec);
-	*vec = vect_init(elsz);
+	*vec = vect_init_in(elsz, alloc);
 }
 
 /**
@@ -203,8 +303,270 @@ void vect_end(Vector *vec)
 	vec->size = 0;
 	vec->count = 0;
 	vec->elsz = 0;
-	free(vec->data);
+	osm_free(vec->alloc, vec->data);
 	vec->data = NULL;
 }
 
+/**
+ * Initialize a new small vector, with its elements inside the struct
+ */
+SmallVector svect_init(unsigned int elsz)
+{
+	return svect_init_in(elsz, NULL);
+}
+
+/**
+ * Initialize a new small vector which spills to an allocator
+ */
+SmallVector svect_init_in(unsigned int elsz, OSMAllocator *alloc)
+{
+	SmallVector out = {
+		.elsz = elsz,
+		.size = elsz > 0 ? SVECT_INLINE / elsz : 0,
+		.count = 0,
+		.alloc = alloc,
+	};
 
+	return out;
+}
+
+/**
+ * Unexported function to check whether a small vector's elements are on
+ * the heap
+ */
+bool _svect_spilled(SmallVector *vec)
+{
+	return (size_t) vec->size * vec->elsz > SVECT_INLINE;
+}
+
+/**
+ * Unexported function to move the small vector's elements to a heap buffer
+ * of size elements, which must be more than fit inline
+ */
+bool _svect_resize(SmallVector *vec, unsigned int size)
+{
+	void *data;
+	if (_svect_spilled(vec))
+	{
+		data = osm_realloc(vec->alloc, vec->store.heap, (size_t) vec->size * vec->elsz, (size_t) size * vec->elsz);
+		if (data == NULL)
+			return false;
+	}
+	else
+	{
+		data = osm_alloc(vec->alloc, (size_t) size * vec->elsz);
+		if (data == NULL)
+			return false;
+		memcpy(data, vec->store.local, (size_t) vec->count * vec->elsz);
+	}
+
+	vec->store.heap = data;
+	vec->size = size;
+	return true;
+}
+
+/**
+ * Unexported function for growing the small vector to fit at least count
+ * elements, at least doubling it
+ */
+bool _svect_grow(SmallVector *vec, unsigned int count)
+{
+	if (vec->elsz == 0)
+		return false;
+
+	if (count <= vec->size)
+		return true;
+
+	unsigned int size = vec->size < VECT_INIT_CAP ? VECT_INIT_CAP : vec->size;
+	while (size < count)
+		size = size > UINT32_MAX / 2 ? count : size * 2;
+
+	return _svect_resize(vec, size);
+}
+
+/**
+ * Make room for count elements
+ * Returns false if the small vector was invalid or out of memory
+ */
+bool svect_reserve(SmallVector *vec, unsigned int count)
+{
+	if (vec->elsz == 0)
+		return false;
+
+	return count <= vec->size || _svect_resize(vec, count);
+}
+
+/**
+ * Push a new element to the end of the small vector
+ * Returns false if the small vector was invalid or out of memory
+ */
+bool svect_push(SmallVector *vec, void *el)
+{
+	return svect_add(vec, vec->count, el);
+}
+
+/**
+ * Pop an element off of the end of the small vector
+ * Returns false if there was no element to remove
+ */
+bool svect_pop(SmallVector *vec)
+{
+	if (vec->count < 1)
+		return false;
+
+	vec->count--;
+	return true;
+}
+
+/**
+ * Get an element from the small vector
+ * Returns NULL if the index is invalid
+ */
+void *svect_get(SmallVector *vec, unsigned int index)
+{
+	if (index >= vec->count)
+		return NULL;
+
+	return (char *) svect_data(vec) + (size_t) index * vec->elsz;
+}
+
+/**
+ * Set an element in the small vector
+ * If the index is outside the small vector, returns false.
+ */
+bool svect_set(SmallVector *vec, unsigned int index, void *el)
+{
+	if (index >= vec->count)
+		return false;
+
+	memcpy((char *) svect_data(vec) + (size_t) index * vec->elsz, el, vec->elsz);
+	return true;
+}
+
+/**
+ * Add an element into the small vector
+ * Returns false if the index is invalid or out of memory
+ * O(n)
+ */
+bool svect_add(SmallVector *vec, unsigned int index, void *el)
+{
+	if (index > vec->count || vec->count == UINT32_MAX)
+		return false;
+
+	// el may point into the small vector itself, where spilling or
+	// shifting would move it
+	size_t elsz = vec->elsz;
+	void *copy = NULL;
+	uintptr_t start = (uintptr_t) svect_data(vec);
+	if ((uintptr_t) el >= start && (uintptr_t) el < start + (size_t) vec->count * elsz)
+	{
+		copy = osm_alloc(vec->alloc, elsz);
+		if (copy == NULL)
+			return false;
+		memcpy(copy, el, elsz);
+		el = copy;
+	}
+
+	if (!_svect_grow(vec, vec->count + 1))
+	{
+		osm_free(vec->alloc, copy);
+		return false;
+	}
+
+	char *data = svect_data(vec);
+	if (index < vec->count)
+		memmove(data + (index + 1) * elsz, data + index * elsz, (vec->count - index) * elsz);
+	memcpy(data + index * elsz, el, elsz);
+	vec->count++;
+
+	osm_free(vec->alloc, copy);
+	return true;
+}
+
+/**
+ * Remove an element from the given position in the small vector
+ * Returns false if the index was invalid
+ * O(n)
+ */
+bool svect_remove(SmallVector *vec, unsigned int index)
+{
+	if (index >= vec->count)
+		return false;
+
+	size_t elsz = vec->elsz;
+	char *data = svect_data(vec);
+	memmove(data + index * elsz, data + (index + 1) * elsz, (vec->count - index - 1) * elsz);
+	vec->count--;
+	return true;
+}
+
+/**
+ * Copy a small vector, only allocating if the elements don't fit inline
+ * Returns false if out of memory
+ */
+bool svect_copy(SmallVector *dst, SmallVector *src)
+{
+	*dst = svect_init_in(src->elsz, src->alloc);
+	if (!svect_reserve(dst, src->count))
+		return false;
+
+	memcpy(svect_data(dst), svect_data(src), (size_t) src->count * src->elsz);
+	dst->count = src->count;
+	return true;
+}
+
+/**
+ * Move the elements back inline if they fit, otherwise free the unused
+ * capacity
+ * Returns false if the small vector was invalid or out of memory
+ */
+bool svect_shrink_to_fit(SmallVector *vec)
+{
+	if (vec->elsz == 0)
+		return false;
+
+	if (!_svect_spilled(vec))
+		return true;
+
+	void *heap = vec->store.heap;
+	if ((size_t) vec->count * vec->elsz <= SVECT_INLINE)
+	{
+		memcpy(vec->store.local, heap, (size_t) vec->count * vec->elsz);
+		osm_free(vec->alloc, heap);
+		vec->size = SVECT_INLINE / vec->elsz;
+		return true;
+	}
+
+	void *data = osm_realloc(vec->alloc, heap, (size_t) vec->size * vec->elsz, (size_t) vec->count * vec->elsz);
+	if (data == NULL)
+		return false;
+
+	vec->store.heap = data;
+	vec->size = vec->count;
+	return true;
+}
+
+/**
+ * Clear all data from the small vector
+ */
+void svect_clear(SmallVector *vec)
+{
+	unsigned int elsz = vec->elsz;
+	OSMAllocator *alloc = vec->alloc;
+	svect_end(vec);
+	*vec = svect_init_in(elsz, alloc);
+}
+
+/**
+ * Free associated data of the small vector
+ */
+void svect_end(SmallVector *vec)
+{
+	if (_svect_spilled(vec))
+		osm_free(vec->alloc, vec->store.heap);
+
+	vec->size = 0;
+	vec->count = 0;
+	vec->elsz = 0;
+	vec->store.heap = NULL;
+}
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+
+#include "osm/workers.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define WORKER_INIT_CAP 64
+
+/// The worker running on this thread (if any)
+thread_local OSMWorker *_osm_current_worker = NULL;
+
+/**
+ * Push a task to the bottom of a worker's deque, growing it if needed
+ */
+bool _osm_deque_push(OSMWorker *w, OSMTask task)
+{
+	mtx_lock(&w->lock);
+
+	if (w->bottom - w->top == w->size)
+	{
+		OSMTask *tasks = malloc(sizeof(OSMTask) * w->size * 2);
+		if (tasks == NULL)
+		{
+			mtx_unlock(&w->lock);
+			return false;
+		}
+
+		// Unwrap the ring into the new array
+		for (unsigned int i = 0; i < w->size; i++)
+			tasks[i] = w->tasks[(w->top + i) & (w->size - 1)];
+
+		free(w->tasks);
+		w->tasks = tasks;
+		w->bottom = w->size;
+		w->top = 0;
+		w->size *= 2;
+	}
+
+	w->tasks[w->bottom & (w->size - 1)] = task;
+	w->bottom++;
+
+	mtx_unlock(&w->lock);
+	return true;
+}
+
+/**
+ * Take the newest task from the bottom of a worker's own deque
+ */
+bool _osm_deque_pop(OSMWorker *w, OSMTask *out)
+{
+	bool found = false;
+	mtx_lock(&w->lock);
+
+	if (w->bottom != w->top)
+	{
+		w->bottom--;
+		*out = w->tasks[w->bottom & (w->size - 1)];
+		found = true;
+	}
+
+	mtx_unlock(&w->lock);
+	return found;
+}
+
+/**
+ * Take the oldest task from the top of another worker's deque
+ */
+bool _osm_deque_steal(OSMWorker *w, OSMTask *out)
+{
+	bool found = false;
+
+	// Don't queue up behind the owner or other thieves
+	if (mtx_trylock(&w->lock) != thrd_success)
+		return false;
+
+	if (w->bottom != w->top)
+	{
+		*out = w->tasks[w->top & (w->size - 1)];
+		w->top++;
+		found = true;
+	}
+
+	mtx_unlock(&w->lock);
+	return found;
+}
+
+/**
+ * Find the next task for a worker: its own first, then stolen
+ */
+bool _osm_worker_next(OSMWorker *w, OSMTask *out)
+{
+	if (_osm_deque_pop(w, out))
+		return true;
+
+	OSMWorkerPool *pool = w->pool;
+	for (unsigned int i = 1; i < pool->count; i++)
+	{
+		OSMWorker *victim = &pool->workers[(w->index + i) % pool->count];
+		if (_osm_deque_steal(victim, out))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Pin the calling thread to the nth cpu it is allowed to run on
+ */
+void _osm_worker_pin(unsigned int n)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+
+	int count = CPU_COUNT(&allowed);
+	if (count <= 1)
+		return;
+
+	n %= count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+
+		if (n == 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+			return;
+		}
+		n--;
+	}
+}
+
+/**
+ * Worker thread main loop
+ */
+int _osm_worker_run(void *data)
+{
+	OSMWorker *w = data;
+	OSMWorkerPool *pool = w->pool;
+	_osm_current_worker = w;
+
+	if (pool->pin)
+		_osm_worker_pin(w->index);
+
+	while (1)
+	{
+		OSMTask task;
+		if (_osm_worker_next(w, &task))
+		{
+			atomic_fetch_sub(&pool->pending, 1);
+			task.func(task.data);
+			continue;
+		}
+
+		// Nothing to do, sleep until a submit or stop.
+		// Queued tasks might sit in a deque we failed to trylock, so
+		// only sleep if there really is nothing pending.
+		mtx_lock(&pool->lock);
+		atomic_fetch_add(&pool->sleeping, 1);
+
+		while (atomic_load(&pool->pending) == 0 && !atomic_load(&pool->stopping))
+			cnd_wait(&pool->wake, &pool->lock);
+
+		atomic_fetch_sub(&pool->sleeping, 1);
+		mtx_unlock(&pool->lock);
+
+		if (atomic_load(&pool->stopping) && atomic_load(&pool->pending) == 0)
+			break;
+	}
+
+	_osm_current_worker = NULL;
+	return 0;
+}
+
+/**
+ * Free the deques of the first n workers
+ */
+void _osm_workers_free(OSMWorkerPool *pool, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++)
+	{
+		mtx_destroy(&pool->workers[i].lock);
+		free(pool->workers[i].tasks);
+	}
+	free(pool->workers);
+	pool->workers = NULL;
+}
+
+int osm_workers_init(OSMWorkerPool *pool, unsigned int count, bool pin)
+{
+	if (count == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? cpus : 1;
+	}
+
+	pool->count = count;
+	pool->pin = pin;
+	atomic_init(&pool->pending, 0);
+	atomic_init(&pool->sleeping, 0);
+	atomic_init(&pool->next, 0);
+	atomic_init(&pool->stopping, false);
+
+	if (mtx_init(&pool->lock, mtx_plain) != thrd_success)
+		return -1;
+	if (cnd_init(&pool->wake) != thrd_success)
+	{
+		mtx_destroy(&pool->lock);
+		return -1;
+	}
+
+	pool->workers = calloc(count, sizeof(OSMWorker));
+	if (pool->workers == NULL)
+		goto fail;
+
+	// Set up every deque before any thread can try to steal from it
+	for (unsigned int i = 0; i < count; i++)
+	{
+		OSMWorker *w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i;
+		w->size = WORKER_INIT_CAP;
+		w->tasks = malloc(sizeof(OSMTask) * w->size);
+
+		if (w->tasks == NULL || mtx_init(&w->lock, mtx_plain) != thrd_success)
+		{
+			free(w->tasks);
+			_osm_workers_free(pool, i);
+			goto fail;
+		}
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (thrd_create(&pool->workers[i].thread, _osm_worker_run, &pool->workers[i]) != thrd_success)
+		{
+			perror("Error creating worker thread");
+
+			// Stop the workers that did start
+			mtx_lock(&pool->lock);
+			atomic_store(&pool->stopping, true);
+			cnd_broadcast(&pool->wake);
+			mtx_unlock(&pool->lock);
+
+			for (unsigned int j = 0; j < i; j++)
+				thrd_join(pool->workers[j].thread, NULL);
+
+			_osm_workers_free(pool, count);
+			goto fail;
+		}
+	}
+
+	return 0;
+
+fail:
+	cnd_destroy(&pool->wake);
+	mtx_destroy(&pool->lock);
+	return -1;
+}
+
+int osm_workers_submit(OSMWorkerPool *pool, thrd_start_t func, void *data)
+{
+	OSMTask task = {
+		.func = func,
+		.data = data,
+	};
+
+	// Keep work on the submitting worker if possible, otherwise round robin
+	OSMWorker *w = _osm_current_worker;
+	if (w == NULL || w->pool != pool)
+		w = &pool->workers[atomic_fetch_add(&pool->next, 1) % pool->count];
+
+	// Count the task before it can be taken so pending never underflows
+	atomic_fetch_add(&pool->pending, 1);
+
+	if (!_osm_deque_push(w, task))
+	{
+		atomic_fetch_sub(&pool->pending, 1);
+		return -1;
+	}
+
+	if (atomic_load(&pool->sleeping) > 0)
+	{
+		mtx_lock(&pool->lock);
+		cnd_signal(&pool->wake);
+		mtx_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+void osm_workers_end(OSMWorkerPool *pool)
+{
+	if (pool->workers == NULL)
+		return;
+
+	mtx_lock(&pool->lock);
+	atomic_store(&pool->stopping, true);
+	cnd_broadcast(&pool->wake);
+	mtx_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < pool->count; i++)
+		thrd_join(pool->workers[i].thread, NULL);
+
+	_osm_workers_free(pool, pool->count);
+	cnd_destroy(&pool->wake);
+	mtx_destroy(&pool->lock);
+}
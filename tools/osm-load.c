@@ -0,0 +1,948 @@
+#define _GNU_SOURCE
+
+/*
+ * Load generator: simulates onboard and TCP devices and drives them from
+ * controller clients, all in one process over unix sockets and loopback.
+ *
+ * Devices listen with osm_open_onboard and osm_open_network and are served
+ * by event loops on their own threads.  Each device has integer datapoints
+ * which change at a set rate, and pushes every change to the clients
+ * streaming it.  Each client runs its own loop and keeps a window of GET and
+ * SET operations in flight on every device with the asynchronous API, and
+ * may also stream datapoints from every device.
+ *
+ * At the end it prints throughput, operation latency percentiles and the
+ * CPU time spent per frame.
+ */
+
+#include <osm/async.h>
+#include <osm/bind.h>
+#include <osm/codec.h>
+#include <osm/device.h>
+#include <osm/framer.h>
+#include <osm/frames.h>
+#include <osm/loop.h>
+#include <osm/stream.h>
+#include <osm/types.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/// Interval of the value change timers
+#define LOAD_TICK_MS 10
+/// Sub-buckets per power of two in latency histograms
+#define LOAD_HIST_SUB_BITS 5
+#define LOAD_HIST_SUB (1 << LOAD_HIST_SUB_BITS)
+#define LOAD_HIST_BUCKETS ((64 - LOAD_HIST_SUB_BITS + 1) * LOAD_HIST_SUB)
+
+typedef struct {
+	unsigned int onboard, tcp;
+	uint16_t port;
+	unsigned int datapoints;
+	double rate;                 // value changes per device per second
+	unsigned int streams;        // per device per client
+	unsigned int clients;
+	unsigned int servers;
+	unsigned int window;         // operations in flight per device per client
+	unsigned int write_pct;
+	unsigned int seconds;
+	bool compact;
+	bool json;
+} LoadOptions;
+
+/// Log-linear histogram of latencies in nanoseconds
+typedef struct {
+	uint64_t counts[LOAD_HIST_BUCKETS];
+	uint64_t total;
+} LoadHist;
+
+typedef struct LoadServer LoadServer;
+typedef struct LoadDevice LoadDevice;
+
+/**
+ * A client connection to a simulated device
+ */
+typedef struct {
+	LoadDevice *dev;
+	int fd;
+	OSMLoopHandle *handle;
+	OSMFramer framer;            // TCP only
+	OSMStreamEngine streams;
+	unsigned int max_stream;     // highest stream number opened + 1
+} LoadConn;
+
+struct LoadDevice {
+	LoadServer *server;
+	bool tcp;
+	int listen_fd;
+	char address[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	OSMFrameHeader header;
+	uint64_t *values;            // datapoint id i + 1 is values[i]
+	double pending;              // fraction of a change carried over
+	Vector conns;                // LoadConn *
+};
+
+struct LoadServer {
+	OSMLoop loop;
+	thrd_t thread;
+	Vector devices;              // LoadDevice *
+	OSMLoopHandle *timer;
+	unsigned int seed;
+
+	uint64_t frames_in, frames_out, samples_out;
+};
+
+typedef struct LoadClient LoadClient;
+
+/**
+ * One operation slot kept busy on a device
+ */
+typedef struct {
+	LoadClient *client;
+	unsigned int device;
+	uint64_t start;
+	OSMInteger value;
+} LoadSlot;
+
+/**
+ * A stream connection from a client to a device
+ */
+typedef struct {
+	LoadClient *client;
+	int fd;
+	bool tcp;
+	OSMLoopHandle *handle;
+	OSMFramer framer;
+	OSMStreamEngine streams;
+} LoadStreamConn;
+
+struct LoadClient {
+	OSMLoop loop;
+	thrd_t thread;
+	OSMAsync async;
+	OSMDevice *devices;
+	OSMDatapoint *datapoints;
+	LoadSlot *slots;
+	LoadStreamConn *stream_conns;
+	OSMLoopHandle *timer;
+	unsigned int inflight;
+	unsigned int seed;
+
+	LoadHist hist;
+	uint64_t ops, errors, samples_in;
+};
+
+static LoadOptions options = {
+	.onboard = 100,
+	.port = 21200,
+	.datapoints = 8,
+	.rate = 10,
+	.clients = 1,
+	.servers = 1,
+	.window = 4,
+	.write_pct = 10,
+	.seconds = 10,
+};
+
+static atomic_bool stopping;
+static unsigned int device_count;
+static LoadDevice *all_devices;
+
+uint64_t load_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Latency histograms
+
+unsigned int load_hist_index(uint64_t v)
+{
+	if (v < LOAD_HIST_SUB)
+		return v;
+
+	unsigned int exp = 63 - __builtin_clzll(v);
+	unsigned int sub = (v >> (exp - LOAD_HIST_SUB_BITS)) & (LOAD_HIST_SUB - 1);
+	return (exp - LOAD_HIST_SUB_BITS + 1) * LOAD_HIST_SUB + sub;
+}
+
+/**
+ * Lowest value counted in a bucket
+ */
+uint64_t load_hist_value(unsigned int index)
+{
+	if (index < LOAD_HIST_SUB)
+		return index;
+
+	unsigned int exp = index / LOAD_HIST_SUB + LOAD_HIST_SUB_BITS - 1;
+	uint64_t sub = index % LOAD_HIST_SUB;
+	return (1ull << exp) | sub << (exp - LOAD_HIST_SUB_BITS);
+}
+
+void load_hist_add(LoadHist *hist, uint64_t v)
+{
+	hist->counts[load_hist_index(v)]++;
+	hist->total++;
+}
+
+uint64_t load_hist_percentile(const LoadHist *hist, double p)
+{
+	uint64_t rank = hist->total * p / 100, seen = 0;
+	for (unsigned int i = 0; i < LOAD_HIST_BUCKETS; i++)
+	{
+		seen += hist->counts[i];
+		if (seen > rank)
+			return load_hist_value(i);
+	}
+	return 0;
+}
+
+// Simulated devices
+
+/**
+ * Send frames to a client, SEQPACKET sockets get one message per frame
+ */
+int load_send(int fd, OSMFrameOut *frames, unsigned int count)
+{
+	unsigned int sent = 0;
+	while (sent < count)
+	{
+		int n = osm_send_frames(fd, frames + sent, count - sent, 0);
+		if (n <= 0)
+			return -1;
+		sent += n;
+	}
+	return 0;
+}
+
+int load_device_stream_send(OSMFrameOut *frame, void *data)
+{
+	LoadConn *conn = data;
+	conn->dev->server->frames_out++;
+	return load_send(conn->fd, frame, 1);
+}
+
+void load_device_stream_event(OSMStreamEngine *engine, uint8_t number, int event, void *data)
+{
+	LoadConn *conn = data;
+	if (event == OSM_STREAM_EV_OPENED && number >= conn->max_stream)
+		conn->max_stream = number + 1;
+}
+
+void load_conn_close(LoadConn *conn)
+{
+	LoadDevice *dev = conn->dev;
+	for (unsigned int i = 0; i < dev->conns.count; i++)
+	{
+		if (*(LoadConn **) vect_get(&dev->conns, i) == conn)
+		{
+			vect_remove(&dev->conns, i);
+			break;
+		}
+	}
+
+	osm_loop_del(&dev->server->loop, conn->handle);
+	osm_stream_end(&conn->streams);
+	if (dev->tcp)
+		osm_framer_end(&conn->framer);
+	close(conn->fd);
+	free(conn);
+}
+
+/**
+ * Answer a GET or SET like a device would, or hand stream frames to the
+ * connection's stream engine
+ * out - filled in with the reply, payload in buf
+ * return - 1 if a reply was made, 0 if not, -1 to drop the connection
+ */
+int load_device_frame(LoadConn *conn, const uint8_t *frame, size_t len, OSMFrameOut *out, uint8_t *buf)
+{
+	LoadDevice *dev = conn->dev;
+	OSMFrameView view;
+	if (osm_frame_parse(&view, frame, len) != 0)
+		return -1;
+
+	dev->server->frames_in++;
+
+	OSMResHeader res = {
+		.res_type = view.frame_type,
+	};
+
+	switch (view.frame_type)
+	{
+		case OSM_FT_GET:
+			res.num_res = view.sub.get.num_get;
+			for (unsigned int i = 0; i < res.num_res; i++)
+			{
+				uint64_t id = osm_view_control_id(&view, i);
+				uint64_t value = id >= 1 && id <= options.datapoints ? dev->values[id - 1] : 0;
+				osm_control_set((OSMControl *)(buf + i * OSM_WIRE_CONTROL), id, value);
+			}
+			break;
+
+		case OSM_FT_SET:
+			for (unsigned int i = 0; i < view.sub.set.num_set; i++)
+			{
+				const OSMControl *control = osm_view_control(&view, i);
+				uint64_t id = osm_control_id(control);
+				if (id >= 1 && id <= options.datapoints)
+					dev->values[id - 1] = osm_control_value(control);
+			}
+			break;
+
+		default:
+			return osm_stream_handle(&conn->streams, &view) == -1 ? -1 : 0;
+	}
+
+	dev->header.frame_type = OSM_FT_RES;
+	*out = osm_frame_out(&dev->header, &res, buf, res.num_res * OSM_WIRE_CONTROL);
+	return 1;
+}
+
+void load_device_read(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	LoadConn *conn = data;
+	static thread_local uint8_t bufs[OSM_FRAME_BATCH][OSM_WIRE_FRAME_HEADER + OSM_WIRE_SUB_MAX + 255 * OSM_WIRE_CONTROL];
+	static thread_local uint8_t replies[OSM_FRAME_BATCH][255 * OSM_WIRE_CONTROL];
+	OSMFrameOut out[OSM_FRAME_BATCH];
+	unsigned int count = 0;
+
+	if (conn->dev->tcp)
+	{
+		if (osm_framer_read(&conn->framer, conn->fd) <= 0)
+		{
+			load_conn_close(conn);
+			return;
+		}
+
+		const uint8_t *frame;
+		size_t len;
+		while (osm_framer_next(&conn->framer, &frame, &len))
+		{
+			int ret = load_device_frame(conn, frame, len, &out[count], replies[count]);
+			if (ret == -1)
+			{
+				load_conn_close(conn);
+				return;
+			}
+			count += ret;
+
+			if (count == OSM_FRAME_BATCH)
+			{
+				if (load_send(conn->fd, out, count) != 0)
+				{
+					load_conn_close(conn);
+					return;
+				}
+				conn->dev->server->frames_out += count;
+				count = 0;
+			}
+		}
+	}
+	else
+	{
+		OSMFrameIn in[OSM_FRAME_BATCH];
+		for (int i = 0; i < OSM_FRAME_BATCH; i++)
+			in[i] = (OSMFrameIn) { .buf = bufs[i], .size = sizeof(bufs[i]) };
+
+		int n = osm_recv_frames(conn->fd, in, OSM_FRAME_BATCH, 0);
+		if (n <= 0 || in[0].len == 0)
+		{
+			load_conn_close(conn);
+			return;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int ret = load_device_frame(conn, in[i].buf, in[i].len, &out[count], replies[count]);
+			if (ret == -1)
+			{
+				load_conn_close(conn);
+				return;
+			}
+			count += ret;
+		}
+	}
+
+	if (count > 0)
+	{
+		if (load_send(conn->fd, out, count) != 0)
+		{
+			load_conn_close(conn);
+			return;
+		}
+		conn->dev->server->frames_out += count;
+	}
+}
+
+void load_device_accept(OSMLoop *loop, int fd, void *data)
+{
+	LoadDevice *dev = data;
+	LoadConn *conn = calloc(1, sizeof(LoadConn));
+	if (conn == NULL)
+	{
+		close(fd);
+		return;
+	}
+
+	conn->dev = dev;
+	conn->fd = fd;
+	if (dev->tcp && osm_framer_init(&conn->framer, 0) != 0)
+	{
+		close(fd);
+		free(conn);
+		return;
+	}
+
+	osm_stream_init(&conn->streams, &dev->header, load_device_stream_send, load_device_stream_event, conn);
+	osm_stream_compact(&conn->streams, options.compact);
+
+	conn->handle = osm_loop_add(loop, fd, OSM_LOOP_READ, load_device_read, NULL, conn);
+	if (conn->handle == NULL)
+	{
+		osm_stream_end(&conn->streams);
+		if (dev->tcp)
+			osm_framer_end(&conn->framer);
+		close(fd);
+		free(conn);
+		return;
+	}
+
+	vect_push(&dev->conns, &conn);
+}
+
+/**
+ * Change a datapoint and push it to every client streaming it
+ */
+void load_device_change(LoadDevice *dev, unsigned int *seed)
+{
+	unsigned int point = rand_r(seed) % options.datapoints;
+	dev->values[point] += rand_r(seed) % 7 - 3;
+
+	for (unsigned int c = 0; c < dev->conns.count; c++)
+	{
+		LoadConn *conn = *(LoadConn **) vect_get(&dev->conns, c);
+		for (unsigned int s = 0; s < conn->max_stream; s++)
+		{
+			OSMStream *stream = &conn->streams.streams[s];
+			if (stream->state != OSM_STREAM_OPEN || !stream->outgoing || stream->control_id != point + 1)
+				continue;
+
+			// Samples are dropped while a slow client holds no credits
+			if (osm_stream_credits(&conn->streams, s) > 0 &&
+				osm_stream_write_samples(&conn->streams, s, OSM_TYPE_INT, &dev->values[point], 1) == 1)
+				dev->server->samples_out++;
+		}
+	}
+}
+
+void load_server_tick(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	LoadServer *server = data;
+	for (unsigned int i = 0; i < server->devices.count; i++)
+	{
+		LoadDevice *dev = *(LoadDevice **) vect_get(&server->devices, i);
+		dev->pending += options.rate * LOAD_TICK_MS / 1000;
+		for (; dev->pending >= 1; dev->pending--)
+			load_device_change(dev, &server->seed);
+	}
+}
+
+int load_server_run(void *arg)
+{
+	LoadServer *server = arg;
+	osm_loop_run(&server->loop);
+	return 0;
+}
+
+/**
+ * Open a simulated device's listening socket
+ */
+int load_device_open(LoadDevice *dev, const char *dir, unsigned int index)
+{
+	dev->values = calloc(options.datapoints, sizeof(uint64_t));
+	dev->conns = vect_init(sizeof(LoadConn *));
+	if (dev->values == NULL)
+		return -1;
+
+	memcpy(dev->header.magic, OSM_MAGIC_FRAME, 4);
+	osm_put_le64(dev->header.uuid, 0x4c4f4144ull << 32 | index);
+
+	if (dev->tcp)
+	{
+		uint16_t port = options.port + index;
+		dev->listen_fd = osm_open_network(port, false);
+		snprintf(dev->address, sizeof(dev->address), "127.0.0.1:%u", port);
+		return dev->listen_fd < 0 ? -1 : 0;
+	}
+
+	dev->listen_fd = osm_open_onboard((char *) dir);
+	if (dev->listen_fd < 0)
+		return -1;
+
+	struct sockaddr_un name;
+	socklen_t len = sizeof(name);
+	if (getsockname(dev->listen_fd, (struct sockaddr *) &name, &len) != 0)
+		return -1;
+	snprintf(dev->address, sizeof(dev->address), "%s", name.sun_path);
+
+	// Every client connects at once when the load starts
+	listen(dev->listen_fd, SOMAXCONN);
+	return 0;
+}
+
+// Controller clients
+
+void load_client_next(LoadSlot *slot);
+
+void load_client_done(OSMAsyncOp *op, int error, void *data)
+{
+	LoadSlot *slot = data;
+	LoadClient *client = slot->client;
+
+	client->inflight--;
+	if (error == 0)
+	{
+		client->ops++;
+		load_hist_add(&client->hist, load_now() - slot->start);
+	}
+	else
+	{
+		client->errors++;
+	}
+
+	if (!atomic_load(&stopping))
+		load_client_next(slot);
+	else if (client->inflight == 0)
+		osm_loop_stop(&client->loop);
+}
+
+void load_client_next(LoadSlot *slot)
+{
+	LoadClient *client = slot->client;
+	OSMDevice *dev = &client->devices[slot->device];
+	OSMDatapoint *dat = &client->datapoints[rand_r(&client->seed) % options.datapoints];
+
+	slot->start = load_now();
+	OSMAsyncOp *op;
+	if (rand_r(&client->seed) % 100 < options.write_pct)
+	{
+		slot->value = rand_r(&client->seed);
+		op = osm_async_write(&client->async, dev, dat, &slot->value, load_client_done, slot);
+	}
+	else
+	{
+		op = osm_async_read(&client->async, dev, dat, &slot->value, load_client_done, slot);
+	}
+
+	if (op == NULL)
+		client->errors++;
+	else
+		client->inflight++;
+}
+
+int load_client_stream_send(OSMFrameOut *frame, void *data)
+{
+	LoadStreamConn *sc = data;
+	return load_send(sc->fd, frame, 1);
+}
+
+void load_client_stream_event(OSMStreamEngine *engine, uint8_t number, int event, void *data)
+{
+	LoadStreamConn *sc = data;
+	uint64_t values[64];
+	int n;
+
+	if (event != OSM_STREAM_EV_DATA)
+		return;
+
+	while ((n = osm_stream_read_samples(engine, number, OSM_TYPE_INT, values, 64)) > 0)
+		sc->client->samples_in += n;
+}
+
+void load_client_stream_read(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	LoadStreamConn *sc = data;
+	OSMFrameView view;
+	bool failed = false;
+
+	if (sc->tcp)
+	{
+		failed = osm_framer_read(&sc->framer, sc->fd) <= 0;
+
+		const uint8_t *frame;
+		size_t len;
+		while (!failed && osm_framer_next(&sc->framer, &frame, &len))
+			failed = osm_frame_parse(&view, frame, len) != 0 || osm_stream_handle(&sc->streams, &view) == -1;
+	}
+	else
+	{
+		uint8_t bufs[OSM_FRAME_BATCH][256];
+		OSMFrameIn in[OSM_FRAME_BATCH];
+		for (int i = 0; i < OSM_FRAME_BATCH; i++)
+			in[i] = (OSMFrameIn) { .buf = bufs[i], .size = sizeof(bufs[i]) };
+
+		int n = osm_recv_frames(sc->fd, in, OSM_FRAME_BATCH, 0);
+		failed = n <= 0 || in[0].len == 0;
+		for (int i = 0; !failed && i < n; i++)
+			failed = osm_frame_parse(&view, in[i].buf, in[i].len) != 0 || osm_stream_handle(&sc->streams, &view) == -1;
+	}
+
+	if (failed)
+	{
+		osm_loop_del(loop, handle);
+		sc->handle = NULL;
+	}
+}
+
+/**
+ * Open a stream connection to a device and ask for its first datapoints
+ */
+int load_client_streams(LoadClient *client, LoadStreamConn *sc, OSMDevice *dev)
+{
+	sc->client = client;
+	sc->tcp = dev->conn_type == OSM_CT_TCP;
+	sc->fd = osm_device_socket(dev, false);
+	if (sc->fd == -1)
+		return -1;
+
+	if (sc->tcp)
+		osm_tune_network(sc->fd);
+	if (sc->tcp && osm_framer_init(&sc->framer, 0) != 0)
+		return -1;
+
+	OSMFrameHeader header = { 0 };
+	memcpy(header.magic, OSM_MAGIC_FRAME, 4);
+	osm_stream_init(&sc->streams, &header, load_client_stream_send, load_client_stream_event, sc);
+	osm_stream_compact(&sc->streams, options.compact);
+
+	sc->handle = osm_loop_add(&client->loop, sc->fd, OSM_LOOP_READ, load_client_stream_read, NULL, sc);
+	if (sc->handle == NULL)
+		return -1;
+
+	for (unsigned int s = 0; s < options.streams; s++)
+	{
+		if (osm_stream_open_in(&sc->streams, s, s % options.datapoints + 1, 0, 0) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+void load_client_check(OSMLoop *loop, OSMLoopHandle *handle, void *data)
+{
+	LoadClient *client = data;
+	if (atomic_load(&stopping) && client->inflight == 0)
+		osm_loop_stop(loop);
+}
+
+int load_client_run(void *arg)
+{
+	LoadClient *client = arg;
+
+	for (unsigned int d = 0; d < device_count; d++)
+	{
+		for (unsigned int w = 0; w < options.window; w++)
+		{
+			LoadSlot *slot = &client->slots[d * options.window + w];
+			slot->client = client;
+			slot->device = d;
+			load_client_next(slot);
+		}
+
+		if (options.streams > 0 && load_client_streams(client, &client->stream_conns[d], &client->devices[d]) != 0)
+			fprintf(stderr, "osm-load: streaming from %s failed: %s\n", all_devices[d].address, strerror(errno));
+	}
+
+	client->timer = osm_loop_timer(&client->loop, 100, true, load_client_check, client);
+	osm_loop_run(&client->loop);
+	return 0;
+}
+
+int load_client_init(LoadClient *client, unsigned int index)
+{
+	client->seed = index + 1;
+	client->devices = calloc(device_count, sizeof(OSMDevice));
+	client->datapoints = calloc(options.datapoints, sizeof(OSMDatapoint));
+	client->slots = calloc((size_t) device_count * options.window, sizeof(LoadSlot));
+	client->stream_conns = calloc(device_count, sizeof(LoadStreamConn));
+	if (client->devices == NULL || client->datapoints == NULL || client->slots == NULL || client->stream_conns == NULL)
+		return -1;
+
+	for (unsigned int d = 0; d < device_count; d++)
+		client->devices[d] = osm_device_new(all_devices[d].tcp ? OSM_CT_TCP : OSM_CT_FILE, all_devices[d].address);
+
+	for (unsigned int p = 0; p < options.datapoints; p++)
+	{
+		client->datapoints[p].id = p + 1;
+		client->datapoints[p].type = OSM_TYPE_INT;
+		client->datapoints[p].flags = OSM_DDF_INPUT | OSM_DDF_OUTPUT;
+	}
+
+	if (osm_loop_init(&client->loop) != 0)
+		return -1;
+
+	// The window is kept full, so that is the depth each device needs
+	return osm_async_init(&client->async, &client->loop, options.window);
+}
+
+void load_client_end(LoadClient *client)
+{
+	osm_async_end(&client->async);
+
+	for (unsigned int d = 0; d < device_count; d++)
+	{
+		LoadStreamConn *sc = &client->stream_conns[d];
+		if (sc->client == NULL)
+			continue;
+		if (sc->handle != NULL)
+			osm_loop_del(&client->loop, sc->handle);
+		osm_stream_end(&sc->streams);
+		if (sc->tcp)
+			osm_framer_end(&sc->framer);
+		if (sc->fd >= 0)
+			close(sc->fd);
+	}
+
+	for (unsigned int d = 0; d < device_count; d++)
+		osm_device_free(&client->devices[d]);
+
+	osm_loop_end(&client->loop);
+	free(client->devices);
+	free(client->datapoints);
+	free(client->slots);
+	free(client->stream_conns);
+}
+
+// Main
+
+void load_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -o N   onboard devices (default %u)\n"
+		"  -t N   TCP devices on loopback (default %u)\n"
+		"  -P N   first TCP device port (default %u)\n"
+		"  -d N   datapoints per device (default %u)\n"
+		"  -r HZ  value changes per device per second (default %g)\n"
+		"  -s N   streams per device per client (default %u)\n"
+		"  -c N   controller clients (default %u)\n"
+		"  -S N   device server threads (default %u)\n"
+		"  -w N   operations in flight per device per client (default %u)\n"
+		"  -W PCT percentage of operations which are writes (default %u)\n"
+		"  -T S   seconds to run (default %u)\n"
+		"  -z     use compact samples on streams\n"
+		"  -j     print the results as JSON\n",
+		name, options.onboard, options.tcp, options.port, options.datapoints, options.rate,
+		options.streams, options.clients, options.servers, options.window, options.write_pct,
+		options.seconds);
+}
+
+double load_cpu_seconds(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "o:t:P:d:r:s:c:S:w:W:T:zjh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o': options.onboard = strtoul(optarg, NULL, 10); break;
+			case 't': options.tcp = strtoul(optarg, NULL, 10); break;
+			case 'P': options.port = strtoul(optarg, NULL, 10); break;
+			case 'd': options.datapoints = strtoul(optarg, NULL, 10); break;
+			case 'r': options.rate = strtod(optarg, NULL); break;
+			case 's': options.streams = strtoul(optarg, NULL, 10); break;
+			case 'c': options.clients = strtoul(optarg, NULL, 10); break;
+			case 'S': options.servers = strtoul(optarg, NULL, 10); break;
+			case 'w': options.window = strtoul(optarg, NULL, 10); break;
+			case 'W': options.write_pct = strtoul(optarg, NULL, 10); break;
+			case 'T': options.seconds = strtoul(optarg, NULL, 10); break;
+			case 'z': options.compact = true; break;
+			case 'j': options.json = true; break;
+			default:
+				load_usage(argv[0]);
+				return 2;
+		}
+	}
+
+	device_count = options.onboard + options.tcp;
+	if (device_count == 0 || options.datapoints == 0 || options.clients == 0 || options.servers == 0
+		|| options.window == 0 || options.streams > OSM_STREAM_MAX)
+	{
+		load_usage(argv[0]);
+		return 2;
+	}
+
+	// Every device takes a listening socket and two fds per client connection
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	char dir[] = "/tmp/osm-load-XXXXXX";
+	if (options.onboard > 0 && mkdtemp(dir) == NULL)
+	{
+		perror("osm-load: mkdtemp");
+		return 1;
+	}
+
+	// Devices are spread over the server loops
+	all_devices = calloc(device_count, sizeof(LoadDevice));
+	LoadServer *servers = calloc(options.servers, sizeof(LoadServer));
+	for (unsigned int s = 0; s < options.servers; s++)
+	{
+		servers[s].devices = vect_init(sizeof(LoadDevice *));
+		servers[s].seed = s + 1;
+		if (osm_loop_init(&servers[s].loop) != 0)
+		{
+			perror("osm-load: loop");
+			return 1;
+		}
+	}
+
+	for (unsigned int d = 0; d < device_count; d++)
+	{
+		LoadDevice *dev = &all_devices[d];
+		LoadServer *server = &servers[d % options.servers];
+		dev->server = server;
+		dev->tcp = d >= options.onboard;
+
+		if (load_device_open(dev, dir, d - (dev->tcp ? options.onboard : 0)) != 0 ||
+			osm_loop_listen(&server->loop, dev->listen_fd, load_device_accept, dev) == NULL)
+		{
+			fprintf(stderr, "osm-load: device %u: %s\n", d, strerror(errno));
+			return 1;
+		}
+		vect_push(&server->devices, &dev);
+	}
+
+	for (unsigned int s = 0; s < options.servers; s++)
+	{
+		if (options.rate > 0)
+			servers[s].timer = osm_loop_timer(&servers[s].loop, LOAD_TICK_MS, true, load_server_tick, &servers[s]);
+		thrd_create(&servers[s].thread, load_server_run, &servers[s]);
+	}
+
+	LoadClient *clients = calloc(options.clients, sizeof(LoadClient));
+	for (unsigned int c = 0; c < options.clients; c++)
+	{
+		if (load_client_init(&clients[c], c) != 0)
+		{
+			perror("osm-load: client");
+			return 1;
+		}
+	}
+
+	double cpu_start = load_cpu_seconds();
+	uint64_t start = load_now();
+
+	for (unsigned int c = 0; c < options.clients; c++)
+		thrd_create(&clients[c].thread, load_client_run, &clients[c]);
+
+	struct timespec duration = { .tv_sec = options.seconds };
+	thrd_sleep(&duration, NULL);
+	atomic_store(&stopping, true);
+
+	for (unsigned int c = 0; c < options.clients; c++)
+		thrd_join(clients[c].thread, NULL);
+
+	double elapsed = (load_now() - start) / 1e9;
+	double cpu = load_cpu_seconds() - cpu_start;
+
+	for (unsigned int s = 0; s < options.servers; s++)
+	{
+		osm_loop_stop(&servers[s].loop);
+		thrd_join(servers[s].thread, NULL);
+	}
+
+	// Gather the results
+	LoadHist *hist = calloc(1, sizeof(LoadHist));
+	uint64_t ops = 0, errors = 0, samples_in = 0, frames = 0, samples_out = 0;
+	for (unsigned int c = 0; c < options.clients; c++)
+	{
+		for (unsigned int i = 0; i < LOAD_HIST_BUCKETS; i++)
+			hist->counts[i] += clients[c].hist.counts[i];
+		hist->total += clients[c].hist.total;
+		ops += clients[c].ops;
+		errors += clients[c].errors;
+		samples_in += clients[c].samples_in;
+	}
+	for (unsigned int s = 0; s < options.servers; s++)
+	{
+		frames += servers[s].frames_in + servers[s].frames_out;
+		samples_out += servers[s].samples_out;
+	}
+
+	double p50 = load_hist_percentile(hist, 50) / 1e3;
+	double p99 = load_hist_percentile(hist, 99) / 1e3;
+	double p999 = load_hist_percentile(hist, 99.9) / 1e3;
+	double cpu_per_frame = frames > 0 ? cpu * 1e6 / frames : 0;
+
+	if (options.json)
+	{
+		printf("{\"devices\":%u,\"onboard\":%u,\"tcp\":%u,\"clients\":%u,\"servers\":%u,\"window\":%u,"
+			"\"streams\":%u,\"seconds\":%.3f,\"ops\":%lu,\"errors\":%lu,\"ops_per_sec\":%.0f,"
+			"\"frames\":%lu,\"frames_per_sec\":%.0f,\"samples_sent\":%lu,\"samples_received\":%lu,"
+			"\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f},\"cpu_seconds\":%.3f,\"cpu_us_per_frame\":%.3f}\n",
+			device_count, options.onboard, options.tcp, options.clients, options.servers, options.window,
+			options.streams, elapsed, ops, errors, ops / elapsed, frames, frames / elapsed,
+			samples_out, samples_in, p50, p99, p999, cpu, cpu_per_frame);
+	}
+	else
+	{
+		printf("devices      %u (%u onboard, %u tcp), %u clients, %u server threads\n",
+			device_count, options.onboard, options.tcp, options.clients, options.servers);
+		printf("operations   %lu in %.2fs, %.0f/s, %lu errors\n", ops, elapsed, ops / elapsed, errors);
+		printf("frames       %lu, %.0f/s\n", frames, frames / elapsed);
+		printf("samples      %lu sent, %lu received\n", samples_out, samples_in);
+		printf("latency      p50 %.1fus  p99 %.1fus  p999 %.1fus\n", p50, p99, p999);
+		printf("cpu          %.2fs, %.3fus per frame\n", cpu, cpu_per_frame);
+	}
+
+	for (unsigned int c = 0; c < options.clients; c++)
+		load_client_end(&clients[c]);
+
+	for (unsigned int d = 0; d < device_count; d++)
+	{
+		LoadDevice *dev = &all_devices[d];
+		while (dev->conns.count > 0)
+			load_conn_close(*(LoadConn **) vect_get(&dev->conns, dev->conns.count - 1));
+		vect_end(&dev->conns);
+		close(dev->listen_fd);
+		if (!dev->tcp)
+			unlink(dev->address);
+		free(dev->values);
+	}
+	if (options.onboard > 0)
+		rmdir(dir);
+
+	for (unsigned int s = 0; s < options.servers; s++)
+	{
+		osm_loop_end(&servers[s].loop);
+		vect_end(&servers[s].devices);
+	}
+
+	free(hist);
+	free(clients);
+	free(servers);
+	free(all_devices);
+	return 0;
+}